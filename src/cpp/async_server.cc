@@ -0,0 +1,18 @@
+#include <thread>
+
+#include "async_server.h"
+
+void kvdefs::run_event_loops(
+    const std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> &cqs) {
+  std::vector<std::thread> loops;
+  for (const auto &cq : cqs) {
+    grpc::ServerCompletionQueue *queue = cq.get();
+    loops.emplace_back([queue]() {
+      void *tag;
+      bool ok;
+      while (queue->Next(&tag, &ok))
+        static_cast<AsyncCall *>(tag)->Proceed(ok);
+    });
+  }
+  for (auto &t : loops) t.join();
+}
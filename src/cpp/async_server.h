@@ -0,0 +1,83 @@
+#ifndef KVSTORE_ASYNC_SERVER_H
+#define KVSTORE_ASYNC_SERVER_H
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+namespace kvdefs {
+
+// A call in flight on a ServerCompletionQueue, used as the queue's tag.
+// Proceed is called from the queue's polling thread each time an operation
+// on the call completes.
+class AsyncCall {
+public:
+  virtual ~AsyncCall() {}
+  virtual void Proceed(bool ok) = 0;
+};
+
+// One unary method served through the async API.
+//
+// Arm() asks the service for the next incoming call on the queue. When it
+// arrives a fresh call is armed in its place and handler runs with the
+// request, a response to fill and a finish callback. The handler may call
+// finish from any thread, so work that has to wait (a replication round, a
+// catch-up) never holds up the polling thread.
+template <class Service, class Req, class Resp>
+class AsyncUnaryCall : public AsyncCall {
+public:
+  typedef void (Service::*RequestMethod)(
+      grpc::ServerContext *, Req *, grpc::ServerAsyncResponseWriter<Resp> *,
+      grpc::CompletionQueue *, grpc::ServerCompletionQueue *, void *);
+  typedef std::function<void(grpc::Status)> Finisher;
+  typedef std::function<void(const Req &, Resp *, const Finisher &)> Handler;
+
+  static void Arm(Service *service, RequestMethod method,
+                  grpc::ServerCompletionQueue *cq, const Handler &handler) {
+    AsyncUnaryCall *call = new AsyncUnaryCall(service, method, cq, handler);
+    (service->*method)(&call->context_, &call->request_, &call->responder_,
+                       cq, cq, call);
+  }
+
+  void Proceed(bool ok) override {
+    // a failed request means the queue is shutting down, a finished call
+    // has nothing left to do
+    if (!ok || finished_) {
+      delete this;
+      return;
+    }
+
+    Arm(service_, method_, cq_, handler_);
+    finished_ = true;
+    handler_(request_, &response_, [this](grpc::Status status) {
+      responder_.Finish(response_, status, this);
+    });
+  }
+
+private:
+  AsyncUnaryCall(Service *service, RequestMethod method,
+                 grpc::ServerCompletionQueue *cq, const Handler &handler)
+      : service_(service), method_(method), cq_(cq), handler_(handler),
+        responder_(&context_), finished_(false) {}
+
+  Service *service_;
+  RequestMethod method_;
+  grpc::ServerCompletionQueue *cq_;
+  Handler handler_;
+
+  grpc::ServerContext context_;
+  Req request_;
+  Resp response_;
+  grpc::ServerAsyncResponseWriter<Resp> responder_;
+  bool finished_;
+};
+
+// Drain every queue on its own thread until the server shuts them down.
+void run_event_loops(
+    const std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> &cqs);
+
+}
+
+#endif
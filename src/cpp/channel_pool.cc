@@ -0,0 +1,49 @@
+#include "channel_pool.h"
+#include "defines.h"
+
+kvdefs::ChannelPool &kvdefs::ChannelPool::Instance() {
+  static ChannelPool pool;
+  return pool;
+}
+
+kvdefs::ChannelPool::ChannelPool() : last_sweep_(clock::now()) {}
+
+std::shared_ptr<grpc::Channel>
+kvdefs::ChannelPool::Get(const std::string &addr) {
+  const clock::time_point now = clock::now();
+  std::lock_guard<std::mutex> guard(mutex_);
+  EvictIdleLocked(now);
+
+  Entry &entry = channels_[addr];
+  if (entry.channel) {
+    grpc_connectivity_state state = entry.channel->GetState(false);
+    // a failing channel would sit in backoff, dial a fresh one instead
+    if (state == GRPC_CHANNEL_SHUTDOWN ||
+        state == GRPC_CHANNEL_TRANSIENT_FAILURE)
+      entry.channel.reset();
+  }
+  if (!entry.channel)
+    entry.channel =
+        grpc::CreateChannel(addr, grpc::InsecureChannelCredentials());
+
+  entry.last_used = now;
+  return entry.channel;
+}
+
+void kvdefs::ChannelPool::Invalidate(const std::string &addr) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  channels_.erase(addr);
+}
+
+void kvdefs::ChannelPool::EvictIdleLocked(clock::time_point now) {
+  const std::chrono::seconds idle(kChannelIdleSeconds);
+  if (now - last_sweep_ < idle / 10) return;
+  last_sweep_ = now;
+
+  for (auto it = channels_.begin(); it != channels_.end();) {
+    if (now - it->second.last_used > idle)
+      it = channels_.erase(it);
+    else
+      ++it;
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef KVSTORE_CHANNEL_POOL_H
+#define KVSTORE_CHANNEL_POOL_H
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <grpcpp/grpcpp.h>
+
+namespace kvdefs {
+
+// Process-wide cache of client channels keyed by peer address, so repeated
+// syncs, probes and redirects reuse one HTTP/2 connection per peer instead
+// of handshaking on every call.
+//
+// A channel that has shut down or keeps failing to connect is replaced on
+// the next Get, and channels nobody asked for in kChannelIdleSeconds are
+// dropped. Callers may keep the returned channel; eviction only releases the
+// pool's reference.
+class ChannelPool {
+public:
+  static ChannelPool &Instance();
+
+  std::shared_ptr<grpc::Channel> Get(const std::string &addr);
+  // forget addr's channel, the next Get dials a fresh connection
+  void Invalidate(const std::string &addr);
+
+private:
+  typedef std::chrono::steady_clock clock;
+
+  struct Entry {
+    std::shared_ptr<grpc::Channel> channel;
+    clock::time_point last_used;
+  };
+
+  ChannelPool();
+  void EvictIdleLocked(clock::time_point now);
+
+  std::mutex mutex_;
+  std::map<std::string, Entry> channels_;
+  clock::time_point last_sweep_;
+};
+
+inline std::shared_ptr<grpc::Channel> get_channel(const std::string &addr) {
+  return ChannelPool::Instance().Get(addr);
+}
+
+}
+
+#endif
@@ -0,0 +1,67 @@
+#include <cstdint>
+
+#include <zlib.h>
+
+#include "compress.h"
+#include "defines.h"
+
+namespace {
+
+// the raw length in front of a deflated value, so decoding can size its
+// buffer up front
+const std::size_t kRawLenBytes = 4;
+
+}
+
+int kvdefs::parse_codec(const std::string &name) {
+  if (name == "none") return CODEC_NONE;
+  if (name == "deflate") return CODEC_DEFLATE;
+  return -1;
+}
+
+int kvdefs::encode_value(int codec, std::size_t threshold,
+                         const std::string &raw, std::string *out) {
+  if (codec != CODEC_DEFLATE || raw.size() < threshold ||
+      raw.size() > UINT32_MAX)
+    return CODEC_NONE;
+
+  std::string buf(kRawLenBytes + compressBound(raw.size()), '\0');
+  for (std::size_t i = 0; i < kRawLenBytes; ++i)
+    buf[i] = static_cast<char>((raw.size() >> (8 * i)) & 0xFF);
+  uLongf len = buf.size() - kRawLenBytes;
+  if (compress2(reinterpret_cast<Bytef *>(&buf[kRawLenBytes]), &len,
+                reinterpret_cast<const Bytef *>(raw.data()), raw.size(),
+                Z_BEST_SPEED) != Z_OK ||
+      kRawLenBytes + len >= raw.size())
+    return CODEC_NONE;
+
+  buf.resize(kRawLenBytes + len);
+  out->swap(buf);
+  return CODEC_DEFLATE;
+}
+
+int kvdefs::decode_value(int codec, const std::string &data,
+                         std::string *out) {
+  if (codec == CODEC_NONE) {
+    *out = data;
+    return 0;
+  }
+  if (codec != CODEC_DEFLATE || data.size() < kRawLenBytes) return -1;
+
+  std::size_t raw_len = 0;
+  for (std::size_t i = 0; i < kRawLenBytes; ++i)
+    raw_len |= static_cast<std::size_t>(static_cast<unsigned char>(data[i]))
+               << (8 * i);
+  // the length comes off the wire or the disk, size nothing off a bad one
+  if (raw_len > kMaxValueBytes) return -1;
+  std::string buf(raw_len, '\0');
+  uLongf len = raw_len;
+  if (uncompress(reinterpret_cast<Bytef *>(&buf[0]), &len,
+                 reinterpret_cast<const Bytef *>(data.data()) + kRawLenBytes,
+                 data.size() - kRawLenBytes) != Z_OK ||
+      len != raw_len)
+    return -1;
+
+  out->swap(buf);
+  return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef KVSTORE_COMPRESS_H
+#define KVSTORE_COMPRESS_H
+
+#include <cstddef>
+#include <string>
+
+namespace kvdefs {
+
+// How a stored value is encoded. RequestContent.codec carries it, so an
+// unset field means raw bytes.
+enum VALUE_CODEC {
+  CODEC_NONE = 0,
+  CODEC_DEFLATE = 800  // zlib at its fastest level, after the raw length
+};
+
+// "none" or "deflate", -1 for anything else
+int parse_codec(const std::string &name);
+
+// Encode raw with codec into out if raw is at least threshold bytes and
+// encoding actually shrinks it. Returns the codec out was encoded with, or
+// CODEC_NONE with out left untouched.
+int encode_value(int codec, std::size_t threshold, const std::string &raw,
+                 std::string *out);
+// 0 on success, -1 for an unknown codec or corrupt data
+int decode_value(int codec, const std::string &data, std::string *out);
+
+}
+
+#endif
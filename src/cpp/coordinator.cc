@@ -0,0 +1,358 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include <zookeeper/zookeeper.h>
+
+#include "coordinator.h"
+
+namespace {
+
+int from_zk(int rc) {
+  switch (rc) {
+  case ZOK: return kvdefs::COORD_OK;
+  case ZNONODE: return kvdefs::COORD_NONODE;
+  case ZNODEEXISTS: return kvdefs::COORD_NODEEXISTS;
+  case ZBADVERSION: return kvdefs::COORD_BADVERSION;
+  }
+  return kvdefs::COORD_FAILED;
+}
+
+// session events need no handling, child watches carry their own watcher
+void zk_session_watcher(zhandle_t *zh, int type, int state, const char *path,
+                        void *ctx) {}
+
+void zk_children_completion(int rc, const String_vector *strings,
+                            const void *data) {}
+
+}
+
+struct kvdefs::ZkCoordinator::Watch {
+  zhandle_t *zh;
+  std::string path;
+  Coordinator::Watcher watcher;
+
+  // zookeeper watches fire once, re-arm after every change. Session events
+  // leave the watch in place.
+  static void Fire(zhandle_t *zh, int type, int state, const char *path,
+                   void *ctx) {
+    if (type != ZOO_CHILD_EVENT) return;
+    Watch *watch = static_cast<Watch *>(ctx);
+    watch->watcher();
+    watch->Arm();
+  }
+
+  void Arm() {
+    zoo_awget_children(zh, path.c_str(), Fire, this, zk_children_completion,
+                       nullptr);
+  }
+};
+
+kvdefs::ZkCoordinator *kvdefs::ZkCoordinator::Connect(const std::string &hosts) {
+  zhandle_t *zh = zookeeper_init(hosts.c_str(), zk_session_watcher, 10000, 0,
+                                 nullptr, 0);
+  if (!zh) return nullptr;
+  return new ZkCoordinator(zh);
+}
+
+kvdefs::ZkCoordinator::ZkCoordinator(void *zh) : zh_(zh) {}
+
+kvdefs::ZkCoordinator::~ZkCoordinator() { Close(); }
+
+int kvdefs::ZkCoordinator::Create(const std::string &path,
+                                  const std::string &data, int flags,
+                                  std::string *created) {
+  int zk_flags = 0;
+  if (flags & COORD_EPHEMERAL) zk_flags |= ZOO_EPHEMERAL;
+  if (flags & COORD_SEQUENCE) zk_flags |= ZOO_SEQUENCE;
+  char buf[256] = {0};
+  int rc = zoo_create(static_cast<zhandle_t *>(zh_), path.c_str(), data.data(),
+                      data.size(), &ZOO_OPEN_ACL_UNSAFE, zk_flags, buf,
+                      sizeof(buf) - 1);
+  if (rc == ZOK && created) *created = buf[0] ? buf : path;
+  return from_zk(rc);
+}
+
+int kvdefs::ZkCoordinator::Delete(const std::string &path) {
+  return from_zk(zoo_delete(static_cast<zhandle_t *>(zh_), path.c_str(), -1));
+}
+
+int kvdefs::ZkCoordinator::Get(const std::string &path, std::string *data,
+                               CoordStat *stat) {
+  char buf[1024] = {0};
+  int buf_len = sizeof(buf) - 1;
+  struct Stat zk_stat;
+  int rc = zoo_get(static_cast<zhandle_t *>(zh_), path.c_str(), 0, buf,
+                   &buf_len, &zk_stat);
+  if (rc != ZOK) return from_zk(rc);
+  data->assign(buf, std::max(buf_len, 0));
+  if (stat) {
+    stat->version = zk_stat.version;
+    stat->cversion = zk_stat.cversion;
+  }
+  return COORD_OK;
+}
+
+int kvdefs::ZkCoordinator::Set(const std::string &path,
+                               const std::string &data, int32_t version) {
+  return from_zk(zoo_set(static_cast<zhandle_t *>(zh_), path.c_str(),
+                         data.data(), data.size(), version));
+}
+
+int kvdefs::ZkCoordinator::GetChildren(const std::string &path,
+                                       std::vector<std::string> *children) {
+  String_vector strings;
+  int rc = zoo_get_children(static_cast<zhandle_t *>(zh_), path.c_str(), 0,
+                            &strings);
+  if (rc != ZOK) return from_zk(rc);
+  children->assign(strings.data, strings.data + strings.count);
+  deallocate_String_vector(&strings);
+  return COORD_OK;
+}
+
+void kvdefs::ZkCoordinator::WatchChildren(const std::string &path,
+                                          const Watcher &watcher) {
+  std::unique_ptr<Watch> watch(new Watch);
+  watch->zh = static_cast<zhandle_t *>(zh_);
+  watch->path = path;
+  watch->watcher = watcher;
+  watch->Arm();
+  std::lock_guard<std::mutex> guard(mutex_);
+  watches_.push_back(std::move(watch));
+}
+
+void kvdefs::ZkCoordinator::Close() {
+  if (!zh_) return;
+  // no watcher runs once the handle is closed
+  zookeeper_close(static_cast<zhandle_t *>(zh_));
+  zh_ = nullptr;
+  std::lock_guard<std::mutex> guard(mutex_);
+  watches_.clear();
+}
+
+kvdefs::MemStore::MemStore()
+    : next_session_(1), next_sequence_(0), dispatching_(0), stop_(false),
+      dispatcher_(&MemStore::DispatchLoop, this) {
+  nodes_["/"];
+}
+
+kvdefs::MemStore::~MemStore() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+  }
+  events_cv_.notify_all();
+  dispatcher_.join();
+}
+
+std::string kvdefs::MemStore::Parent(const std::string &path) {
+  std::size_t pos = path.rfind('/');
+  return pos == 0 || pos == std::string::npos ? "/" : path.substr(0, pos);
+}
+
+int kvdefs::MemStore::Create(int64_t session, const std::string &path,
+                             const std::string &data, int flags,
+                             std::string *created) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  const std::string parent = Parent(path);
+  if (!nodes_.count(parent)) return COORD_NONODE;
+
+  std::string name = path;
+  if (flags & COORD_SEQUENCE) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "%010lld",
+             static_cast<long long>(next_sequence_++));
+    name += suffix;
+  }
+  if (nodes_.count(name)) return COORD_NODEEXISTS;
+
+  Node &node = nodes_[name];
+  node.data = data;
+  node.owner = (flags & COORD_EPHEMERAL) ? session : 0;
+  if (created) *created = name;
+  ChildrenChangedLocked(parent);
+  return COORD_OK;
+}
+
+int kvdefs::MemStore::Delete(const std::string &path) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = nodes_.find(path);
+  if (it == nodes_.end() || path == "/") return COORD_NONODE;
+  nodes_.erase(it);
+  ChildrenChangedLocked(Parent(path));
+  return COORD_OK;
+}
+
+int kvdefs::MemStore::Get(const std::string &path, std::string *data,
+                          CoordStat *stat) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = nodes_.find(path);
+  if (it == nodes_.end()) return COORD_NONODE;
+  *data = it->second.data;
+  if (stat) *stat = it->second.stat;
+  return COORD_OK;
+}
+
+int kvdefs::MemStore::Set(const std::string &path, const std::string &data,
+                          int32_t version) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = nodes_.find(path);
+  if (it == nodes_.end()) return COORD_NONODE;
+  if (version != -1 && version != it->second.stat.version)
+    return COORD_BADVERSION;
+  it->second.data = data;
+  ++it->second.stat.version;
+  return COORD_OK;
+}
+
+int kvdefs::MemStore::GetChildren(const std::string &path,
+                                  std::vector<std::string> *children) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (!nodes_.count(path)) return COORD_NONODE;
+  children->clear();
+  const std::string prefix = path == "/" ? "/" : path + "/";
+  for (auto it = nodes_.lower_bound(prefix);
+       it != nodes_.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+       ++it) {
+    const std::string name = it->first.substr(prefix.size());
+    if (name.size() && name.find('/') == std::string::npos)
+      children->push_back(name);
+  }
+  return COORD_OK;
+}
+
+void kvdefs::MemStore::WatchChildren(int64_t session, const std::string &path,
+                                     const Coordinator::Watcher &watcher) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  Watch watch;
+  watch.session = session;
+  watch.path = path;
+  watch.watcher = watcher;
+  watches_.push_back(watch);
+}
+
+int64_t kvdefs::MemStore::OpenSession() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return next_session_++;
+}
+
+void kvdefs::MemStore::CloseSession(int64_t session) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto owned = [session](const Watch &w) { return w.session == session; };
+  watches_.erase(std::remove_if(watches_.begin(), watches_.end(), owned),
+                 watches_.end());
+  events_.erase(std::remove_if(events_.begin(), events_.end(), owned),
+                events_.end());
+  events_cv_.wait(lock, [this, session] { return dispatching_ != session; });
+  for (auto it = nodes_.begin(); it != nodes_.end();) {
+    if (it->second.owner == session) {
+      const std::string parent = Parent(it->first);
+      it = nodes_.erase(it);
+      ChildrenChangedLocked(parent);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void kvdefs::MemStore::ChildrenChangedLocked(const std::string &parent) {
+  ++nodes_[parent].stat.cversion;
+  for (const Watch &watch : watches_)
+    if (watch.path == parent) events_.push_back(watch);
+  events_cv_.notify_all();
+}
+
+void kvdefs::MemStore::DispatchLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    events_cv_.wait(lock, [this] { return stop_ || !events_.empty(); });
+    if (stop_) return;
+    Watch watch = events_.front();
+    events_.pop_front();
+    dispatching_ = watch.session;
+    lock.unlock();
+    watch.watcher();
+    lock.lock();
+    dispatching_ = 0;
+    // a CloseSession may be waiting for this watcher to return
+    events_cv_.notify_all();
+  }
+}
+
+kvdefs::MemCoordinator::MemCoordinator(std::shared_ptr<MemStore> store)
+    : store_(store), session_(store->OpenSession()) {}
+
+kvdefs::MemCoordinator::~MemCoordinator() { Close(); }
+
+int kvdefs::MemCoordinator::Create(const std::string &path,
+                                   const std::string &data, int flags,
+                                   std::string *created) {
+  return store_->Create(session_, path, data, flags, created);
+}
+
+int kvdefs::MemCoordinator::Delete(const std::string &path) {
+  return store_->Delete(path);
+}
+
+int kvdefs::MemCoordinator::Get(const std::string &path, std::string *data,
+                                CoordStat *stat) {
+  return store_->Get(path, data, stat);
+}
+
+int kvdefs::MemCoordinator::Set(const std::string &path,
+                                const std::string &data, int32_t version) {
+  return store_->Set(path, data, version);
+}
+
+int kvdefs::MemCoordinator::GetChildren(const std::string &path,
+                                        std::vector<std::string> *children) {
+  return store_->GetChildren(path, children);
+}
+
+void kvdefs::MemCoordinator::WatchChildren(const std::string &path,
+                                           const Watcher &watcher) {
+  store_->WatchChildren(session_, path, watcher);
+}
+
+void kvdefs::MemCoordinator::Close() {
+  if (!session_) return;
+  store_->CloseSession(session_);
+  session_ = 0;
+}
+
+int kvdefs::delete_recursive(Coordinator *coord, const std::string &path) {
+  std::vector<std::string> children;
+  if (coord->GetChildren(path, &children) == COORD_OK) {
+    for (const std::string &child : children) {
+      int ret = delete_recursive(coord, path + "/" + child);
+      if (ret != COORD_OK) return ret;
+    }
+  }
+  return coord->Delete(path);
+}
+
+int kvdefs::lease_seq_block(Coordinator *coord, const std::string &path,
+                            int64_t count, int64_t *first) {
+  int ret = coord->Create(path, "", COORD_PERSISTENT, nullptr);
+  if (ret && ret != COORD_NODEEXISTS) return ret;
+
+  while (true) {
+    std::string data;
+    CoordStat stat;
+    ret = coord->Get(path, &data, &stat);
+    if (ret) return ret;
+
+    // The node's data is the highest index leased so far. Before the first
+    // lease it is empty, and cversion is the counter the old per-index
+    // sequential children were numbered from, so we never go backwards.
+    int64_t high = data.size() ? std::strtoll(data.c_str(), nullptr, 10)
+                               : stat.cversion;
+    const std::string next = std::to_string(high + count);
+    ret = coord->Set(path, next, stat.version);
+    if (ret == COORD_BADVERSION) continue;  // raced with another node, re-read
+    if (ret) return ret;
+
+    *first = high + 1;
+    return COORD_OK;
+  }
+}
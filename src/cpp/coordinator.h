@@ -0,0 +1,183 @@
+#ifndef KVSTORE_COORDINATOR_H
+#define KVSTORE_COORDINATOR_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kvdefs {
+
+enum COORD_ERR_NO {
+  COORD_OK = 0,
+  COORD_NONODE = 500,
+  COORD_NODEEXISTS,
+  COORD_BADVERSION,
+  COORD_FAILED
+};
+
+enum COORD_NODE_FLAG {
+  COORD_PERSISTENT = 0,
+  COORD_EPHEMERAL = 1,  // removed when the creating session closes
+  COORD_SEQUENCE = 2    // a unique increasing counter is appended to the name
+};
+
+struct CoordStat {
+  int32_t version;   // bumped by every Set
+  int32_t cversion;  // bumped by every change of the children
+};
+
+// The coordination calls the master and the datanodes make: a small tree of
+// versioned nodes, ephemeral nodes tied to the session, and child watches.
+// ZkCoordinator talks to a zookeeper ensemble; MemCoordinator keeps the tree
+// in memory so a whole cluster can run inside one process.
+//
+// Every call returns a COORD_ERR_NO. Watchers run on the coordinator's event
+// thread and stay armed until Close.
+class Coordinator {
+public:
+  typedef std::function<void()> Watcher;
+
+  virtual ~Coordinator() {}
+
+  // created receives the final name of a COORD_SEQUENCE node, may be null
+  virtual int Create(const std::string &path, const std::string &data,
+                     int flags, std::string *created) = 0;
+  virtual int Delete(const std::string &path) = 0;
+  virtual int Get(const std::string &path, std::string *data,
+                  CoordStat *stat) = 0;
+  // version -1 sets unconditionally
+  virtual int Set(const std::string &path, const std::string &data,
+                  int32_t version) = 0;
+  virtual int GetChildren(const std::string &path,
+                          std::vector<std::string> *children) = 0;
+  // call watcher whenever a child of path is created or deleted
+  virtual void WatchChildren(const std::string &path,
+                             const Watcher &watcher) = 0;
+  // end the session, its ephemeral nodes go away
+  virtual void Close() = 0;
+};
+
+// Coordinator backed by the zookeeper C client.
+class ZkCoordinator : public Coordinator {
+public:
+  // null if the client could not be set up
+  static ZkCoordinator *Connect(const std::string &hosts);
+  ~ZkCoordinator() override;
+
+  int Create(const std::string &path, const std::string &data, int flags,
+             std::string *created) override;
+  int Delete(const std::string &path) override;
+  int Get(const std::string &path, std::string *data,
+          CoordStat *stat) override;
+  int Set(const std::string &path, const std::string &data,
+          int32_t version) override;
+  int GetChildren(const std::string &path,
+                  std::vector<std::string> *children) override;
+  void WatchChildren(const std::string &path,
+                     const Watcher &watcher) override;
+  void Close() override;
+
+  struct Watch;
+
+private:
+  explicit ZkCoordinator(void *zh);
+
+  void *zh_;  // zhandle_t, kept opaque so users need no zookeeper headers
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Watch>> watches_;
+};
+
+// The shared node tree behind MemCoordinator sessions. Watchers are queued
+// and run on the store's own event thread, never under its lock, just like
+// zookeeper's. Once CloseSession returns none of the session's watchers runs
+// anymore.
+class MemStore {
+public:
+  MemStore();
+  ~MemStore();
+
+  int Create(int64_t session, const std::string &path, const std::string &data,
+             int flags, std::string *created);
+  int Delete(const std::string &path);
+  int Get(const std::string &path, std::string *data, CoordStat *stat);
+  int Set(const std::string &path, const std::string &data, int32_t version);
+  int GetChildren(const std::string &path, std::vector<std::string> *children);
+  void WatchChildren(int64_t session, const std::string &path,
+                     const Coordinator::Watcher &watcher);
+  int64_t OpenSession();
+  void CloseSession(int64_t session);
+
+private:
+  struct Node {
+    Node() : owner(0) {
+      stat.version = 0;
+      stat.cversion = 0;
+    }
+    std::string data;
+    CoordStat stat;
+    int64_t owner;  // session of an ephemeral node, 0 if persistent
+  };
+  struct Watch {
+    int64_t session;
+    std::string path;
+    Coordinator::Watcher watcher;
+  };
+
+  static std::string Parent(const std::string &path);
+  void ChildrenChangedLocked(const std::string &parent);
+  void DispatchLoop();
+
+  std::mutex mutex_;
+  std::map<std::string, Node> nodes_;
+  std::vector<Watch> watches_;
+  int64_t next_session_;
+  int64_t next_sequence_;
+
+  std::condition_variable events_cv_;
+  std::deque<Watch> events_;
+  int64_t dispatching_;  // session whose watcher runs right now, 0 if none
+  bool stop_;
+  std::thread dispatcher_;
+};
+
+// One session on a MemStore, each node of an embedded cluster opens its own
+// so its ephemeral nodes vanish when it leaves.
+class MemCoordinator : public Coordinator {
+public:
+  explicit MemCoordinator(std::shared_ptr<MemStore> store);
+  ~MemCoordinator() override;
+
+  int Create(const std::string &path, const std::string &data, int flags,
+             std::string *created) override;
+  int Delete(const std::string &path) override;
+  int Get(const std::string &path, std::string *data,
+          CoordStat *stat) override;
+  int Set(const std::string &path, const std::string &data,
+          int32_t version) override;
+  int GetChildren(const std::string &path,
+                  std::vector<std::string> *children) override;
+  void WatchChildren(const std::string &path,
+                     const Watcher &watcher) override;
+  void Close() override;
+
+private:
+  std::shared_ptr<MemStore> store_;
+  int64_t session_;
+};
+
+int delete_recursive(Coordinator *coord, const std::string &path);
+// reserve count consecutive indices from the counter kept at path,
+// the first one is returned through first
+int lease_seq_block(Coordinator *coord, const std::string &path,
+                    int64_t count, int64_t *first);
+
+}
+
+#endif
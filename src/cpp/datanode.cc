@@ -0,0 +1,2158 @@
+#include <memory>
+#include <string>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <set>
+
+#include <google/protobuf/arena.h>
+
+#include "async_server.h"
+#include "channel_pool.h"
+#include "datanode.h"
+#include "logger.h"
+#include "lsm_engine.h"
+#include "snapshot.h"
+
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/health_check_service_interface.h>
+#include <grpcpp/ext/proto_server_reflection_plugin.h>
+
+namespace {
+
+// delta passes over keys written during the copy before writes are fenced
+const int kMigrationDeltaPasses = 3;
+
+// arena bytes reserved per client write of a round, enough for its
+// RequestContent and short key and value
+const std::size_t kArenaBytesPerWrite = 256;
+
+typedef std::function<void(grpc::Status)> Finisher;
+
+// A SyncContent allocated, repeated fields and strings included, from an
+// arena of its own, which is released with the last reference to it.
+struct ArenaEntry {
+  explicit ArenaEntry(const google::protobuf::ArenaOptions &opts)
+      : arena(opts),
+        ent(google::protobuf::Arena::CreateMessage<kvStore::SyncContent>(
+            &arena)) {}
+  google::protobuf::Arena arena;
+  kvStore::SyncContent *ent;
+};
+
+// an empty entry whose first arena block has room for bytes
+std::shared_ptr<kvStore::SyncContent> new_arena_entry(std::size_t bytes) {
+  google::protobuf::ArenaOptions opts;
+  opts.start_block_size = bytes;
+  opts.max_block_size = std::max(bytes, opts.max_block_size);
+  std::shared_ptr<ArenaEntry> holder = std::make_shared<ArenaEntry>(opts);
+  return std::shared_ptr<kvStore::SyncContent>(holder, holder->ent);
+}
+
+class SyncRequester {
+public:
+  SyncRequester(std::shared_ptr<grpc::Channel> channel)
+      : stub_(kvStore::KvNodeService::NewStub(channel)) {}
+
+  // Ship ents over one SyncStream call, cut into SyncBatch messages. Write
+  // blocks while the peer's flow-control window is full, so a slow peer
+  // throttles us instead of queueing the whole tail in memory.
+  int DoSyncStream(const std::vector<std::string> &ents) {
+    kvStore::SyncResult reply;
+    grpc::ClientContext context;
+    std::unique_ptr<grpc::ClientWriter<kvStore::SyncBatch>> writer(
+        stub_->SyncStream(&context, &reply));
+
+    kvStore::SyncBatch batch;
+    std::size_t batch_bytes = 0;
+    bool broken = false;
+    for (std::size_t i = 0; i < ents.size() && !broken; ++i) {
+      if (!batch.add_ents()->ParseFromString(ents[i])) {
+        broken = true;
+        break;
+      }
+      batch_bytes += ents[i].size();
+      if (batch.ents_size() >= static_cast<int>(kvdefs::kSyncBatchEntries) ||
+          batch_bytes >= kvdefs::kSyncBatchBytes || i + 1 == ents.size()) {
+        broken = !writer->Write(batch);
+        batch.Clear();
+        batch_bytes = 0;
+      }
+    }
+    writer->WritesDone();
+    grpc::Status status = writer->Finish();
+
+    if (status.ok() && !broken) {
+      return reply.err();
+    } else {
+      KV_LOG(WARN) << "RPC failed: " << status.error_code() << ": "
+                   << status.error_message();
+      return kvdefs::SYNC_FAIL;
+    }
+  }
+
+  int DoInstallSnapshot(const kvStore::SnapshotChunk &chunk) {
+    kvStore::SyncResult reply;
+    grpc::ClientContext context;
+
+    grpc::Status status = stub_->InstallSnapshot(&context, chunk, &reply);
+
+    if (status.ok()) {
+      return reply.err();
+    } else {
+      KV_LOG(WARN) << "RPC failed: " << status.error_code() << ": "
+                   << status.error_message();
+      return kvdefs::SYNC_FAIL;
+    }
+  }
+
+  int64_t RequestLogVersion() {
+    kvStore::RequestContent request;
+    request.set_op(kvdefs::LOGVERSION);
+
+    kvStore::RequestResult reply;
+    grpc::ClientContext context;
+    // a hung peer must not hold the replication lock of a catch-up forever
+    context.set_deadline(std::chrono::system_clock::now() +
+                         std::chrono::milliseconds(kvdefs::kProbeTimeoutMs));
+
+    grpc::Status status = stub_->Request(&context, request, &reply);
+
+    if (status.ok() && reply.err() == kvdefs::OK) {
+      return std::stoll(reply.value());
+    } else {
+      KV_LOG(WARN) << "request version failed";
+      return -1;
+    }
+  }
+
+  // 0 once every write of batch took effect, deleting a missing key counts
+  int DoMultiRequest(const kvStore::MultiRequestContent &batch) {
+    kvStore::MultiRequestResult reply;
+    grpc::ClientContext context;
+
+    grpc::Status status = stub_->MultiRequest(&context, batch, &reply);
+
+    if (!status.ok()) {
+      KV_LOG(WARN) << "RPC failed: " << status.error_code() << ": "
+                   << status.error_message();
+      return -1;
+    }
+    for (const auto &result : reply.results())
+      if (result.err() != kvdefs::OK && result.err() != kvdefs::NOTFOUND)
+        return -1;
+    return 0;
+  }
+
+private:
+  std::unique_ptr<kvStore::KvNodeService::Stub> stub_;
+};
+
+// Ships moving keys to the groups owning them under a new ring, batched per
+// group into MultiRequests of kScanChunkKeys writes.
+class KeyMover {
+public:
+  KeyMover(const kvStore::RouteTable &table, const kvdefs::HashRing &ring)
+      : ring_(ring), failed_(false) {
+    for (const auto &entry : table.entries()) addrs_[entry.node()] = entry.addr();
+  }
+
+  // PUT key with version at its new owner, DELETE it there if version is
+  // null or expired. The new owner takes the PUT like any client's: the
+  // value goes out decoded and the expiry as the TTL left of it.
+  void Move(const std::string &key, const kvdefs::Version *version) {
+    const std::string &node = ring_.NodeFor(key);
+    kvStore::MultiRequestContent &batch = pending_[node];
+    kvStore::RequestContent *req = batch.add_reqs();
+    req->set_key(key);
+    const int64_t now = kvdefs::now_ms();
+    if (version && !version->Expired(now)) {
+      req->set_op(kvdefs::PUT);
+      if (kvdefs::decode_value(version->codec, version->value,
+                               req->mutable_value())) {
+        KV_LOG(ERROR) << "cannot decode value of " << key;
+        failed_ = true;
+      }
+      if (version->expire_at) req->set_ttl_ms(version->expire_at - now);
+    } else {
+      req->set_op(kvdefs::DELETE);
+    }
+    if (batch.reqs_size() >= static_cast<int>(kvdefs::kScanChunkKeys))
+      Send(node, &batch);
+  }
+
+  // send what is still pending, 0 if every write so far went through
+  int Flush() {
+    for (auto &e : pending_)
+      if (e.second.reqs_size()) Send(e.first, &e.second);
+    return failed_ ? -1 : 0;
+  }
+
+  bool Failed() const { return failed_; }
+
+private:
+  void Send(const std::string &node, kvStore::MultiRequestContent *batch) {
+    auto it = addrs_.find(node);
+    if (failed_ || it == addrs_.end()) {
+      failed_ = true;
+    } else {
+      SyncRequester client(kvdefs::get_channel(it->second));
+      if (client.DoMultiRequest(*batch)) {
+        KV_LOG(ERROR) << "failed moving keys to " << it->second;
+        failed_ = true;
+      }
+    }
+    batch->Clear();
+  }
+
+  const kvdefs::HashRing &ring_;
+  std::map<std::string, std::string> addrs_;
+  std::map<std::string, kvStore::MultiRequestContent> pending_;
+  bool failed_;
+};
+
+// finish, after recording the time since now in latency
+Finisher timed(kvdefs::Histogram *latency, const Finisher &finish) {
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  return [latency, start, finish](grpc::Status status) {
+    latency->Record(std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count());
+    finish(status);
+  };
+}
+
+// finish, once all parts of a call reported, with the first error
+Finisher join_finish(int parts, const Finisher &finish) {
+  struct Join {
+    std::mutex mutex;
+    int left;
+    grpc::Status status;
+  };
+  std::shared_ptr<Join> join = std::make_shared<Join>();
+  join->left = parts;
+  return [join, finish](grpc::Status status) {
+    grpc::Status ret;
+    {
+      std::lock_guard<std::mutex> guard(join->mutex);
+      if (!status.ok() && join->status.ok()) join->status = status;
+      if (--join->left) return;
+      ret = join->status;
+    }
+    finish(ret);
+  };
+}
+
+// Run fn and block until it reports through its finisher, for the sync
+// service whose handlers must return the final status.
+grpc::Status WaitFinish(const std::function<void(const Finisher &)> &fn) {
+  // writes complete on the committer thread, wait for ours here
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool done = false;
+  grpc::Status ret;
+  fn([&](grpc::Status status) {
+    std::lock_guard<std::mutex> guard(mutex);
+    ret = status;
+    done = true;
+    cv.notify_one();
+  });
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&done] { return done; });
+  return ret;
+}
+
+}
+
+// The gRPC face of a DataNode. The async server wraps it in WithAsyncMethod_
+// templates, which need it default constructible, so the node is bound after.
+class kvdefs::DataNode::ServiceImpl : public kvStore::KvNodeService::Service {
+public:
+  ServiceImpl() : node_(nullptr) {}
+  void Bind(DataNode *node) { node_ = node; }
+
+private:
+  grpc::Status SayHello(grpc::ServerContext *context,
+                        const kvStore::HelloRequest *request,
+                        kvStore::HelloReply *reply) override {
+    std::string suffix("datanode");
+    reply->set_message(request->name() + suffix);
+    return grpc::Status::OK;
+  }
+
+  grpc::Status Request(grpc::ServerContext *context,
+                       const kvStore::RequestContent *req,
+                       kvStore::RequestResult *result) override {
+    DataNode *node = node_;
+    return WaitFinish([node, req, result](const Finisher &finish) {
+      node->HandleRequest(*req, result, finish);
+    });
+  }
+
+  grpc::Status MultiRequest(grpc::ServerContext *context,
+                            const kvStore::MultiRequestContent *batch,
+                            kvStore::MultiRequestResult *results) override {
+    DataNode *node = node_;
+    return WaitFinish([node, batch, results](const Finisher &finish) {
+      node->HandleMultiRequest(*batch, results, finish);
+    });
+  }
+
+  grpc::Status Sync(grpc::ServerContext *context,
+                    const kvStore::SyncContent *ent,
+                    kvStore::SyncResult *result) override {
+    return node_->HandleSync(*ent, result);
+  }
+
+  grpc::Status MultiSync(grpc::ServerContext *context,
+                         const kvStore::SyncBatch *batch,
+                         kvStore::SyncResult *result) override {
+    return node_->HandleMultiSync(*batch, result);
+  }
+
+  // Stream our part of the range in kScanChunkKeys chunks. Write waits for
+  // the client to drain its flow-control window, so a slow reader paces the
+  // scan instead of buffering it here.
+  grpc::Status Scan(grpc::ServerContext *context,
+                    const kvStore::ScanRequest *req,
+                    grpc::ServerWriter<kvStore::ScanChunk> *writer) override {
+    ScopedTimer timer(node_->metrics_.GetHistogram("op.scan_us"));
+    std::string start = std::max(req->start(), req->prefix());
+    std::string end = req->end();
+    const std::string prefix_end = kvdefs::prefix_end(req->prefix());
+    if (!prefix_end.empty() && (end.empty() || prefix_end < end))
+      end = prefix_end;
+    if (!end.empty() && end <= start) return grpc::Status::OK;
+
+    kvStore::ScanChunk chunk;
+    bool ok = true;
+    std::string corrupt;  // the key whose value could not be decoded
+    const int64_t now = kvdefs::now_ms();
+    // the limit counts live keys, so expired ones are skipped here rather
+    // than by the engine's own limit
+    const std::size_t limit = std::max<int64_t>(req->limit(), 0);
+    std::size_t emitted = 0;
+    const int scanned = node_->dict_->Scan(
+        start, end, 0, [&](const std::string &key, const Version &version) {
+          if (version.Expired(now)) return true;
+          if (limit && emitted++ == limit) return false;
+          kvStore::RequestContent *kv = chunk.add_kvs();
+          kv->set_key(key);
+          if (decode_value(version.codec, version.value,
+                           kv->mutable_value())) {
+            KV_LOG(ERROR) << "cannot decode value of " << key;
+            corrupt = key;
+            return ok = false;
+          }
+          if (chunk.kvs_size() >=
+              static_cast<int>(kvdefs::kScanChunkKeys)) {
+            ok = writer->Write(chunk) && !context->IsCancelled();
+            chunk.Clear();
+          }
+          return ok;
+        });
+    // a stream cut short must not pass for the whole range
+    if (!corrupt.empty())
+      return grpc::Status(grpc::StatusCode::DATA_LOSS,
+                          "cannot decode value of " + corrupt);
+    if (scanned)
+      return grpc::Status(grpc::StatusCode::DATA_LOSS,
+                          "cannot read the whole range");
+    if (ok && chunk.kvs_size()) writer->Write(chunk);
+    return grpc::Status::OK;
+  }
+
+  // Every batch goes to the log, the wal and dict under one log_mutex_
+  // acquisition, and the stream is acked after one wal sync covering them
+  // all. Entries we already hold are skipped, so a catch-up overlapping
+  // live replication is harmless. A failed node or one installing a
+  // snapshot takes none of it.
+  grpc::Status SyncStream(grpc::ServerContext *context,
+                          grpc::ServerReader<kvStore::SyncBatch> *reader,
+                          kvStore::SyncResult *result) override {
+    ScopedTimer timer(node_->metrics_.GetHistogram("op.sync_stream_us"));
+    kvStore::SyncBatch batch;
+    std::size_t applied = 0, wal_seq = 0;
+    while (reader->Read(&batch)) {
+      std::unique_lock<std::mutex> lock = node_->LockLog();
+      if (node_->failed_) {
+        result->set_err(kvdefs::SYNC_FAIL);
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "node failed");
+      }
+      if (node_->installing_) {
+        result->set_err(kvdefs::SYNC_FAIL);
+        return grpc::Status::OK;
+      }
+      applied += node_->AppendLogBatch(batch, &wal_seq);
+      node_->MaybeSnapshot();
+    }
+    if (node_->failed_ || node_->WaitPersisted(wal_seq)) {
+      result->set_err(kvdefs::SYNC_FAIL);
+      return grpc::Status(grpc::StatusCode::UNAVAILABLE, "wal failed");
+    }
+    KV_LOG(INFO) << "applied " << applied << " streamed log entries";
+    result->set_err(kvdefs::SYNC_SUCC);
+    return grpc::Status::OK;
+  }
+
+  grpc::Status InstallSnapshot(grpc::ServerContext *context,
+                               const kvStore::SnapshotChunk *chunk,
+                               kvStore::SyncResult *result) override {
+    DataNode *node = node_;
+    ScopedTimer timer(node->metrics_.GetHistogram("op.install_snapshot_us"));
+    std::unique_lock<std::mutex> lock = node->LockLog();
+    // An install that fails part way drops what of the snapshot made it
+    // into dict: empty, we are at index 0 and the primary's next catch-up
+    // starts over, while a partial snapshot would be served as ours.
+    auto abandon = [node, result]() -> grpc::Status {
+      if (node->installing_) {
+        node->dict_->Clear();
+        std::lock_guard<std::mutex> guard(node->expiry_mutex_);
+        node->expiry_.Clear(kvdefs::now_ms());
+        node->installing_ = false;
+        KV_LOG(WARN) << "abandoned snapshot install";
+      }
+      result->set_err(kvdefs::SYNC_FAIL);
+      return grpc::Status::OK;
+    };
+    // a snapshot older than our own log would roll us back
+    if (chunk->index() <= node->LastLogIndex()) return abandon();
+
+    // The chunks stream straight into dict, which serves no reads until
+    // the last one is in. Our log and wal go with the old content, so a
+    // restart in between comes back empty or at our last checkpoint.
+    // wait out a checkpoint being written, then void it
+    std::lock_guard<std::mutex> checkpoint_guard(node->checkpoint_mutex_);
+    if (chunk->first()) {
+      ++node->snapshot_generation_;
+      node->installing_ = true;
+      node->dict_->Clear();
+      {
+        std::lock_guard<std::mutex> guard(node->expiry_mutex_);
+        node->expiry_.Clear(kvdefs::now_ms());
+      }
+      node->log_.Clear();
+      node->snapshot_index_ = 0;
+      node->log_floor_ = 0;
+      if (node->wal_.IsOpen() && node->wal_.Reset()) return abandon();
+    } else if (!node->installing_) {
+      result->set_err(kvdefs::SYNC_FAIL);
+      return grpc::Status::OK;
+    }
+    for (const auto &kv : chunk->kvs()) {
+      node->dict_->Put(kv.key(), kv.value(), chunk->index(), kv.codec(),
+                       kv.expire_at());
+      if (kv.expire_at()) node->TrackExpiry(kv.key(), kv.expire_at());
+    }
+
+    if (chunk->last()) {
+      if (node->dict_->Checkpoint(chunk->index())) return abandon();
+      node->snapshot_index_ = chunk->index();
+      node->log_floor_ = chunk->index();
+      node->SetApplied(chunk->index());
+      node->installing_ = false;
+      KV_LOG(INFO) << "installed snapshot at " << node->snapshot_index_;
+    }
+
+    result->set_err(kvdefs::SYNC_SUCC);
+    return grpc::Status::OK;
+  }
+
+  grpc::Status Stats(grpc::ServerContext *context,
+                     const kvStore::StatsRequest *req,
+                     kvStore::StatsReply *reply) override {
+    node_->metrics_.Fill(reply);
+    if (req->text()) reply->set_text(stats_text(*reply));
+    return grpc::Status::OK;
+  }
+
+  DataNode *node_;
+};
+
+kvdefs::DataNode::DataNode(const Options &opts, Coordinator *coord)
+    : opts_(opts), coord_(coord), route_epoch_(0), is_primary_(false),
+      applied_index_(0), replicator_(&metrics_), snapshot_index_(0),
+      log_floor_(0), wal_seq_(0), snapshotting_(false), snapshot_generation_(0),
+      installing_(false), seq_next_(0), seq_end_(0), commit_stop_(false),
+      window_stop_(false), complete_stop_(false), read_index_stop_(false),
+      sync_stop_(false), migration_fenced_(false),
+      expiry_(kExpireTickMs, now_ms()), expiry_stop_(false), expiring_(0),
+      tasks_(0), stopping_(false), failed_(false) {
+  const std::map<int64_t, std::string> ops = {
+      {PUT, "put"},         {READ, "read"},   {DELETE, "delete"},
+      {LOGVERSION, "logversion"}, {PRIMARY, "primary"}, {CLONE, "clone"},
+      {NODES, "nodes"},     {MIGRATE, "migrate"}, {ROUTE, "route"},
+      {READINDEX, "readindex"}};
+  for (const auto &op : ops)
+    op_latency_[op.first] = metrics_.GetHistogram("op." + op.second + "_us");
+  multi_latency_ = metrics_.GetHistogram("op.multi_us");
+  sync_latency_ = metrics_.GetHistogram("op.sync_us");
+  round_latency_ = metrics_.GetHistogram("repl.round_us");
+  round_writes_ = metrics_.GetHistogram("repl.round_writes");
+  seq_latency_ = metrics_.GetHistogram("seq.next_us");
+  lease_latency_ = metrics_.GetHistogram("coord.lease_us");
+  log_lock_wait_ = metrics_.GetHistogram("log.lock_wait_us");
+  stale_ = metrics_.GetCounter("op.stale");
+  behind_ = metrics_.GetCounter("read.behind");
+  read_index_latency_ = metrics_.GetHistogram("read.index_us");
+  failed_rounds_ = metrics_.GetCounter("repl.failed_rounds");
+  compressed_ = metrics_.GetCounter("write.compressed");
+  compress_saved_ = metrics_.GetCounter("write.compress_saved_bytes");
+  expired_ = metrics_.GetCounter("ttl.expired");
+  if (opts_.storage_engine == ENGINE_LSM && !opts_.wal_path.empty())
+    dict_.reset(new LsmEngine(opts_.wal_path + ".lsm", kDictShardBits,
+                              &metrics_));
+  else
+    dict_.reset(new MapEngine(
+        opts_.wal_path.empty() ? "" : opts_.wal_path + ".snap",
+        kDictShardBits));
+  dict_->SetLockWaitHistogram(metrics_.GetHistogram("dict.lock_wait_us"));
+  AddGauges();
+}
+
+void kvdefs::DataNode::AddGauges() {
+  metrics_.AddGauge("dict.keys", [this]() {
+    return static_cast<int64_t>(dict_->Size());
+  });
+  metrics_.AddGauge("ttl.tracked", [this]() {
+    std::lock_guard<std::mutex> guard(expiry_mutex_);
+    return static_cast<int64_t>(expiry_.size());
+  });
+  metrics_.AddGauge("wal.syncs", [this]() {
+    return static_cast<int64_t>(wal_.SyncCount());
+  });
+  metrics_.AddGauge("log.entries", [this]() {
+    std::lock_guard<std::mutex> guard(log_mutex_);
+    return static_cast<int64_t>(log_.size());
+  });
+  metrics_.AddGauge("log.bytes", [this]() {
+    std::lock_guard<std::mutex> guard(log_mutex_);
+    return static_cast<int64_t>(log_.Bytes());
+  });
+  metrics_.AddGauge("log.last_index", [this]() {
+    std::lock_guard<std::mutex> guard(log_mutex_);
+    return LastLogIndex();
+  });
+  metrics_.AddGauge("log.applied_index", [this]() {
+    return static_cast<int64_t>(applied_index_);
+  });
+  metrics_.AddGauge("repl.backups", [this]() {
+    return static_cast<int64_t>(CurrentBackups().size());
+  });
+  metrics_.AddGauge("repl.write_queue", [this]() {
+    std::lock_guard<std::mutex> guard(batch_mutex_);
+    return static_cast<int64_t>(write_queue_.size());
+  });
+  metrics_.AddGauge("route.epoch", [this]() {
+    return static_cast<int64_t>(route_epoch_);
+  });
+  metrics_.AddGauge("route.primary", [this]() {
+    return static_cast<int64_t>(is_primary_);
+  });
+}
+
+std::unique_lock<std::mutex> kvdefs::DataNode::LockLog() {
+  std::unique_lock<std::mutex> lock(log_mutex_, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    ScopedTimer timer(log_lock_wait_);
+    lock.lock();
+  }
+  return lock;
+}
+
+kvdefs::DataNode::~DataNode() { Stop(); }
+
+int kvdefs::DataNode::Start() {
+  if (Recover()) return -1;
+
+  committer_ = std::thread(&DataNode::CommitLoop, this);
+  completer_ = std::thread(&DataNode::CompleteLoop, this);
+  read_indexer_ = std::thread(&DataNode::ReadIndexLoop, this);
+  syncer_ = std::thread(&DataNode::SyncLoop, this);
+  expirer_ = std::thread(&DataNode::ExpireLoop, this);
+  if (StartServer()) {
+    Cleanup();
+    return -1;
+  }
+
+  // the master weighs our group's share of the keys by the primary's weight,
+  // and probes us as soon as we show up, so we are already serving by then
+  znode_path_ = "/master/data" + std::to_string(opts_.id);
+  const std::string node_data = make_node_data(opts_.addr, opts_.weight);
+  int ret = coord_->Create(znode_path_, node_data, COORD_EPHEMERAL, nullptr);
+  if (ret == COORD_NODEEXISTS) {
+    ret = coord_->Create(znode_path_ + "_backup", node_data,
+                         COORD_EPHEMERAL | COORD_SEQUENCE, &znode_path_);
+  }
+  if (ret) {
+    KV_LOG(ERROR) << "Failed creating znode: " << ret;
+    Stop();
+    return -1;
+  }
+
+  coord_->WatchChildren("/master", [this]() { MembersChanged(); });
+  // pick up the members that registered before the watch was armed
+  MembersChanged();
+  return 0;
+}
+
+// Restore dict from its last checkpoint and the log tail from the wal
+// before announcing ourselves, so the master sees the recovered log version
+// when it probes this node.
+int kvdefs::DataNode::Recover() {
+  if (opts_.storage_engine == ENGINE_LSM && opts_.wal_path.empty()) {
+    KV_LOG(ERROR) << "the lsm engine needs a wal path";
+    return -1;
+  }
+  if (dict_->Open(&snapshot_index_)) return -1;
+  log_floor_ = snapshot_index_;
+  if (opts_.wal_path.empty()) return 0;
+  // the wheel is not persisted, track the recovered keys with a TTL again
+  int scanned =
+      dict_->Scan("", "", 0,
+                  [this](const std::string &key, const Version &version) {
+                    if (version.expire_at) TrackExpiry(key, version.expire_at);
+                    return true;
+                  });
+  if (scanned) {
+    KV_LOG(ERROR) << "Failed reading the recovered dict";
+    return -1;
+  }
+  SetApplied(snapshot_index_);
+
+  if (wal_.Open(opts_.wal_path, opts_.wal_policy)) return -1;
+  int ret = wal_.Replay([this](const kvStore::SyncContent &ent) {
+    // records already folded into the snapshot
+    if (ent.index() <= snapshot_index_) return;
+    log_.Append(ent.index(), ent.SerializeAsString());
+    kvStore::RequestResult result;
+    ApplyLog(ent, &result);
+  });
+  if (ret) {
+    KV_LOG(ERROR) << "Failed replaying wal " << opts_.wal_path;
+    return -1;
+  }
+  return 0;
+}
+
+// With async_threads set, Request, MultiRequest and Sync are served from one
+// completion queue and polling thread each instead of a thread per call.
+// Polling threads never block: writes go to the committer and Syncs to
+// syncer_. The remaining methods are rare or long-lived streams and stay on
+// the sync thread pool.
+int kvdefs::DataNode::StartServer() {
+  typedef kvStore::KvNodeService::WithAsyncMethod_Request<
+      kvStore::KvNodeService::WithAsyncMethod_MultiRequest<
+          kvStore::KvNodeService::WithAsyncMethod_Sync<ServiceImpl>>>
+      AsyncService;
+  typedef AsyncUnaryCall<AsyncService, kvStore::RequestContent,
+                         kvStore::RequestResult>
+      RequestCall;
+  typedef AsyncUnaryCall<AsyncService, kvStore::MultiRequestContent,
+                         kvStore::MultiRequestResult>
+      MultiRequestCall;
+  typedef AsyncUnaryCall<AsyncService, kvStore::SyncContent,
+                         kvStore::SyncResult>
+      SyncCall;
+
+  AsyncService *async_service = nullptr;
+  if (opts_.async_threads > 0) {
+    async_service = new AsyncService;
+    async_service->Bind(this);
+    service_.reset(async_service);
+  } else {
+    ServiceImpl *service = new ServiceImpl;
+    service->Bind(this);
+    service_.reset(service);
+  }
+
+  grpc::EnableDefaultHealthCheckService(true);
+  grpc::reflection::InitProtoReflectionServerBuilderPlugin();
+  grpc::ServerBuilder builder;
+  // Listen on the given address without any authentication mechanism.
+  builder.AddListeningPort(opts_.addr, grpc::InsecureServerCredentials());
+  builder.RegisterService(service_.get());
+  for (int i = 0; i < opts_.async_threads; ++i)
+    cqs_.emplace_back(builder.AddCompletionQueue());
+  server_ = builder.BuildAndStart();
+  if (!server_) {
+    KV_LOG(ERROR) << "Failed listening on " << opts_.addr;
+    return -1;
+  }
+  KV_LOG(INFO) << "Server listening on " << opts_.addr;
+
+  if (!async_service) return 0;
+  for (auto &cq : cqs_) {
+    RequestCall::Arm(async_service, &AsyncService::RequestRequest, cq.get(),
+                     [this](const kvStore::RequestContent &req,
+                            kvStore::RequestResult *result,
+                            const Finisher &finish) {
+                       HandleRequest(req, result, finish);
+                     });
+    MultiRequestCall::Arm(async_service, &AsyncService::RequestMultiRequest,
+                          cq.get(),
+                          [this](const kvStore::MultiRequestContent &batch,
+                                 kvStore::MultiRequestResult *results,
+                                 const Finisher &finish) {
+                            HandleMultiRequest(batch, results, finish);
+                          });
+    SyncCall::Arm(async_service, &AsyncService::RequestSync, cq.get(),
+                  [this](const kvStore::SyncContent &ent,
+                         kvStore::SyncResult *result, const Finisher &finish) {
+                    PendingSync s;
+                    s.ent = &ent;
+                    s.result = result;
+                    s.queued = std::chrono::steady_clock::now();
+                    s.finish = finish;
+                    QueueSync(std::move(s));
+                  });
+  }
+  event_loops_ = std::thread([this]() { run_event_loops(cqs_); });
+  return 0;
+}
+
+// Before the last member of a group leaves, clone its data to the other
+// groups so it is not lost with it.
+void kvdefs::DataNode::HandOff() {
+  if (!CurrentBackups().empty()) return;
+
+  std::vector<std::string> children;
+  if (coord_->GetChildren("/master", &children)) return;
+  for (const std::string &child : children) {
+    std::string data;
+    if (coord_->Get("/master/" + child, &data, nullptr)) continue;
+    std::string target_addr;
+    int64_t weight;
+    parse_node_data(data.c_str(), &target_addr, &weight);
+    if (target_addr != opts_.addr) {
+      KV_LOG(INFO) << "doing complete cloning to " << target_addr;
+      CatchUpPeer(target_addr);
+    }
+  }
+}
+
+void kvdefs::DataNode::Stop() {
+  {
+    std::unique_lock<std::mutex> lock(tasks_mutex_);
+    stopping_ = true;
+    tasks_cv_.wait(lock, [this] { return !tasks_; });
+  }
+  if (server_) {
+    // calls still running after the deadline are cancelled
+    server_->Shutdown(std::chrono::system_clock::now() +
+                      std::chrono::milliseconds(kSyncTimeoutMs));
+    for (auto &cq : cqs_) cq->Shutdown();
+    if (event_loops_.joinable()) event_loops_.join();
+    server_.reset();
+  }
+  Cleanup();
+}
+
+void kvdefs::DataNode::Cleanup() {
+  // before the committer, whose rounds it may be waiting on
+  {
+    std::lock_guard<std::mutex> guard(expiry_mutex_);
+    expiry_stop_ = true;
+  }
+  expiry_cv_.notify_all();
+  if (expirer_.joinable()) expirer_.join();
+  // a waiting committer would keep batch_cv_ from being destroyed, and
+  // one waiting for room among the rounds in flight would never get it
+  // once the completer stopped
+  {
+    std::lock_guard<std::mutex> guard(sent_mutex_);
+    window_stop_ = true;
+  }
+  sent_cv_.notify_all();
+  {
+    std::lock_guard<std::mutex> guard(batch_mutex_);
+    commit_stop_ = true;
+  }
+  batch_cv_.notify_all();
+  if (committer_.joinable() &&
+      committer_.get_id() != std::this_thread::get_id())
+    committer_.join();
+  // after the committer, it settles whatever the committer sent
+  {
+    std::lock_guard<std::mutex> guard(sent_mutex_);
+    complete_stop_ = true;
+  }
+  sent_cv_.notify_all();
+  if (completer_.joinable() &&
+      completer_.get_id() != std::this_thread::get_id())
+    completer_.join();
+  {
+    std::lock_guard<std::mutex> guard(read_index_mutex_);
+    read_index_stop_ = true;
+  }
+  read_index_cv_.notify_all();
+  if (read_indexer_.joinable()) read_indexer_.join();
+  {
+    std::lock_guard<std::mutex> guard(sync_mutex_);
+    sync_stop_ = true;
+  }
+  sync_cv_.notify_all();
+  if (syncer_.joinable()) syncer_.join();
+  wal_.Close();
+  coord_->Close();
+}
+
+bool kvdefs::DataNode::RunTask(const std::function<void()> &fn) {
+  {
+    std::lock_guard<std::mutex> guard(tasks_mutex_);
+    if (stopping_) return false;
+    ++tasks_;
+  }
+  std::thread([this, fn]() {
+    fn();
+    // Stop may destroy the node as soon as the count drops
+    std::lock_guard<std::mutex> guard(tasks_mutex_);
+    if (!--tasks_) tasks_cv_.notify_all();
+  }).detach();
+  return true;
+}
+
+// Serve a client request and report the outcome through finish, either
+// before returning or later from another thread. Both server modes share it.
+void kvdefs::DataNode::HandleRequest(const kvStore::RequestContent &request,
+                                     kvStore::RequestResult *result,
+                                     const Finisher &untimed_finish) {
+  const kvStore::RequestContent *req = &request;
+  KV_LOG(DEBUG) << "received request: " << req->op();
+
+  auto latency = op_latency_.find(req->op());
+  const Finisher finish = latency == op_latency_.end()
+                              ? untimed_finish
+                              : timed(latency->second, untimed_finish);
+
+  if (IsStaleRoute(*req)) {
+    stale_->Add(1);
+    result->set_err(kvdefs::STALE);
+    finish(grpc::Status::OK);
+    return;
+  }
+
+  // Immediately return result if it is read request (or maybe flush log
+  // before); Update request (put and del) should be entered into log and then
+  // do 2pc consensus.
+  if (req->op() == kvdefs::READ) {
+    if (TryServeRead(*req, result)) {
+      finish(grpc::Status::OK);
+      return;
+    }
+    PendingRead r;
+    r.reqs.push_back(req);
+    r.results.push_back(result);
+    r.finish = finish;
+    QueueReadIndex(std::move(r));
+  } else if (req->op() == kvdefs::READINDEX) {
+    // a demoted primary may miss writes, only the current one can vouch
+    result->set_index(applied_index_);
+    result->set_err(is_primary_ ? kvdefs::OK : kvdefs::FAILED);
+    finish(grpc::Status::OK);
+  } else if (req->op() == kvdefs::ROUTE) {
+    kvStore::RouteTable table;
+    if (!table.ParseFromString(req->value())) {
+      KV_LOG(ERROR) << "wrong routing table";
+      finish(grpc::Status::CANCELLED);
+      return;
+    }
+    route_epoch_ = req->epoch();
+    FollowRoute(table);
+    result->set_err(kvdefs::OK);
+    finish(grpc::Status::OK);
+  } else if (req->op() == kvdefs::NODES) {
+    // we only know ourselves, a client scanning through us directly gets
+    // just our keys
+    result->set_value(opts_.addr);
+    result->set_err(kvdefs::OK);
+    finish(grpc::Status::OK);
+  } else if (req->op() == kvdefs::LOGVERSION) {
+    {
+      std::lock_guard<std::mutex> guard(log_mutex_);
+      result->set_value(std::to_string(LastLogIndex()));
+      result->set_err(kvdefs::OK);
+    }
+    finish(grpc::Status::OK);
+  } else if (req->op() == kvdefs::PRIMARY) {
+    route_epoch_ = req->epoch();
+    {
+      // what is left of a lease from an earlier term lies below the indices
+      // the primaries since then used, backups would reject all of it
+      std::lock_guard<std::mutex> guard(seq_mutex_);
+      seq_next_ = seq_end_;
+    }
+    is_primary_ = true;
+    {
+      std::lock_guard<std::mutex> guard(primary_mutex_);
+      primary_addr_.clear();
+    }
+    kvStore::RouteTable table;
+    if (req->value().size() && table.ParseFromString(req->value()))
+      SettleMigration(table);
+    // catch-ups stream whole logs, keep them off the server threads
+    bool started = RunTask([this, finish]() {
+      // completely sync with all backups
+      for (const std::string& addr : CurrentBackups()) {
+        if (stopping_) break;
+        KV_LOG(INFO) << "doing complete sync to " << addr;
+        CatchUpPeer(addr);
+      }
+      finish(grpc::Status::OK);
+    });
+    if (!started) finish(grpc::Status(grpc::StatusCode::UNAVAILABLE, ""));
+  } else if (req->op() == kvdefs::CLONE) {
+    std::string addr = req->value();
+    if(addr.empty()) {
+      KV_LOG(ERROR) << "wrong target addr";
+      finish(grpc::Status::CANCELLED);
+      return;
+    }
+    bool started = RunTask([this, addr, finish]() {
+      KV_LOG(INFO) << "doing complete cloning to " << addr;
+      CatchUpPeer(addr);
+      finish(grpc::Status::OK);
+    });
+    if (!started) finish(grpc::Status(grpc::StatusCode::UNAVAILABLE, ""));
+  } else if (req->op() == kvdefs::MIGRATE) {
+    kvStore::RouteTable table;
+    if (!table.ParseFromString(req->value())) {
+      KV_LOG(ERROR) << "wrong routing table";
+      finish(grpc::Status::CANCELLED);
+      return;
+    }
+    // copying a group's worth of keys takes a while
+    bool started = RunTask([this, table, result, finish]() {
+      result->set_err(MigrateKeys(table) ? kvdefs::FAILED : kvdefs::OK);
+      finish(grpc::Status::OK);
+    });
+    if (!started) finish(grpc::Status(grpc::StatusCode::UNAVAILABLE, ""));
+  } else if (req->op() == kvdefs::PUT || req->op() == kvdefs::DELETE) {
+    PendingWrite w;
+    w.reqs.push_back(req);
+    w.results.push_back(result);
+    w.finish = finish;
+    SubmitWrite(std::move(w));
+  } else {
+    // EXPIRE only comes from ReclaimExpired, a client's would drop keys
+    // before their TTL ran out on every replica
+    KV_LOG(ERROR) << "rejected request with op " << req->op();
+    result->set_err(kvdefs::FAILED);
+    finish(grpc::Status::OK);
+  }
+}
+
+// A client that routed req with a table older than the one the master last
+// told us about may have picked the wrong group. Requests that came through
+// a master redirect carry no epoch and are always served.
+bool kvdefs::DataNode::IsStaleRoute(const kvStore::RequestContent &req) {
+  if (req.op() != kvdefs::READ && req.op() != kvdefs::PUT &&
+      req.op() != kvdefs::DELETE)
+    return false;
+  return req.epoch() && req.epoch() < route_epoch_;
+}
+
+// Answer req from dict unless it is a READ_INDEX read on a backup, which has
+// to wait for a read-index check first. A bounded read this backup has not
+// caught up with, or any read while a snapshot installs, is answered BEHIND,
+// the client retries on the primary. The
+// primary always answers: backups apply entries as they arrive, before the
+// primary commits them, so a client may have seen a higher index from one.
+bool kvdefs::DataNode::TryServeRead(const kvStore::RequestContent &req,
+                                    kvStore::RequestResult *result) {
+  if (is_primary_) {
+    ServeRead(req, result);
+    return true;
+  }
+  if (installing_ || (req.consistency() == kvdefs::READ_BOUNDED &&
+                      applied_index_ < req.min_index())) {
+    behind_->Add(1);
+    result->set_err(kvdefs::BEHIND);
+    return true;
+  }
+  if (req.consistency() == kvdefs::READ_INDEX) return false;
+  ServeRead(req, result);
+  return true;
+}
+
+// Writes only reach dict once their round committed, so a read always sees
+// the last committed version and never waits for a round to finish.
+void kvdefs::DataNode::ServeRead(const kvStore::RequestContent &req,
+                                 kvStore::RequestResult *result) {
+  // taken before the lookup, the value is at least this fresh
+  result->set_index(applied_index_);
+  std::shared_ptr<const Version> version;
+  if (dict_->Get(req.key(), &version)) {
+    KV_LOG(ERROR) << "cannot read " << req.key();
+    result->set_err(kvdefs::FAILED);
+  } else if (!version || version->Expired(now_ms())) {
+    result->set_err(kvdefs::NOTFOUND);
+  } else if (decode_value(version->codec, version->value,
+                          result->mutable_value())) {
+    KV_LOG(ERROR) << "cannot decode value of " << req.key();
+    result->set_err(kvdefs::FAILED);
+  } else {
+    result->set_err(kvdefs::OK);
+  }
+}
+
+void kvdefs::DataNode::QueueReadIndex(PendingRead &&r) {
+  bool queued = false;
+  {
+    std::lock_guard<std::mutex> guard(read_index_mutex_);
+    if (!read_index_stop_) {
+      read_index_queue_.push_back(std::move(r));
+      queued = true;
+    }
+  }
+  if (queued) {
+    read_index_cv_.notify_one();
+    return;
+  }
+  // shutting down, let the client ask the primary
+  for (kvStore::RequestResult *result : r.results)
+    result->set_err(kvdefs::BEHIND);
+  r.finish(grpc::Status::OK);
+}
+
+// Serve READ_INDEX reads in rounds: ask the primary for its applied index,
+// wait until we applied as much, then answer every read that was queued when
+// the round started. Reads arriving meanwhile wait for the next round, the
+// primary may have committed writes they must see since.
+void kvdefs::DataNode::ReadIndexLoop() {
+  while (true) {
+    std::vector<PendingRead> reads;
+    bool stop;
+    {
+      std::unique_lock<std::mutex> lock(read_index_mutex_);
+      read_index_cv_.wait(lock, [this] {
+        return read_index_stop_ || !read_index_queue_.empty();
+      });
+      stop = read_index_stop_;
+      reads.swap(read_index_queue_);
+    }
+
+    const bool caught_up = !stop && WaitReadIndex();
+    for (PendingRead &r : reads) {
+      for (std::size_t i = 0; i < r.reqs.size(); ++i) {
+        if (caught_up) {
+          ServeRead(*r.reqs[i], r.results[i]);
+        } else {
+          behind_->Add(1);
+          r.results[i]->set_err(kvdefs::BEHIND);
+        }
+      }
+      r.finish(grpc::Status::OK);
+    }
+    if (stop) return;
+  }
+}
+
+// true once we applied everything our primary had applied when asked
+bool kvdefs::DataNode::WaitReadIndex() {
+  ScopedTimer timer(read_index_latency_);
+  std::string primary;
+  {
+    std::lock_guard<std::mutex> guard(primary_mutex_);
+    primary = primary_addr_;
+  }
+  if (primary.empty()) return false;
+
+  kvStore::RequestContent req;
+  req.set_op(kvdefs::READINDEX);
+  kvStore::RequestResult result;
+  grpc::ClientContext context;
+  context.set_deadline(std::chrono::system_clock::now() +
+                       std::chrono::milliseconds(kProbeTimeoutMs));
+  grpc::Status status = kvStore::KvNodeService::NewStub(get_channel(primary))
+                            ->Request(&context, req, &result);
+  if (!status.ok() || result.err() != kvdefs::OK) return false;
+
+  const int64_t index = result.index();
+  std::unique_lock<std::mutex> lock(applied_mutex_);
+  return applied_cv_.wait_for(
+      lock, std::chrono::milliseconds(kSyncTimeoutMs),
+      [this, index] { return applied_index_ >= index; });
+}
+
+// The master sends its table to every backup after each membership change,
+// find our group's primary in it
+void kvdefs::DataNode::FollowRoute(const kvStore::RouteTable &table) {
+  for (const auto &entry : table.entries()) {
+    for (const auto &replica : entry.replicas()) {
+      if (replica != opts_.addr) continue;
+      is_primary_ = false;
+      std::lock_guard<std::mutex> guard(primary_mutex_);
+      primary_addr_ = entry.addr();
+      return;
+    }
+  }
+}
+
+// Reads are served straight from dict or after one read-index check, the
+// writes of the batch are queued together and committed in a single
+// replication round.
+void kvdefs::DataNode::HandleMultiRequest(
+    const kvStore::MultiRequestContent &batch,
+    kvStore::MultiRequestResult *results, const Finisher &untimed_finish) {
+  KV_LOG(DEBUG) << "received multi request of " << batch.reqs_size();
+  const Finisher finish = timed(multi_latency_, untimed_finish);
+
+  PendingWrite w;
+  PendingRead r;
+  for (const auto &req : batch.reqs()) {
+    kvStore::RequestResult *result = results->add_results();
+    if (IsStaleRoute(req)) {
+      stale_->Add(1);
+      result->set_err(kvdefs::STALE);
+    } else if (req.op() == kvdefs::READ) {
+      if (!TryServeRead(req, result)) {
+        r.reqs.push_back(&req);
+        r.results.push_back(result);
+      }
+    } else if (req.op() == kvdefs::PUT || req.op() == kvdefs::DELETE) {
+      w.reqs.push_back(&req);
+      w.results.push_back(result);
+    } else {
+      result->set_err(kvdefs::FAILED);
+    }
+  }
+
+  if (w.reqs.empty() && r.reqs.empty()) {
+    finish(grpc::Status::OK);
+    return;
+  }
+  const Finisher done =
+      w.reqs.size() && r.reqs.size() ? join_finish(2, finish) : finish;
+  if (r.reqs.size()) {
+    r.finish = done;
+    QueueReadIndex(std::move(r));
+  }
+  if (w.reqs.size()) {
+    w.finish = done;
+    SubmitWrite(std::move(w));
+  }
+}
+
+grpc::Status kvdefs::DataNode::HandleSync(const kvStore::SyncContent &sync,
+                                          kvStore::SyncResult *result) {
+  ScopedTimer timer(sync_latency_);
+  if (failed_) {
+    result->set_err(kvdefs::SYNC_FAIL);
+    return grpc::Status(grpc::StatusCode::UNAVAILABLE, "node failed");
+  }
+  // serialized once for the log and the wal, before taking log_mutex_
+  const std::string payload = sync.SerializeAsString();
+  grpc::Status ret;
+  std::size_t wal_seq = 0;
+  {
+    std::unique_lock<std::mutex> lock = LockLog();
+    ret = AppendSync(sync, payload, result, &wal_seq);
+    if (result->err() != kvdefs::SYNC_SUCC) return ret;
+    MaybeSnapshot();
+  }
+  // acked once on disk, while other appenders go on and share the sync
+  if (WaitPersisted(wal_seq)) {
+    result->set_err(kvdefs::SYNC_FAIL);
+    return grpc::Status(grpc::StatusCode::UNAVAILABLE, "wal failed");
+  }
+  return ret;
+}
+
+// Append one Sync to the log and apply it, with log_mutex_ held. *wal_seq
+// is moved up to what to hand WaitPersisted before acking it, unless
+// result->err() says it was not appended. While a snapshot installs, our
+// log tail says nothing about dict, so Syncs wait for the catch-up after.
+grpc::Status kvdefs::DataNode::AppendSync(const kvStore::SyncContent &sync,
+                                          const std::string &payload,
+                                          kvStore::SyncResult *result,
+                                          std::size_t *wal_seq) {
+  if (installing_) {
+    result->set_err(kvdefs::SYNC_FAIL);
+    return grpc::Status::OK;
+  }
+  std::size_t seq = 0;
+  const int sync_ret = AppendLog(sync.index(), payload, &seq);
+  result->set_err(sync_ret);
+  if (sync_ret != kvdefs::SYNC_SUCC) return grpc::Status::OK;
+  *wal_seq = std::max(*wal_seq, seq);
+  kvStore::RequestResult applied;
+  return ApplyLog(sync, &applied);
+}
+
+void kvdefs::DataNode::QueueSync(PendingSync &&s) {
+  bool queued = false;
+  {
+    std::lock_guard<std::mutex> guard(sync_mutex_);
+    if (!sync_stop_) {
+      sync_queue_.push_back(std::move(s));
+      queued = true;
+    }
+  }
+  if (queued) {
+    sync_cv_.notify_one();
+    return;
+  }
+  // shutting down, the primary retries or fails us over
+  s.result->set_err(kvdefs::SYNC_FAIL);
+  s.finish(grpc::Status(grpc::StatusCode::UNAVAILABLE, "node stopping"));
+}
+
+// Serve the Syncs of the async server in rounds: append everything queued
+// under one log_mutex_ acquisition, in arrival order, then ack it all after
+// one wal sync. Syncs arriving meanwhile queue for the next round and share
+// its sync.
+void kvdefs::DataNode::SyncLoop() {
+  while (true) {
+    std::vector<PendingSync> syncs;
+    bool stop;
+    {
+      std::unique_lock<std::mutex> lock(sync_mutex_);
+      sync_cv_.wait(lock,
+                    [this] { return sync_stop_ || !sync_queue_.empty(); });
+      stop = sync_stop_;
+      syncs.swap(sync_queue_);
+    }
+
+    std::vector<grpc::Status> statuses(syncs.size());
+    std::size_t wal_seq = 0;
+    bool lost = stop || failed_;
+    if (!lost && syncs.size()) {
+      // serialized before taking log_mutex_, as in HandleSync
+      std::vector<std::string> payloads;
+      payloads.reserve(syncs.size());
+      for (const PendingSync &s : syncs)
+        payloads.push_back(s.ent->SerializeAsString());
+      std::unique_lock<std::mutex> lock = LockLog();
+      for (std::size_t i = 0; i < syncs.size(); ++i)
+        statuses[i] =
+            AppendSync(*syncs[i].ent, payloads[i], syncs[i].result, &wal_seq);
+      MaybeSnapshot();
+    }
+    if (!lost) lost = WaitPersisted(wal_seq) != 0;
+    for (std::size_t i = 0; i < syncs.size(); ++i) {
+      PendingSync &s = syncs[i];
+      if (lost) {
+        s.result->set_err(kvdefs::SYNC_FAIL);
+        statuses[i] = grpc::Status(grpc::StatusCode::UNAVAILABLE,
+                                   stop ? "node stopping" : "node failed");
+      }
+      sync_latency_->Record(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now() - s.queued)
+              .count());
+      s.finish(statuses[i]);
+    }
+    if (stop) return;
+  }
+}
+
+// The entries the primary queued for us while our last Sync was in flight,
+// taken under one log_mutex_ acquisition and acked after one wal sync.
+// Entries we already hold are skipped, as in a catch-up; none are taken
+// while a snapshot installs, as in AppendSync.
+grpc::Status kvdefs::DataNode::HandleMultiSync(const kvStore::SyncBatch &batch,
+                                               kvStore::SyncResult *result) {
+  ScopedTimer timer(sync_latency_);
+  std::size_t wal_seq = 0;
+  if (!failed_) {
+    std::unique_lock<std::mutex> lock = LockLog();
+    if (installing_) {
+      result->set_err(kvdefs::SYNC_FAIL);
+      return grpc::Status::OK;
+    }
+    AppendLogBatch(batch, &wal_seq);
+    MaybeSnapshot();
+  }
+  if (failed_ || WaitPersisted(wal_seq)) {
+    result->set_err(kvdefs::SYNC_FAIL);
+    return grpc::Status(grpc::StatusCode::UNAVAILABLE, "node failed");
+  }
+  result->set_err(kvdefs::SYNC_SUCC);
+  return grpc::Status::OK;
+}
+
+// Queue client writes for the committer thread, w.finish runs once the
+// batch carrying them has committed. While a migration is fenced, writes to
+// the keys it moves wait for the master to settle where they belong.
+void kvdefs::DataNode::SubmitWrite(PendingWrite &&w) {
+  std::lock_guard<std::mutex> guard(migration_mutex_);
+  if (migration_fenced_) {
+    const std::string me = MyNode();
+    for (const kvStore::RequestContent *req : w.reqs) {
+      if (migration_ring_->NodeFor(req->key()) != me) {
+        fenced_writes_.push_back(std::move(w));
+        return;
+      }
+    }
+  }
+  EnqueueWrite(std::move(w));
+}
+
+void kvdefs::DataNode::EnqueueWrite(PendingWrite &&w) {
+  std::lock_guard<std::mutex> guard(batch_mutex_);
+  write_queue_.push_back(std::move(w));
+  batch_cv_.notify_one();
+}
+
+// Drain write_queue_ one replication round at a time: take queued calls
+// until kWriteBatchMax writes are gathered and send them to the backups as
+// a single log entry. A call is never split across rounds. Writes arriving
+// meanwhile wait for the next round, so concurrent writers share one round
+// trip to the backups. Up to kRoundsInFlight rounds are out at once, the
+// completer commits them, and no server thread ever blocks on a round.
+void kvdefs::DataNode::CommitLoop() {
+  while (true) {
+    SentRound round;
+    {
+      std::unique_lock<std::mutex> lock(batch_mutex_);
+      batch_cv_.wait(lock,
+                     [this] { return commit_stop_ || !write_queue_.empty(); });
+      if (commit_stop_) return;
+      std::size_t writes = 0;
+      while (write_queue_.size() && writes < kvdefs::kWriteBatchMax) {
+        writes += write_queue_.front().reqs.size();
+        round.batch.push_back(std::move(write_queue_.front()));
+        write_queue_.pop_front();
+      }
+    }
+    {
+      std::unique_lock<std::mutex> lock(sent_mutex_);
+      sent_cv_.wait(lock, [this] {
+        return window_stop_ || sent_rounds_.size() < kvdefs::kRoundsInFlight;
+      });
+    }
+    SendBatch(std::move(round));
+  }
+}
+
+// Commit the rounds the committer sent, in log order, and answer their
+// writers once the wal has them. Rounds whose quorum is in by the time the
+// one before them committed share its wal sync, so with rounds in flight
+// one sync covers several of them.
+void kvdefs::DataNode::CompleteLoop() {
+  while (true) {
+    std::vector<SentRound> settled;
+    std::size_t wal_seq = 0;
+    while (settled.size() < kvdefs::kRoundsInFlight) {
+      SentRound *round;
+      {
+        std::unique_lock<std::mutex> lock(sent_mutex_);
+        if (settled.empty())
+          sent_cv_.wait(lock, [this] {
+            return complete_stop_ || !sent_rounds_.empty();
+          });
+        if (sent_rounds_.empty()) break;
+        // the deque only grows at the back meanwhile
+        round = &sent_rounds_.front();
+      }
+      // rather than hold up the rounds already committed
+      if (!settled.empty() && round->ent && !round->failed &&
+          !Replicator::Settled(round->round.get()))
+        break;
+      wal_seq = std::max(wal_seq, SettleRound(round));
+      {
+        std::lock_guard<std::mutex> guard(sent_mutex_);
+        settled.push_back(std::move(sent_rounds_.front()));
+        sent_rounds_.pop_front();
+      }
+      sent_cv_.notify_all();
+    }
+    if (settled.empty()) return;
+    // writes the wal lost are not durable here, whatever a quorum took
+    const bool lost = WaitPersisted(wal_seq) != 0;
+    for (SentRound &round : settled) {
+      for (PendingWrite &w : round.batch) {
+        if (lost && round.ent)
+          for (kvStore::RequestResult *result : w.results)
+            result->set_err(kvdefs::FAILED);
+        w.finish(w.status);
+      }
+    }
+  }
+}
+
+// Send the writes of round to the backups as one entry and leave it to the
+// completer. A lone barrier only asks for the calls queued before it to
+// finish, which the completer answers in order.
+void kvdefs::DataNode::SendBatch(SentRound &&round) {
+  round.sent = std::chrono::steady_clock::now();
+  std::size_t writes = 0;
+  for (const PendingWrite &w : round.batch) writes += w.reqs.size();
+  if (!writes) {
+    {
+      std::lock_guard<std::mutex> guard(sent_mutex_);
+      sent_rounds_.push_back(std::move(round));
+    }
+    sent_cv_.notify_all();
+    return;
+  }
+
+  // the round's writes are copied once, into an entry the replicator's
+  // sends share, with big PUT values encoded on the way
+  const std::size_t arena_bytes = writes * kArenaBytesPerWrite;
+  std::shared_ptr<kvStore::SyncContent> ent = new_arena_entry(arena_bytes);
+  ent->mutable_reqs()->Reserve(writes);
+  std::string encoded;
+  const int64_t now = now_ms();
+  for (const PendingWrite &w : round.batch) {
+    for (const kvStore::RequestContent *req : w.reqs) {
+      kvStore::RequestContent *copy = ent->add_reqs();
+      // a client's PUT carries raw bytes whatever codec it names, only log
+      // entries and snapshot pairs say how their values are encoded
+      const int codec =
+          req->op() == kvdefs::PUT
+              ? encode_value(opts_.value_codec, opts_.compress_threshold,
+                             req->value(), &encoded)
+              : CODEC_NONE;
+      *copy = *req;
+      copy->clear_codec();
+      if (codec != CODEC_NONE) {
+        copy->set_value(encoded);
+        copy->set_codec(codec);
+        compressed_->Add(1);
+        compress_saved_->Add(req->value().size() - encoded.size());
+      }
+      // fixed here from ttl_ms, so every replica expires the key at the
+      // same time; only ReclaimExpired's EXPIREs come with their own
+      if (req->op() != kvdefs::EXPIRE) copy->clear_expire_at();
+      if (req->op() == kvdefs::PUT && req->ttl_ms() > 0)
+        copy->set_expire_at(now + req->ttl_ms());
+    }
+  }
+  round_writes_->Record(writes);
+
+  // 2pc:
+  // send sync reqeust to all backups at once,
+  // apply log on receiving success responses of the majority.
+  // No log or dict lock is held here, and backups slower than the
+  // majority finish in the background.
+  std::lock_guard<std::mutex> repl_guard(replication_mutex_);
+  const int64_t index = failed_ ? -1 : GenerateGlobalSeq();
+  round.ent = ent;
+  if (index < 0) {
+    // the node failed, the completer answers the round FAILED
+    round.failed = true;
+  } else {
+    ent->set_index(index);
+    round.round = replicator_.Send(CurrentBackups(), ent);
+  }
+  // under replication_mutex_, so RevertRounds sees every round sent
+  {
+    std::lock_guard<std::mutex> guard(sent_mutex_);
+    sent_rounds_.push_back(std::move(round));
+  }
+  sent_cv_.notify_all();
+}
+
+// Commit round once a majority of the group, us and the voting backups,
+// has its entry, filling in the result and status of every write in it.
+// Otherwise it fails along with every round sent after it, see
+// RevertRounds. The entry is sent once: a backup that missed it is lagging
+// and gets it with a catch-up. Returns what to hand WaitPersisted before
+// answering the writers.
+std::size_t kvdefs::DataNode::SettleRound(SentRound *round) {
+  if (!round->ent) return 0;
+  std::size_t wal_seq = 0;
+  if (!round->failed) {
+    const std::size_t acks = replicator_.Wait(round->round.get());
+    if (acks < Replicator::Quorum(round->round->voters))
+      RevertRounds();
+    else
+      wal_seq = CommitLog(*round->ent, round->batch);
+    round_latency_->Record(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - round->sent)
+            .count());
+  }
+  if (round->failed) {
+    failed_rounds_->Add(1);
+    for (PendingWrite &w : round->batch)
+      for (kvStore::RequestResult *result : w.results)
+        result->set_err(kvdefs::FAILED);
+  }
+
+  // backups that are not caught up get there by a catch-up, the other
+  // peers the replicator knows were only cloned to
+  const std::vector<std::string> peers = CurrentBackups();
+  for (const std::string &addr : replicator_.Lagging())
+    if (std::find(peers.begin(), peers.end(), addr) != peers.end())
+      RunTask([this, addr]() { CatchUpPeer(addr); });
+  return wal_seq;
+}
+
+// A round no majority took may still have reached some backups, and so may
+// the rounds sent after it. All of them fail, undone where they landed by
+// one entry writing back what dict holds for their keys: that is what the
+// rounds before them committed, and with replication_mutex_ held no round
+// is sent in between. It changes nothing here, so it is logged whether or
+// not a majority takes it, and backups that miss it get it with their next
+// catch-up.
+void kvdefs::DataNode::RevertRounds() {
+  std::lock_guard<std::mutex> repl_guard(replication_mutex_);
+  std::set<std::string> keys;
+  {
+    std::lock_guard<std::mutex> guard(sent_mutex_);
+    for (SentRound &round : sent_rounds_) {
+      if (!round.ent || round.failed) continue;
+      round.failed = true;
+      for (const kvStore::RequestContent &req : round.ent->reqs())
+        keys.insert(req.key());
+    }
+  }
+  std::shared_ptr<kvStore::SyncContent> undo =
+      std::make_shared<kvStore::SyncContent>();
+  for (const std::string &key : keys) {
+    kvStore::RequestContent *back = undo->add_reqs();
+    back->set_key(key);
+    std::shared_ptr<const Version> version = dict_->GetVersion(key);
+    if (!version) {
+      back->set_op(kvdefs::DELETE);
+      continue;
+    }
+    back->set_op(kvdefs::PUT);
+    back->set_value(version->value);
+    back->set_codec(version->codec);
+    back->set_expire_at(version->expire_at);
+  }
+  const int64_t index = GenerateGlobalSeq();
+  // a failed node sends nothing more, the master fails the group over
+  if (index < 0) return;
+  undo->set_index(index);
+  // it reaches each backup after the rounds it undoes
+  replicator_.Send(CurrentBackups(), undo);
+
+  const std::string payload = undo->SerializeAsString();
+  std::unique_lock<std::mutex> lock = LockLog();
+  if (AppendLog(undo->index(), payload) != kvdefs::SYNC_SUCC) return;
+  kvStore::RequestResult result;
+  ApplyLog(*undo, &result);
+  MaybeSnapshot();
+}
+
+// The entry is only queued to the wal here, log_mutex_ is not held across
+// the disk sync; returns what to hand WaitPersisted for it.
+std::size_t kvdefs::DataNode::CommitLog(const kvStore::SyncContent &ent,
+                                        std::vector<PendingWrite> &batch) {
+  const std::string payload = ent.SerializeAsString();
+
+  std::size_t wal_seq = 0;
+  std::unique_lock<std::mutex> lock = LockLog();
+  if (AppendLog(ent.index(), payload, &wal_seq) != kvdefs::SYNC_SUCC) {
+    for (PendingWrite &w : batch) {
+      for (kvStore::RequestResult *result : w.results)
+        result->set_err(kvdefs::FAILED);
+      w.status = grpc::Status::OK;
+    }
+    return 0;
+  }
+  // the whole batch lands in dict before any of its writers is answered
+  int i = 0;
+  for (PendingWrite &w : batch) {
+    for (kvStore::RequestResult *result : w.results) {
+      grpc::Status ret = ApplyRequest(ent.reqs(i++), ent.index(), result);
+      result->set_index(ent.index());
+      if (!ret.ok()) w.status = ret;
+    }
+  }
+  SetApplied(ent.index());
+  MarkMigrationDirty(ent);
+
+  MaybeSnapshot();
+  return wal_seq;
+}
+
+std::string kvdefs::DataNode::MyNode() const {
+  return "data" + std::to_string(opts_.id);
+}
+
+// Copy every key the ring of table takes away from this group to its new
+// owner while we keep serving them: one pass over dict, a few passes over
+// the keys written meanwhile, then a last one with writes to them fenced.
+// Returns 0 once the new owners hold everything; the keys stay fenced here
+// until a PRIMARY tells whether the master switched to table.
+int kvdefs::DataNode::MigrateKeys(const kvStore::RouteTable &table) {
+  const std::string me = MyNode();
+  std::shared_ptr<const HashRing> ring =
+      std::make_shared<const HashRing>(ring_from_table(table));
+  // a MIGRATE the master gave up on is superseded by this one
+  AbortMigration();
+  {
+    std::lock_guard<std::mutex> guard(migration_mutex_);
+    migration_ring_ = ring;
+  }
+
+  KeyMover mover(table, *ring);
+  std::size_t moved = 0;
+  int scanned = dict_->Scan(
+      "", "", 0, [&](const std::string &key, const Version &version) {
+        if (ring->NodeFor(key) != me) {
+          mover.Move(key, &version);
+          ++moved;
+        }
+        return !mover.Failed() && !stopping_;
+      });
+  KV_LOG(INFO) << "copied " << moved << " keys to their new groups";
+  // keys we could not read would be lost with the move
+  if (stopping_ || scanned) {
+    AbortMigration();
+    return -1;
+  }
+
+  // push the current value of every key written since its last copy
+  auto move_dirty = [this, &mover]() {
+    std::set<std::string> dirty;
+    {
+      std::lock_guard<std::mutex> guard(migration_mutex_);
+      dirty.swap(migration_dirty_);
+    }
+    for (const std::string &key : dirty) {
+      std::shared_ptr<const Version> version = dict_->GetVersion(key);
+      mover.Move(key, version.get());
+    }
+    mover.Flush();
+    return dirty.size();
+  };
+  for (int pass = 0; pass < kMigrationDeltaPasses && !mover.Failed(); ++pass)
+    if (!move_dirty()) break;
+
+  // hold back new writes to moving keys and wait out the ones already
+  // queued, after that the last delta leaves nothing behind
+  WaitFinish([this, &ring](const Finisher &finish) {
+    std::lock_guard<std::mutex> guard(migration_mutex_);
+    // unless a PRIMARY called the migration off meanwhile
+    migration_fenced_ = migration_ring_ == ring;
+    PendingWrite barrier;
+    barrier.finish = finish;
+    EnqueueWrite(std::move(barrier));
+  });
+  if (!mover.Failed()) move_dirty();
+
+  if (mover.Flush()) {
+    AbortMigration();
+    return -1;
+  }
+  std::lock_guard<std::mutex> guard(migration_mutex_);
+  return migration_fenced_ ? 0 : -1;
+}
+
+// Forget the in-flight migration and let the writes it held back through.
+void kvdefs::DataNode::AbortMigration() {
+  std::lock_guard<std::mutex> guard(migration_mutex_);
+  for (PendingWrite &w : fenced_writes_) EnqueueWrite(std::move(w));
+  fenced_writes_.clear();
+  migration_dirty_.clear();
+  migration_ring_.reset();
+  migration_fenced_ = false;
+}
+
+// The master routes by table from now on. If that is the layout we migrated
+// to, the moved keys are served by their new owners: bounce the writes held
+// back for them and drop our copies. Any other table means the master gave
+// the migration up.
+void kvdefs::DataNode::SettleMigration(const kvStore::RouteTable &table) {
+  std::shared_ptr<const HashRing> ring;
+  std::vector<PendingWrite> bounced;
+  {
+    std::lock_guard<std::mutex> guard(migration_mutex_);
+    if (!migration_ring_) return;
+    if (migration_fenced_ &&
+        ring_from_table(table).Weights() == migration_ring_->Weights()) {
+      ring = migration_ring_;
+      bounced.swap(fenced_writes_);
+    }
+  }
+  if (!ring) {
+    KV_LOG(INFO) << "migration abandoned by the master";
+    AbortMigration();
+    return;
+  }
+  AbortMigration();
+
+  // the writers refetch the table and retry at the new owner
+  for (PendingWrite &w : bounced) {
+    for (kvStore::RequestResult *result : w.results)
+      result->set_err(kvdefs::STALE);
+    w.finish(grpc::Status::OK);
+  }
+  // skipped once Stop began, the copies left behind are routed elsewhere
+  RunTask([this, ring]() { DropMovedKeys(ring); });
+}
+
+// Delete the keys ring assigns to other groups, through the write path so
+// our backups drop them too.
+void kvdefs::DataNode::DropMovedKeys(std::shared_ptr<const HashRing> ring) {
+  const std::string me = MyNode();
+  std::vector<std::string> keys;
+  // the keys past a corrupt table stay behind, harmless but for the space
+  if (dict_->Scan("", "", 0,
+                  [&](const std::string &key, const Version &version) {
+                    if (ring->NodeFor(key) != me) keys.push_back(key);
+                    return true;
+                  }))
+    KV_LOG(ERROR) << "could not read every key to drop";
+
+  for (std::size_t first = 0; first < keys.size();
+       first += kvdefs::kWriteBatchMax) {
+    const std::size_t last =
+        std::min(keys.size(), first + kvdefs::kWriteBatchMax);
+    std::vector<kvStore::RequestContent> reqs(last - first);
+    std::vector<kvStore::RequestResult> results(last - first);
+    PendingWrite w;
+    for (std::size_t i = 0; i < reqs.size(); ++i) {
+      reqs[i].set_op(kvdefs::DELETE);
+      reqs[i].set_key(keys[first + i]);
+      w.reqs.push_back(&reqs[i]);
+      w.results.push_back(&results[i]);
+    }
+    WaitFinish([this, &w](const Finisher &finish) {
+      w.finish = finish;
+      SubmitWrite(std::move(w));
+    });
+  }
+  KV_LOG(INFO) << "dropped " << keys.size() << " moved keys";
+}
+
+// Called with log_mutex_ held, as entries are applied.
+void kvdefs::DataNode::TrackExpiry(const std::string &key, int64_t expire_at) {
+  std::lock_guard<std::mutex> guard(expiry_mutex_);
+  expiry_.Add(key, expire_at);
+}
+
+// Every kExpireTickMs, take the keys whose deadline passed off the wheel and
+// look them up. Keys deleted, written again or given a later deadline since
+// are dropped; the rest stay tracked for another look kExpireRetryMs later,
+// until an EXPIRE entry reclaims them. Only the primary logs those, the
+// backups keep tracking the keys in case they take over first.
+void kvdefs::DataNode::ExpireLoop() {
+  std::vector<std::string> due, expired;
+  while (true) {
+    int64_t now;
+    {
+      std::unique_lock<std::mutex> lock(expiry_mutex_);
+      expiry_cv_.wait_for(lock, std::chrono::milliseconds(kExpireTickMs),
+                          [this] { return expiry_stop_; });
+      if (expiry_stop_) return;
+      now = now_ms();
+      due.clear();
+      expiry_.Advance(now, &due);
+    }
+
+    expired.clear();
+    for (const std::string &key : due) {
+      std::shared_ptr<const Version> version = dict_->GetVersion(key);
+      if (version && version->Expired(now)) expired.push_back(key);
+    }
+    if (expired.empty()) continue;
+    {
+      std::lock_guard<std::mutex> guard(expiry_mutex_);
+      // a key written again meanwhile is tracked for its new deadline
+      for (const std::string &key : expired)
+        if (!expiry_.Tracked(key)) expiry_.Add(key, now + kExpireRetryMs);
+    }
+    // a round still in flight gets its keys again on the retry
+    if (is_primary_ && !expiring_) ReclaimExpired(expired, now);
+  }
+}
+
+// Log EXPIRE writes for keys through the write path, kWriteBatchMax to a
+// replication round, so backups reclaim them in the same entries. Nothing
+// waits for them: the rounds queue behind client writes.
+void kvdefs::DataNode::ReclaimExpired(const std::vector<std::string> &keys,
+                                      int64_t now) {
+  struct Batch {
+    std::vector<kvStore::RequestContent> reqs;
+    std::vector<kvStore::RequestResult> results;
+  };
+  for (std::size_t first = 0; first < keys.size();
+       first += kvdefs::kWriteBatchMax) {
+    const std::size_t last =
+        std::min(keys.size(), first + kvdefs::kWriteBatchMax);
+    std::shared_ptr<Batch> b = std::make_shared<Batch>();
+    b->reqs.resize(last - first);
+    b->results.resize(last - first);
+    PendingWrite w;
+    for (std::size_t i = 0; i < b->reqs.size(); ++i) {
+      b->reqs[i].set_op(kvdefs::EXPIRE);
+      b->reqs[i].set_key(keys[first + i]);
+      b->reqs[i].set_expire_at(now);
+      w.reqs.push_back(&b->reqs[i]);
+      w.results.push_back(&b->results[i]);
+    }
+    ++expiring_;
+    w.finish = [this, b](grpc::Status status) {
+      for (const kvStore::RequestResult &result : b->results)
+        if (result.err() == kvdefs::OK) expired_->Add(1);
+      --expiring_;
+    };
+    SubmitWrite(std::move(w));
+  }
+}
+
+// Note the moving keys ent wrote, so the migration copies them again.
+// Called with log_mutex_ held, after ent reached dict.
+void kvdefs::DataNode::MarkMigrationDirty(const kvStore::SyncContent &ent) {
+  std::lock_guard<std::mutex> guard(migration_mutex_);
+  if (!migration_ring_) return;
+  const std::string me = MyNode();
+  for (const auto &req : ent.reqs())
+    if (migration_ring_->NodeFor(req.key()) != me)
+      migration_dirty_.insert(req.key());
+}
+
+// *wal_seq, if given, is set to what to hand WaitPersisted for the entry
+int kvdefs::DataNode::AppendLog(int64_t index, const std::string &payload,
+                                std::size_t *wal_seq) {
+  if (LastLogIndex() < index) {
+    log_.Append(index, payload);
+    const std::size_t seq = PersistLog(payload);
+    if (wal_seq) *wal_seq = seq;
+    return kvdefs::SYNC_SUCC;
+  }
+
+  return kvdefs::SYNC_FAIL;
+}
+
+// Append and apply the entries of batch that are newer than our log tail,
+// returns how many were taken. Called with log_mutex_ held; *wal_seq is
+// moved up to what to hand WaitPersisted for them.
+std::size_t kvdefs::DataNode::AppendLogBatch(const kvStore::SyncBatch &batch,
+                                             std::size_t *wal_seq) {
+  std::vector<const kvStore::SyncContent *> taken;
+  std::vector<std::string> payloads;
+  for (const auto &ent : batch.ents()) {
+    if (LastLogIndex() >= ent.index()) continue;
+    payloads.push_back(ent.SerializeAsString());
+    log_.Append(ent.index(), payloads.back());
+    taken.push_back(&ent);
+  }
+
+  if (payloads.size())
+    *wal_seq = PersistLogBatch(payloads.data(), payloads.size());
+  kvStore::RequestResult result;
+  for (const kvStore::SyncContent *ent : taken) ApplyLog(*ent, &result);
+  return taken.size();
+}
+
+grpc::Status kvdefs::DataNode::ApplyLog(const kvStore::SyncContent &ent,
+                                        kvStore::RequestResult *result) {
+  // check if being empty log entry
+  if(!ent.has_req() && !ent.reqs_size()) {
+    return grpc::Status::OK;
+  }
+
+  grpc::Status ret = grpc::Status::OK;
+  if (ent.has_req()) ret = ApplyRequest(ent.req(), ent.index(), result);
+  for (const auto &req : ent.reqs()) {
+    grpc::Status s = ApplyRequest(req, ent.index(), result);
+    if (!s.ok()) ret = s;
+  }
+  SetApplied(ent.index());
+  return ret;
+}
+
+// Callers hold log_mutex_, so entries are applied one at a time and in
+// order.
+void kvdefs::DataNode::SetApplied(int64_t index) {
+  {
+    std::lock_guard<std::mutex> guard(applied_mutex_);
+    if (index <= applied_index_) return;
+    applied_index_ = index;
+  }
+  applied_cv_.notify_all();
+}
+
+grpc::Status kvdefs::DataNode::ApplyRequest(
+    const kvStore::RequestContent &request, int64_t index,
+    kvStore::RequestResult *result) {
+  const kvStore::RequestContent *req = &request;
+  switch (req->op()) {
+  case kvdefs::PUT:
+    dict_->Put(req->key(), req->value(), index, req->codec(),
+               req->expire_at());
+    if (req->expire_at()) TrackExpiry(req->key(), req->expire_at());
+    result->set_err(kvdefs::OK);
+    break;
+
+  case kvdefs::EXPIRE: {
+    // unless a write renewed the key after the primary found it expired
+    std::shared_ptr<const Version> version = dict_->GetVersion(req->key());
+    if (version && version->Expired(req->expire_at()) &&
+        dict_->Erase(req->key(), index)) {
+      result->set_err(kvdefs::OK);
+    } else {
+      result->set_err(kvdefs::NOTFOUND);
+    }
+  } break;
+
+  case kvdefs::DELETE:
+    if (dict_->Erase(req->key(), index)) {
+      result->set_err(kvdefs::OK);
+    } else {
+      result->set_err(kvdefs::NOTFOUND);
+    }
+    break;
+
+  default:
+    KV_LOG(ERROR) << "cannot apply op " << req->op();
+    return grpc::Status::CANCELLED;
+  }
+
+  return grpc::Status::OK;
+
+}
+
+int64_t kvdefs::DataNode::LastLogIndex() {
+  return log_.empty() ? snapshot_index_ : log_.LastIndex();
+}
+
+// fold the log into a checkpoint of dict once snapshot_interval entries
+// came in since the last one, so memory and catch-up cost track live data
+// instead of write history
+// Called with log_mutex_ held, which only covers rotating the wal and
+// noting the cut at index: the dict is written out on a task of its own
+// while writes go on. A checkpoint can pick up entries after index that
+// way; Recover replays them again from the wal, to the same result.
+void kvdefs::DataNode::MaybeSnapshot() {
+  if (snapshotting_ || installing_ ||
+      log_.CountAfter(snapshot_index_) < opts_.snapshot_interval)
+    return;
+
+  const int64_t index = LastLogIndex();
+  // later records go to a fresh wal file, the checkpoint covers the rest
+  if (wal_.IsOpen() && wal_.Rotate()) {
+    KV_LOG(ERROR) << "Failed saving snapshot at " << index;
+    return;
+  }
+  dict_->BeginCheckpoint(index);
+  const uint64_t generation = snapshot_generation_;
+  // if we are stopping, the rotated wal is replayed on the next start
+  snapshotting_ = RunTask(
+      [this, index, generation]() { FinishSnapshot(index, generation); });
+}
+
+void kvdefs::DataNode::FinishSnapshot(int64_t index, uint64_t generation) {
+  int ret = 0;
+  {
+    std::lock_guard<std::mutex> guard(checkpoint_mutex_);
+    // an installed snapshot replaced what we were about to write
+    if (generation != snapshot_generation_) ret = 1;
+    else ret = dict_->FinishCheckpoint();
+  }
+
+  std::unique_lock<std::mutex> lock = LockLog();
+  snapshotting_ = false;
+  if (ret > 0 || generation != snapshot_generation_) return;
+  // once the checkpoint is on disk the rotated wal records are covered by it
+  if (ret || (wal_.IsOpen() && wal_.DropRotated())) {
+    KV_LOG(ERROR) << "Failed saving snapshot at " << index;
+    return;
+  }
+  snapshot_index_ = index;
+  // keep the newest entries for peers only a little behind
+  const int64_t floor =
+      std::min(index, log_.IndexBeforeLast(opts_.snapshot_interval / 2));
+  if (floor > log_floor_) {
+    log_.TruncatePrefix(floor);
+    log_floor_ = floor;
+  }
+  KV_LOG(INFO) << "snapshot taken at " << index;
+}
+
+// Bring a peer up to our log tail. Writes go on meanwhile: the replicator
+// holds back what it has for the peer, and once the copy is through sends
+// only the entries past the index the copy reached.
+void kvdefs::DataNode::CatchUpPeer(const std::string &addr) {
+  std::lock_guard<std::mutex> guard(catch_up_mutex_);
+  for (int attempt = 0; attempt < kCatchUpAttempts; ++attempt) {
+    replicator_.Hold(addr);
+    const int64_t index = CopyToPeer(addr);
+    if (replicator_.Release(addr, index) || index < 0 || stopping_) return;
+    KV_LOG(WARN) << addr << " fell behind again while it was caught up";
+  }
+  replicator_.Release(addr, -1);
+}
+
+// A peer still covered by log_ only gets the entries it misses; one that
+// fell behind the last snapshot gets dict as of our tail instead, which
+// needs no log replay after it. Returns the index the peer is at after,
+// -1 if it could not be brought there.
+int64_t kvdefs::DataNode::CopyToPeer(const std::string &addr) {
+  SyncRequester client(get_channel(addr));
+  const int64_t peer_index = client.RequestLogVersion();
+  if (peer_index < 0) {
+    KV_LOG(WARN) << "failed probing log version of " << addr;
+    return -1;
+  }
+
+  // copy the log tail the peer needs, or for a snapshot just note its
+  // index, then ship it without holding log_mutex_. The snapshot streams
+  // dict as it goes on changing: it may pick up entries past state_index,
+  // which the peer gets again after it and replays to the same state.
+  std::vector<std::string> tail;
+  int64_t state_index = -1;
+  uint64_t generation = 0;
+  int64_t tail_index = peer_index;
+  {
+    std::lock_guard<std::mutex> guard(log_mutex_);
+    tail_index = std::max(tail_index, LastLogIndex());
+    if (peer_index < log_floor_) {
+      state_index = LastLogIndex();
+      generation = snapshot_generation_;
+    } else {
+      log_.ForEach(peer_index,
+                   [&tail](int64_t index, const char *data, std::size_t len) {
+                     tail.emplace_back(data, len);
+                     return true;
+                   });
+    }
+  }
+
+  if (state_index >= 0) {
+    KV_LOG(INFO) << "installing snapshot at " << state_index << " to " << addr;
+    bool sent = for_each_snapshot_chunk(
+        state_index, LiveDictView(*dict_), kSnapshotChunkKeys,
+        [&client](const kvStore::SnapshotChunk &chunk) {
+          return client.DoInstallSnapshot(chunk) == kvdefs::SYNC_SUCC;
+        });
+    if (!sent) {
+      KV_LOG(ERROR) << "failed installing snapshot to " << addr;
+      return -1;
+    }
+    // a snapshot installed here meanwhile swapped dict out from under us
+    std::lock_guard<std::mutex> guard(log_mutex_);
+    if (generation != snapshot_generation_ || installing_) {
+      KV_LOG(ERROR) << "dict was replaced while installing it to " << addr;
+      return -1;
+    }
+    return state_index;
+  }
+
+  if (tail.size() && client.DoSyncStream(tail) != kvdefs::SYNC_SUCC) {
+    KV_LOG(ERROR) << "failed streaming log tail to " << addr;
+    return -1;
+  }
+  return tail_index;
+}
+
+std::vector<std::string> kvdefs::DataNode::CurrentBackups() {
+  std::lock_guard<std::mutex> guard(backups_mutex_);
+  return backups_;
+}
+
+// the entry's index must be final before it is persisted, so the primary
+// calls this only after the 2pc round has settled on one
+std::size_t kvdefs::DataNode::PersistLog(const std::string &payload) {
+  return PersistLogBatch(&payload, 1);
+}
+
+// Queue records to the wal in log order, called with log_mutex_ held.
+// Returns what to hand WaitPersisted for them, the sync happens there.
+std::size_t kvdefs::DataNode::PersistLogBatch(const std::string *payloads,
+                                              std::size_t count) {
+  if (!wal_.IsOpen()) return 0;
+  std::size_t seq = 0;
+  // a failed wal stays failed, WaitPersisted gives up on it
+  if (wal_.Enqueue(payloads, count, &seq))
+    KV_LOG(ERROR) << "Failed queueing wal records";
+  else
+    wal_seq_ = seq;
+  return wal_seq_;
+}
+
+// Returns once the wal has what was queued up to wal_seq, without
+// log_mutex_, so appenders queueing meanwhile share the next sync. Returns
+// 0 on success, -1 with the node failed if the wal could not be written.
+int kvdefs::DataNode::WaitPersisted(std::size_t wal_seq) {
+  if (!wal_.IsOpen()) return 0;
+  if (wal_.Sync(wal_seq)) {
+    Fail("Failed writing wal");
+    return -1;
+  }
+  return 0;
+}
+
+// Indices come out of blocks leased from the coordinator, so only one write
+// in kSeqLeaseBlock pays a coordinator round trip. Leases are handed out in
+// increasing order cluster wide, so a node that takes over as primary still
+// numbers its entries above everything its predecessor could have used.
+// Returns -1 with the node failed if no lease could be had.
+int64_t kvdefs::DataNode::GenerateGlobalSeq() {
+  ScopedTimer timer(seq_latency_);
+  std::lock_guard<std::mutex> guard(seq_mutex_);
+  if (seq_next_ >= seq_end_) {
+    int64_t first = 0;
+    int ret;
+    {
+      ScopedTimer lease_timer(lease_latency_);
+      ret = lease_seq_block(coord_, "/globalseq", kSeqLeaseBlock, &first);
+    }
+    if (ret) {
+      KV_LOG(ERROR) << "Failed generating seq: " << ret;
+      Fail("Failed leasing log indices");
+      return -1;
+    }
+    seq_next_ = first;
+    seq_end_ = first + kSeqLeaseBlock;
+  }
+  return seq_next_++;
+}
+
+// Stop taking writes and Syncs for good and leave the group, so the master
+// fails it over to a backup as if our session had expired. Other nodes in
+// the process go on; opts_.on_failed tells the binary. Callable from any
+// thread and with any lock held, the rest happens on a task.
+void kvdefs::DataNode::Fail(const std::string &why) {
+  if (failed_.exchange(true)) return;
+  KV_LOG(ERROR) << why << ", node failed";
+  RunTask([this]() {
+    if (!znode_path_.empty()) coord_->Delete(znode_path_);
+    if (opts_.on_failed) opts_.on_failed();
+  });
+}
+
+// Rebuild the backup list from the members under /master. Runs on the
+// coordinator's event thread whenever one joins or leaves.
+void kvdefs::DataNode::MembersChanged() {
+  std::vector<std::string> children;
+  if (coord_->GetChildren("/master", &children)) return;
+
+  const std::string my_znode = MyNode();
+  std::vector<std::string> new_backups;
+  for (const std::string &child_name : children) {
+    std::string data;
+    if (coord_->Get("/master/" + child_name, &data, nullptr)) continue;
+    std::string new_node_addr;
+    int64_t weight;
+    parse_node_data(data.c_str(), &new_node_addr, &weight);
+    if (extract_data_node(child_name.c_str()) == my_znode &&
+        new_node_addr != opts_.addr && new_node_addr.size()) {
+      new_backups.push_back(new_node_addr);
+      KV_LOG(INFO) << "added backup " << child_name << " with addr: "
+                   << new_node_addr << " my_znode: " << my_znode;
+    }
+  }
+  std::vector<std::string> joined;
+  {
+    std::lock_guard<std::mutex> guard(backups_mutex_);
+    for (const std::string &addr : new_backups)
+      if (std::find(backups_.begin(), backups_.end(), addr) == backups_.end())
+        joined.push_back(addr);
+    backups_.swap(new_backups);
+  }
+  replicator_.Retain(CurrentBackups());
+  // the master's PRIMARY may have beaten this event here, so a primary
+  // catches its new backups up itself rather than wait for the next one
+  if (is_primary_ && joined.size()) {
+    RunTask([this, joined]() {
+      for (const std::string &addr : joined)
+        if (!stopping_) CatchUpPeer(addr);
+    });
+  }
+}
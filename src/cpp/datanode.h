@@ -0,0 +1,339 @@
+#ifndef KVSTORE_DATANODE_H
+#define KVSTORE_DATANODE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "compress.h"
+#include "coordinator.h"
+#include "defines.h"
+#include "hash_ring.h"
+#include "log_store.h"
+#include "metrics.h"
+#include "replicator.h"
+#include "sharded_dict.h"
+#include "storage_engine.h"
+#include "timing_wheel.h"
+#include "wal.h"
+
+#include "kvstore.grpc.pb.h"
+
+namespace kvdefs {
+
+// One member of a datanode group: the dict, its log and wal, replication to
+// the group's backups and key migration. All of its state lives in the
+// object, so an embedded cluster runs several of them in one process, each
+// with its own coordinator session.
+class DataNode {
+public:
+  struct Options {
+    Options()
+        : id(-1), weight(1), wal_policy(WAL_SYNC_GROUP),
+          snapshot_interval(kSnapshotLogEntries), async_threads(0),
+          value_codec(CODEC_NONE), compress_threshold(kCompressMinBytes),
+          storage_engine(ENGINE_MAP) {}
+    std::string addr;
+    int id;
+    int64_t weight;
+    std::string wal_path;  // empty keeps the node in memory only
+    int wal_policy;
+    std::size_t snapshot_interval;
+    int async_threads;  // 0 serves on the sync thread pool
+    // PUT values of at least compress_threshold bytes are stored, logged
+    // and replicated encoded with value_codec, and decoded on READ
+    int value_codec;
+    std::size_t compress_threshold;
+    // ENGINE_LSM keeps its tables in wal_path + ".lsm" and needs a wal_path
+    int storage_engine;
+    // called once the node failed and left its group, from a thread of the
+    // node's own; it must not Stop the node
+    std::function<void()> on_failed;
+  };
+
+  // coord must outlive the node
+  DataNode(const Options &opts, Coordinator *coord);
+  ~DataNode();
+
+  // Recover from the snapshot and wal, register with the master and start
+  // serving. Returns 0 on success, the node is unusable otherwise.
+  int Start();
+  // if this node is its group's last member, clone its data to every other
+  // group before it leaves
+  void HandOff();
+  // stop serving and leave the cluster
+  void Stop();
+  // true once the wal or the coordinator's index leases failed; the node
+  // answers writes and Syncs FAILED from then on
+  bool Failed() const { return failed_; }
+
+private:
+  class ServiceImpl;
+  typedef std::function<void(grpc::Status)> Finisher;
+
+  // the writes of one client call waiting in write_queue_, they always
+  // commit in the same replication round
+  struct PendingWrite {
+    std::vector<const kvStore::RequestContent *> reqs;
+    std::vector<kvStore::RequestResult *> results;
+    grpc::Status status;
+    Finisher finish;
+  };
+
+  // READ_INDEX reads of one client call waiting for read_indexer_
+  struct PendingRead {
+    std::vector<const kvStore::RequestContent *> reqs;
+    std::vector<kvStore::RequestResult *> results;
+    Finisher finish;
+  };
+
+  // a Sync the async server took, waiting for syncer_
+  struct PendingSync {
+    const kvStore::SyncContent *ent;
+    kvStore::SyncResult *result;
+    std::chrono::steady_clock::time_point queued;
+    Finisher finish;
+  };
+
+  int Recover();
+  int StartServer();
+  void Cleanup();
+  // run fn on a thread of its own that Stop waits for; false, and fn never
+  // runs, once Stop began
+  bool RunTask(const std::function<void()> &fn);
+  void AddGauges();
+  // log_mutex_, with the time it took recorded when it was contended
+  std::unique_lock<std::mutex> LockLog();
+
+  void HandleRequest(const kvStore::RequestContent &req,
+                     kvStore::RequestResult *result, const Finisher &finish);
+  void HandleMultiRequest(const kvStore::MultiRequestContent &batch,
+                          kvStore::MultiRequestResult *results,
+                          const Finisher &finish);
+  grpc::Status HandleMultiSync(const kvStore::SyncBatch &batch,
+                               kvStore::SyncResult *result);
+  grpc::Status HandleSync(const kvStore::SyncContent &ent,
+                          kvStore::SyncResult *result);
+  grpc::Status AppendSync(const kvStore::SyncContent &ent,
+                          const std::string &payload,
+                          kvStore::SyncResult *result, std::size_t *wal_seq);
+  void QueueSync(PendingSync &&s);
+  void SyncLoop();
+  bool IsStaleRoute(const kvStore::RequestContent &req);
+  bool TryServeRead(const kvStore::RequestContent &req,
+                    kvStore::RequestResult *result);
+  void ServeRead(const kvStore::RequestContent &req,
+                 kvStore::RequestResult *result);
+  void QueueReadIndex(PendingRead &&r);
+  void ReadIndexLoop();
+  bool WaitReadIndex();
+  void SetApplied(int64_t index);
+  void FollowRoute(const kvStore::RouteTable &table);
+  void SubmitWrite(PendingWrite &&w);
+  void EnqueueWrite(PendingWrite &&w);
+  void CommitLoop();
+  void CompleteLoop();
+  int MigrateKeys(const kvStore::RouteTable &table);
+  void AbortMigration();
+  void SettleMigration(const kvStore::RouteTable &table);
+  void MarkMigrationDirty(const kvStore::SyncContent &ent);
+  void DropMovedKeys(std::shared_ptr<const HashRing> ring);
+  void TrackExpiry(const std::string &key, int64_t expire_at);
+  void ExpireLoop();
+  void ReclaimExpired(const std::vector<std::string> &keys, int64_t now);
+  std::string MyNode() const;
+  struct SentRound;
+  void SendBatch(SentRound &&round);
+  std::size_t SettleRound(SentRound *round);
+  int AppendLog(int64_t index, const std::string &payload,
+                std::size_t *wal_seq = nullptr);
+  std::size_t AppendLogBatch(const kvStore::SyncBatch &batch,
+                             std::size_t *wal_seq);
+  grpc::Status ApplyLog(const kvStore::SyncContent &ent,
+                        kvStore::RequestResult *result);
+  grpc::Status ApplyRequest(const kvStore::RequestContent &req, int64_t index,
+                            kvStore::RequestResult *result);
+  std::size_t CommitLog(const kvStore::SyncContent &ent,
+                        std::vector<PendingWrite> &batch);
+  void RevertRounds();
+  std::vector<std::string> CurrentBackups();
+  std::size_t PersistLog(const std::string &payload);
+  std::size_t PersistLogBatch(const std::string *payloads, std::size_t count);
+  int WaitPersisted(std::size_t wal_seq);
+  int64_t LastLogIndex();
+  void MaybeSnapshot();
+  void FinishSnapshot(int64_t index, uint64_t generation);
+  void CatchUpPeer(const std::string &addr);
+  int64_t CopyToPeer(const std::string &addr);
+  int64_t GenerateGlobalSeq();
+  void Fail(const std::string &why);
+  void MembersChanged();
+
+  Options opts_;
+  Coordinator *coord_;
+  std::string znode_path_;
+
+  // Served by the Stats RPC. The metrics of the hot paths are looked up
+  // once here; timings are in microseconds.
+  Metrics metrics_;
+  std::map<int64_t, Histogram *> op_latency_;  // Request, by op
+  Histogram *multi_latency_;
+  Histogram *sync_latency_;    // applying one Sync from our primary
+  Histogram *round_latency_;   // a 2pc round, from sending to commit
+  Histogram *round_writes_;    // client writes per round
+  Histogram *seq_latency_;     // GenerateGlobalSeq, lease waits included
+  Histogram *lease_latency_;   // leasing an index block from the coordinator
+  Histogram *log_lock_wait_;   // contended log_mutex_ acquisitions
+  Counter *stale_;             // requests answered STALE
+  Counter *behind_;            // follower reads answered BEHIND
+  Histogram *read_index_latency_;  // a read-index check with our primary
+  Counter *failed_rounds_;     // rounds that missed a quorum of backups
+  Counter *compressed_;        // PUT values stored encoded
+  Counter *compress_saved_;    // bytes their encoding saved
+  Counter *expired_;           // keys EXPIRE entries reclaimed
+
+  LogStore log_;
+  std::unique_ptr<StorageEngine> dict_;
+  std::vector<std::string> backups_;
+  // the master's routing epoch as of its last PRIMARY request to us
+  std::atomic<int64_t> route_epoch_;
+  // set once the master named us our group's primary, cleared when its
+  // ROUTE lists us as a backup
+  std::atomic<bool> is_primary_;
+  // our primary as of the master's last ROUTE, read-index checks ask it
+  std::mutex primary_mutex_;
+  std::string primary_addr_;
+  // the index of the last entry applied to dict_, follower reads are only
+  // as fresh as it; applied_cv_ signals it moving, under applied_mutex_
+  std::atomic<int64_t> applied_index_;
+  std::mutex applied_mutex_;
+  std::condition_variable applied_cv_;
+  WriteAheadLog wal_;
+  Replicator replicator_;
+
+  // everything up to snapshot_index_ has been folded into dict_'s last
+  // checkpoint. log_ holds every entry after log_floor_, which stays a
+  // little behind it, so peers that lag by a few entries get just those.
+  int64_t snapshot_index_;
+  int64_t log_floor_;
+  // what to hand wal_.Sync for everything queued to the wal so far
+  std::size_t wal_seq_;
+  // a checkpoint is being written off the write path
+  bool snapshotting_;
+  // held while dict_ finishes a checkpoint, and by a snapshot install,
+  // which bumps snapshot_generation_ to void the checkpoints before it.
+  // Never taken with log_mutex_ held except by the install.
+  std::mutex checkpoint_mutex_;
+  uint64_t snapshot_generation_;
+  // set while a snapshot streams into dict_, which holds part of it
+  std::atomic<bool> installing_;
+
+  // log_mutex_ guards log_, the snapshot state and the order entries
+  // reach the wal and dict_ in. dict_ shards lock themselves, so reads never
+  // take it.
+  std::mutex log_mutex_;
+  // serializes sending replication rounds: backups only accept increasing
+  // indices, so entries have to leave this node in log order. Reads never
+  // take it.
+  std::mutex replication_mutex_;
+  // one catch-up at a time, they run beside replication rounds
+  std::mutex catch_up_mutex_;
+  std::mutex backups_mutex_;
+
+  // indices [seq_next_, seq_end_) are leased to us and not handed out yet
+  std::mutex seq_mutex_;
+  int64_t seq_next_;
+  int64_t seq_end_;
+
+  // writes queued for the next replication round, drained by committer_
+  std::mutex batch_mutex_;
+  std::condition_variable batch_cv_;
+  std::deque<PendingWrite> write_queue_;
+  bool commit_stop_;
+  std::thread committer_;
+
+  // A round the committer sent and completer_ has yet to commit, in log
+  // order. A barrier has no entry. failed is set once an earlier round lost
+  // its quorum: RevertRounds undid this one too.
+  struct SentRound {
+    SentRound() : failed(false) {}
+    std::shared_ptr<kvStore::SyncContent> ent;
+    std::shared_ptr<Replicator::Round> round;
+    std::chrono::steady_clock::time_point sent;
+    bool failed;
+    std::vector<PendingWrite> batch;
+  };
+  // at most kRoundsInFlight of them unless window_stop_ is set, completer_
+  // returns once complete_stop_ is set and they are all settled
+  std::mutex sent_mutex_;
+  std::condition_variable sent_cv_;
+  std::deque<SentRound> sent_rounds_;
+  bool window_stop_;
+  bool complete_stop_;
+  std::thread completer_;
+
+  // READ_INDEX reads queued for the next read-index check, one round trip
+  // to the primary answers every read queued before it started
+  std::mutex read_index_mutex_;
+  std::condition_variable read_index_cv_;
+  std::vector<PendingRead> read_index_queue_;
+  bool read_index_stop_;
+  std::thread read_indexer_;
+
+  // Syncs the async server took. syncer_ appends them and waits for the wal
+  // so the completion-queue threads never block on log_mutex_ or a disk
+  // sync; one wal sync acks every Sync queued while the last one ran.
+  std::mutex sync_mutex_;
+  std::condition_variable sync_cv_;
+  std::vector<PendingSync> sync_queue_;
+  bool sync_stop_;
+  std::thread syncer_;
+
+  // An in-flight MIGRATE: the ring it moves keys by, the moving keys written
+  // since they were last copied and, once fenced, the writes to moving keys
+  // held back until the master's next PRIMARY settles the layout.
+  // Lock order: log_mutex_, then migration_mutex_, then batch_mutex_.
+  std::mutex migration_mutex_;
+  std::shared_ptr<const HashRing> migration_ring_;
+  std::set<std::string> migration_dirty_;
+  bool migration_fenced_;
+  std::vector<PendingWrite> fenced_writes_;
+
+  // The deadlines of the keys with a TTL. Every member tracks them as it
+  // applies PUTs, so a new primary takes over reclaiming them; expirer_
+  // advances the wheel. Taken after log_mutex_.
+  std::mutex expiry_mutex_;
+  std::condition_variable expiry_cv_;
+  TimingWheel expiry_;
+  bool expiry_stop_;
+  std::thread expirer_;
+  std::atomic<int> expiring_;  // EXPIRE rounds in flight
+
+  // threads RunTask started and not finished yet. They use this node and
+  // answer calls, so Stop waits for them before shutting the server down.
+  std::mutex tasks_mutex_;
+  std::condition_variable tasks_cv_;
+  int tasks_;
+  std::atomic<bool> stopping_;  // long tasks cut their work short
+  std::atomic<bool> failed_;    // see Failed
+
+  std::unique_ptr<grpc::Service> service_;
+  std::unique_ptr<grpc::Server> server_;
+  std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs_;
+  std::thread event_loops_;
+};
+
+}
+
+#endif
@@ -1,4 +1,9 @@
-#include <zookeeper/zookeeper.h>
+#ifndef KVSTORE_DEFINES_H
+#define KVSTORE_DEFINES_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
 
 namespace kvdefs {
 
@@ -6,7 +11,9 @@ enum REQUEST_ERR_NO {
   OK = 0,
   NOTFOUND,
   REDIRECT,
-  FAILED
+  FAILED,
+  STALE,  // the client's routing table is older than the datanode's
+  BEHIND  // a follower read's replica could not catch up, ask the primary
 };
 
 enum NOTIFICATOIN_NO {
@@ -19,7 +26,12 @@ enum REQUEST_OP_NO {
   DELETE,
   LOGVERSION,
   PRIMARY,
-  CLONE
+  CLONE,
+  NODES,
+  MIGRATE,  // copy the keys a new routing table moves away to their new owners
+  ROUTE,    // the master's routing table, tells backups who their primary is
+  READINDEX,  // the primary's applied log index, for a backup's read-index
+  EXPIRE      // drop a key whose TTL ran out, logged by the primary
 };
 
 enum SYNC_ERR_NO {
@@ -27,7 +39,119 @@ enum SYNC_ERR_NO {
   SYNC_FAIL
 };
 
-int del_znode_recursive(zhandle_t* zh, const char* path);
+enum WAL_SYNC_POLICY {
+  WAL_SYNC_NONE = 400,  // write(2) only, the kernel decides when to flush
+  WAL_SYNC_GROUP,       // fsync before acking, shared by concurrent writers
+  WAL_SYNC_PERIODIC     // fsync in the background every kWalSyncIntervalMs
+};
+
+// How up to date a READ has to be. Strong reads go to the primary; the
+// others may be answered by any member of the group.
+enum READ_CONSISTENCY {
+  READ_STRONG = 0,
+  READ_BOUNDED = 700,  // from a replica that applied at least min_index
+  READ_INDEX           // from a replica once it applied everything the
+                       // primary had when the read arrived
+};
+
+const int kWalSyncIntervalMs = 100;
+
+// checkpoint the dict once this many entries came in since the last
+// checkpoint; the newest half of them stay in the log for lagging peers
+const std::size_t kSnapshotLogEntries = 10000;
+// key/value pairs per snapshot chunk, on disk and on the wire
+const std::size_t kSnapshotChunkKeys = 1000;
+
+// a Sync to a backup that takes longer than this counts as failed
+const int kSyncTimeoutMs = 2000;
+// entries queued for one backup at most; past that it gets no more until
+// a catch-up, retried this often, brings it back
+const std::size_t kReplicationQueueMax = 4096;
+const int kCatchUpRetryMs = 1000;
+// a backup that falls behind again while it is caught up gets this many
+// more tries before it waits for the next retry
+const int kCatchUpAttempts = 3;
+
+// the master's membership probes and PRIMARY notices give up on a datanode
+// after this long, so one hung node cannot hold back a failover
+const int kProbeTimeoutMs = 1000;
+// a MIGRATE copies a group's share of the keys, allow it far longer
+const int kMigrateTimeoutMs = 600000;
+
+// catch-up streams cut the log tail into batches of at most this many
+// entries or bytes, whichever is reached first, and so does the replicator
+// with what queued up for a backup
+const std::size_t kSyncBatchEntries = 1000;
+const std::size_t kSyncBatchBytes = 1 << 20;
+
+// keys with a TTL are checked for expiry every kExpireTickMs, the ones still
+// there after an EXPIRE was sent for them are checked again kExpireRetryMs
+// later
+const int kExpireTickMs = 100;
+const int kExpireRetryMs = 1000;
+
+// PUT values shorter than this are not worth compressing
+const std::size_t kCompressMinBytes = 256;
+// no value gets past gRPC's default 4 MB message cap, a decoded one that
+// claims more is corrupt
+const std::size_t kMaxValueBytes = 4 << 20;
+
+// the in-memory log packs its entries into segments of this many bytes
+const std::size_t kLogSegmentBytes = 1 << 20;
+
+// key/value pairs per streamed scan chunk
+const std::size_t kScanChunkKeys = 1000;
+
+// most client writes the primary packs into one replicated log entry
+const std::size_t kWriteBatchMax = 256;
+
+// replication rounds the primary has out to the backups at once
+const std::size_t kRoundsInFlight = 8;
+
+// pooled client channels unused for this long are closed
+const int kChannelIdleSeconds = 300;
+
+// log indices are leased from the coordinator this many at a time
+const int64_t kSeqLeaseBlock = 1000;
+
+// points each unit of group weight puts on the consistent-hash ring
+const int64_t kRingVnodesPerWeight = 160;
+
+// the datanode dict is split into 1 << kDictShardBits locked shards
+const std::size_t kDictShardBits = 6;
+
+// lsm engine: a memtable this big is flushed to a level 0 table, level 0
+// is compacted into level 1 at kLsmL0Tables tables, level n >= 1 holds up
+// to kLsmLevelBaseBytes * 10^(n-1) bytes in tables of about kLsmTableBytes
+const std::size_t kLsmMemtableBytes = 4 << 20;
+const std::size_t kLsmL0Tables = 4;
+const std::size_t kLsmLevels = 7;
+const std::size_t kLsmLevelBaseBytes = 8 << 20;
+const std::size_t kLsmTableBytes = 2 << 20;
+// sorted table data blocks, bloom filter bits per key and the shared cache
+// of decoded blocks
+const std::size_t kTableBlockBytes = 4096;
+const std::size_t kBloomBitsPerKey = 10;
+const std::size_t kBlockCacheBytes = 32 << 20;
+
 std::string extract_data_node(const char* buf);
+// a datanode znode holds "<addr>|<weight>", weight defaults to 1
+std::string make_node_data(const std::string& addr, int64_t weight);
+void parse_node_data(const char* buf, std::string* addr, int64_t* weight);
+// the smallest key greater than every key starting with prefix, or "" if
+// there is none, so [prefix, prefix_end(prefix)) is the prefix range
+std::string prefix_end(const std::string& prefix);
+// split the comma separated address list answered to a NODES request
+std::vector<std::string> split_addrs(const std::string& addrs);
+// "strong", "bounded" or "index" as a READ_CONSISTENCY, -1 for anything else
+int parse_consistency(const std::string& name);
+// wall clock milliseconds since the epoch, the time base of key TTLs
+int64_t now_ms();
+// FNV-1a with a murmur3 finalizer. Unlike std::hash it is the same in every
+// build, so clients, the master and the datanodes agree on key placement,
+// and sorted tables written by one build filter keys the same in the next.
+uint64_t stable_hash(const std::string &data);
+
+}
 
-}
\ No newline at end of file
+#endif
@@ -0,0 +1,36 @@
+#include <algorithm>
+
+#include "defines.h"
+#include "hash_ring.h"
+
+kvdefs::HashRing::HashRing(const std::map<std::string, int64_t> &weights)
+    : weights_(weights) {
+  for (const auto &w : weights_) {
+    const int64_t points = std::max<int64_t>(w.second, 1) * kRingVnodesPerWeight;
+    for (int64_t i = 0; i < points; ++i)
+      points_.emplace_back(stable_hash(w.first + "#" + std::to_string(i)),
+                           w.first);
+  }
+  std::sort(points_.begin(), points_.end());
+}
+
+const std::string &kvdefs::HashRing::NodeFor(const std::string &key) const {
+  static const std::string none;
+  if (points_.empty()) return none;
+
+  const uint64_t h = stable_hash(key);
+  auto it = std::lower_bound(
+      points_.begin(), points_.end(), h,
+      [](const std::pair<uint64_t, std::string> &p, uint64_t v) {
+        return p.first < v;
+      });
+  if (it == points_.end()) it = points_.begin();
+  return it->second;
+}
+
+kvdefs::HashRing kvdefs::ring_from_table(const kvStore::RouteTable &table) {
+  std::map<std::string, int64_t> weights;
+  for (const auto &entry : table.entries())
+    weights[entry.node()] = entry.weight();
+  return HashRing(weights);
+}
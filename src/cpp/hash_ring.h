@@ -0,0 +1,41 @@
+#ifndef KVSTORE_HASH_RING_H
+#define KVSTORE_HASH_RING_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "kvstore.pb.h"
+
+namespace kvdefs {
+
+// Consistent-hash ring over datanode groups ("data<N>").
+//
+// A group of weight w owns w * kRingVnodesPerWeight points on the ring, and
+// a key belongs to the group of the first point at or after its hash.
+// Adding or removing a group only moves the keys between its points and
+// their predecessors, about 1/N of the data, instead of remapping nearly
+// every key like hash % groups.
+class HashRing {
+public:
+  HashRing() {}
+  explicit HashRing(const std::map<std::string, int64_t> &weights);
+
+  // the group owning key, "" if the ring is empty
+  const std::string &NodeFor(const std::string &key) const;
+  const std::map<std::string, int64_t> &Weights() const { return weights_; }
+  bool Empty() const { return points_.empty(); }
+
+private:
+  std::map<std::string, int64_t> weights_;
+  std::vector<std::pair<uint64_t, std::string>> points_;  // sorted by hash
+};
+
+// the ring described by a routing table, addresses play no part in it
+HashRing ring_from_table(const kvStore::RouteTable &table);
+
+}
+
+#endif
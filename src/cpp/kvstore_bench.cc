@@ -0,0 +1,516 @@
+// YCSB-style load generator for a running cluster.
+//
+//   kvstore_bench -t <master addr> [-w a|b|c|d|e|f] [-T threads]
+//                 [-c connections] [-n records] [-l] [-d seconds]
+//                 [-W warmup seconds] [-R target ops/s] [-r uniform|zipfian]
+//                 [-k key bytes] [-v value bytes] [-s fixed|uniform|zipfian]
+//                 [-C strong|bounded|index]
+//
+// Workloads follow the YCSB core set: a 50/50 read/update, b 95/5
+// read/update, c read only, d 95/5 read/insert reading the latest keys, e
+// 95/5 short scan/insert, f 50/50 read/read-modify-write. -l loads the
+// records first. Without -R every thread issues its next op as soon as the
+// last one returns (closed loop); with -R ops are scheduled at the target
+// rate and latency counts from the scheduled time, so a stalled server shows
+// up in the tail instead of just lowering the rate (open loop). -C picks the
+// consistency of reads; bounded and index reads are spread over every member
+// of a group instead of just its primary.
+//
+// Each phase prints one JSON line with ops/s and per-op latency percentiles
+// in microseconds. Threads route keys themselves through the master's
+// routing table, like kvstore_client.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "defines.h"
+#include "hash_ring.h"
+#include "metrics.h"
+
+#include <grpcpp/grpcpp.h>
+
+#include "kvstore.grpc.pb.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+// 32 buckets per power of two, so any percentile is within about 3% of the
+// true value
+const int kLatencySubBits = 5;
+
+typedef std::map<std::string, std::unique_ptr<kvdefs::Histogram>>
+    LatencyHistograms;
+
+// the histogram of op in histograms, made on first use
+kvdefs::Histogram &latency_of(LatencyHistograms *histograms,
+                              const std::string &op) {
+  std::unique_ptr<kvdefs::Histogram> &h = (*histograms)[op];
+  if (!h) h.reset(new kvdefs::Histogram(kLatencySubBits));
+  return *h;
+}
+
+// Zipfian ranks over [0, n) as in YCSB (Gray et al., "Quickly generating
+// billion-record synthetic databases"), rank 0 being the most popular.
+class ZipfianGenerator {
+public:
+  ZipfianGenerator(uint64_t n, double theta = 0.99)
+      : n_(std::max<uint64_t>(n, 1)), theta_(theta) {
+    double zetan = 0;
+    for (uint64_t i = 1; i <= n_; ++i) zetan += 1 / std::pow(double(i), theta_);
+    const double zeta2 = 1 + 1 / std::pow(2.0, theta_);
+    zetan_ = zetan;
+    alpha_ = 1 / (1 - theta_);
+    eta_ = (1 - std::pow(2.0 / n_, 1 - theta_)) / (1 - zeta2 / zetan_);
+  }
+
+  uint64_t Next(std::mt19937_64 &rng) const {
+    const double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    const double uz = u * zetan_;
+    if (uz < 1) return 0;
+    if (uz < 1 + std::pow(0.5, theta_)) return 1;
+    return std::min<uint64_t>(
+        n_ * std::pow(eta_ * u - eta_ + 1, alpha_), n_ - 1);
+  }
+
+private:
+  uint64_t n_;
+  double theta_;
+  double zetan_;
+  double alpha_;
+  double eta_;
+};
+
+struct BenchOptions {
+  BenchOptions()
+      : workload('a'), threads(1), connections(1), records(10000),
+        load(false), duration_s(10), warmup_s(0), target_ops(0),
+        request_dist("zipfian"), key_bytes(0), value_bytes(100),
+        value_dist("fixed"), consistency(kvdefs::READ_STRONG) {}
+
+  std::string target;
+  char workload;
+  int threads;
+  int connections;
+  uint64_t records;
+  bool load;
+  double duration_s;
+  double warmup_s;
+  double target_ops;
+  std::string request_dist;
+  std::size_t key_bytes;
+  std::size_t value_bytes;
+  std::string value_dist;
+  int consistency;  // a READ_CONSISTENCY
+};
+
+// op mix of a YCSB core workload, in percent
+struct WorkloadMix {
+  int read, update, insert, scan, rmw;
+  bool latest;  // reads favour recently inserted keys
+};
+
+WorkloadMix mix_for(char workload) {
+  switch (workload) {
+  case 'a': return WorkloadMix{50, 50, 0, 0, 0, false};
+  case 'b': return WorkloadMix{95, 5, 0, 0, 0, false};
+  case 'c': return WorkloadMix{100, 0, 0, 0, 0, false};
+  case 'd': return WorkloadMix{95, 0, 5, 0, 0, true};
+  case 'e': return WorkloadMix{0, 0, 5, 95, 0, false};
+  case 'f': return WorkloadMix{50, 0, 0, 0, 50, false};
+  }
+  return WorkloadMix{-1, 0, 0, 0, 0, false};
+}
+
+// One channel per (address, connection), so -c spreads the threads over
+// that many HTTP/2 connections to each node instead of sharing one.
+std::shared_ptr<grpc::Channel> bench_channel(const std::string &addr,
+                                             int conn) {
+  static std::mutex mutex;
+  static std::map<std::pair<std::string, int>, std::shared_ptr<grpc::Channel>>
+      channels;
+  std::lock_guard<std::mutex> guard(mutex);
+  std::shared_ptr<grpc::Channel> &channel = channels[std::make_pair(addr, conn)];
+  if (!channel) {
+    grpc::ChannelArguments args;
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    args.SetInt("kvstore.bench_connection", conn);
+    channel = grpc::CreateCustomChannel(
+        addr, grpc::InsecureChannelCredentials(), args);
+  }
+  return channel;
+}
+
+// the key of record i, hashed so popular ranks spread over the ring
+std::string bench_key(uint64_t i, std::size_t key_bytes) {
+  std::string key = "user" + std::to_string(kvdefs::stable_hash(std::to_string(i)));
+  if (key.size() < key_bytes) key.append(key_bytes - key.size(), '0');
+  return key;
+}
+
+// One load thread: its own routing table copy, stubs, rng and histograms,
+// so threads share nothing but the op counters.
+class BenchWorker {
+public:
+  BenchWorker(const BenchOptions &opts, int id, const ZipfianGenerator *zipf,
+              const ZipfianGenerator *size_zipf,
+              std::atomic<uint64_t> *next_insert)
+      : opts_(opts), mix_(mix_for(opts.workload)), conn_(id % opts.connections),
+        rng_(0x9E3779B97F4A7C15ull * (id + 1)), zipf_(zipf),
+        size_zipf_(size_zipf),
+        next_insert_(next_insert), recording_(true), route_epoch_(0),
+        next_replica_(0), errors_(0),
+        master_(kvStore::KvNodeService::NewStub(
+            bench_channel(opts.target, conn_))) {}
+
+  // PUT records [first, last)
+  void Load(uint64_t first, uint64_t last) {
+    for (uint64_t i = first; i < last; ++i) {
+      const bench_clock::time_point start = bench_clock::now();
+      const bool ok = Put(bench_key(i, opts_.key_bytes));
+      Finish("insert", start, ok);
+    }
+  }
+
+  // Issue ops until end, recording those that start after record_from.
+  void Run(bench_clock::time_point record_from, bench_clock::time_point end) {
+    const double rate = opts_.target_ops / opts_.threads;
+    bench_clock::time_point next = bench_clock::now();
+    while (true) {
+      bench_clock::time_point start = bench_clock::now();
+      if (rate > 0) {
+        // open loop: wait for the slot, but charge a late op from its slot
+        if (next > start) std::this_thread::sleep_until(next);
+        start = next;
+        next += std::chrono::duration_cast<bench_clock::duration>(
+            std::chrono::duration<double>(1 / rate));
+      }
+      if (start >= end) break;
+      recording_ = start >= record_from;
+      DoOp(start);
+    }
+  }
+
+  const LatencyHistograms &Histograms() const {
+    return histograms_;
+  }
+  uint64_t Errors() const { return errors_; }
+
+private:
+  void DoOp(bench_clock::time_point start) {
+    const int dice = std::uniform_int_distribution<int>(0, 99)(rng_);
+    if (dice < mix_.read) {
+      Finish("read", start, Read(ChooseKey(), nullptr));
+    } else if (dice < mix_.read + mix_.update) {
+      Finish("update", start, Put(ChooseKey()));
+    } else if (dice < mix_.read + mix_.update + mix_.insert) {
+      Finish("insert", start, Put(bench_key(next_insert_->fetch_add(1), opts_.key_bytes)));
+    } else if (dice < mix_.read + mix_.update + mix_.insert + mix_.scan) {
+      const int len = std::uniform_int_distribution<int>(1, 100)(rng_);
+      Finish("scan", start, Scan(ChooseKey(), len));
+    } else {
+      const std::string key = ChooseKey();
+      std::string value;
+      Finish("rmw", start, Read(key, &value) && Put(key));
+    }
+  }
+
+  void Finish(const char *op, bench_clock::time_point start, bool ok) {
+    if (!recording_) return;
+    if (!ok) ++errors_;
+    latency_of(&histograms_, op)
+        .Record(std::chrono::duration_cast<std::chrono::microseconds>(
+                    bench_clock::now() - start)
+                    .count());
+  }
+
+  std::string ChooseKey() {
+    const uint64_t inserted = next_insert_->load();
+    uint64_t i;
+    if (mix_.latest) {
+      i = inserted - 1 - std::min(zipf_->Next(rng_), inserted - 1);
+    } else if (opts_.request_dist == "uniform") {
+      i = std::uniform_int_distribution<uint64_t>(0, opts_.records - 1)(rng_);
+    } else {
+      i = zipf_->Next(rng_);
+    }
+    return bench_key(i, opts_.key_bytes);
+  }
+
+  std::string MakeValue() {
+    std::size_t size = opts_.value_bytes;
+    if (opts_.value_dist == "uniform")
+      size = std::uniform_int_distribution<std::size_t>(1, opts_.value_bytes)(rng_);
+    else if (opts_.value_dist == "zipfian")
+      size = size_zipf_->Next(rng_) + 1;
+    return std::string(size, 'a' + rng_() % 26);
+  }
+
+  bool Put(const std::string &key) {
+    kvStore::RequestContent req;
+    req.set_key(key);
+    req.set_value(MakeValue());
+    req.set_op(kvdefs::PUT);
+    kvStore::RequestResult result;
+    return Send(&req, &result) && result.err() == kvdefs::OK;
+  }
+
+  bool Read(const std::string &key, std::string *value) {
+    kvStore::RequestContent req;
+    req.set_key(key);
+    req.set_op(kvdefs::READ);
+    req.set_consistency(opts_.consistency);
+    kvStore::RequestResult result;
+    if (!Send(&req, &result)) return false;
+    if (value) *value = result.value();
+    return result.err() == kvdefs::OK || result.err() == kvdefs::NOTFOUND;
+  }
+
+  // the first len keys from start, one stream per group and no merging:
+  // every group has to be read for them either way
+  bool Scan(const std::string &start, int len) {
+    if (routes_.empty() && !RefreshRoutes()) return false;
+    kvStore::ScanRequest scan;
+    scan.set_start(start);
+    scan.set_limit(len);
+    bool ok = true;
+    for (const auto &e : routes_) {
+      grpc::ClientContext context;
+      std::unique_ptr<grpc::ClientReader<kvStore::ScanChunk>> reader(
+          Stub(e.second)->Scan(&context, scan));
+      kvStore::ScanChunk chunk;
+      while (reader->Read(&chunk)) {}
+      ok = reader->Finish().ok() && ok;
+    }
+    return ok;
+  }
+
+  // Straight to the key's group, refreshing the table once on STALE or an
+  // unreachable node. Follower reads go to the group's members in turn and
+  // fall back to the primary when one answers BEHIND.
+  bool Send(kvStore::RequestContent *req, kvStore::RequestResult *result) {
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      if (routes_.empty() && !RefreshRoutes()) continue;
+      const std::string node = ring_.NodeFor(req->key());
+      auto it = routes_.find(node);
+      if (it == routes_.end()) {
+        RefreshRoutes();
+        continue;
+      }
+      std::string addr = it->second;
+      if (req->op() == kvdefs::READ &&
+          req->consistency() != kvdefs::READ_STRONG) {
+        const std::vector<std::string> &replicas = replicas_[node];
+        const std::size_t pick = next_replica_++ % (replicas.size() + 1);
+        if (pick) addr = replicas[pick - 1];
+        req->set_min_index(seen_index_[node]);
+      }
+      req->set_epoch(route_epoch_);
+      result->Clear();
+      grpc::ClientContext context;
+      grpc::Status status = Stub(addr)->Request(&context, *req, result);
+      if (status.ok() && result->err() == kvdefs::BEHIND) {
+        req->set_consistency(kvdefs::READ_STRONG);
+        continue;
+      }
+      if (status.ok() && result->err() != kvdefs::STALE) {
+        seen_index_[node] = std::max(seen_index_[node], result->index());
+        return true;
+      }
+      RefreshRoutes();
+    }
+    return false;
+  }
+
+  bool RefreshRoutes() {
+    routes_.clear();
+    replicas_.clear();
+    kvStore::RouteRequest request;
+    kvStore::RouteTable table;
+    grpc::ClientContext context;
+    if (!master_->Route(&context, request, &table).ok()) return false;
+    for (const auto &entry : table.entries()) {
+      routes_[entry.node()] = entry.addr();
+      replicas_[entry.node()].assign(entry.replicas().begin(),
+                                     entry.replicas().end());
+    }
+    ring_ = kvdefs::ring_from_table(table);
+    route_epoch_ = table.epoch();
+    return true;
+  }
+
+  kvStore::KvNodeService::Stub *Stub(const std::string &addr) {
+    std::unique_ptr<kvStore::KvNodeService::Stub> &stub = stubs_[addr];
+    if (!stub) stub = kvStore::KvNodeService::NewStub(bench_channel(addr, conn_));
+    return stub.get();
+  }
+
+  const BenchOptions &opts_;
+  const WorkloadMix mix_;
+  const int conn_;
+  std::mt19937_64 rng_;
+  const ZipfianGenerator *zipf_;
+  // value sizes in [1, value_bytes], apart from the keys' ranks as YCSB
+  // keeps field lengths
+  const ZipfianGenerator *size_zipf_;
+  std::atomic<uint64_t> *next_insert_;
+  bool recording_;
+
+  std::map<std::string, std::string> routes_;
+  std::map<std::string, std::vector<std::string>> replicas_;
+  kvdefs::HashRing ring_;
+  int64_t route_epoch_;
+  std::size_t next_replica_;
+  // highest log index seen per group, the floor of bounded reads
+  std::map<std::string, int64_t> seen_index_;
+  uint64_t errors_;
+  std::unique_ptr<kvStore::KvNodeService::Stub> master_;
+  std::map<std::string, std::unique_ptr<kvStore::KvNodeService::Stub>> stubs_;
+  LatencyHistograms histograms_;
+};
+
+// one JSON line summing up a phase over every worker
+void report(const std::string &phase, const BenchOptions &opts,
+            const std::vector<std::unique_ptr<BenchWorker>> &workers,
+            double seconds) {
+  LatencyHistograms merged;
+  uint64_t ops = 0, errors = 0;
+  for (const auto &w : workers) {
+    for (const auto &h : w->Histograms())
+      latency_of(&merged, h.first).Merge(*h.second);
+    errors += w->Errors();
+  }
+  for (const auto &h : merged) ops += h.second->Count();
+
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(1);
+  out << "{\"phase\":\"" << phase << "\",\"workload\":\"" << opts.workload
+      << "\",\"threads\":" << opts.threads
+      << ",\"connections\":" << opts.connections
+      << ",\"mode\":\"" << (opts.target_ops > 0 ? "open" : "closed")
+      << "\",\"target_ops_per_sec\":" << opts.target_ops
+      << ",\"seconds\":" << seconds << ",\"ops\":" << ops
+      << ",\"errors\":" << errors
+      << ",\"ops_per_sec\":" << (seconds > 0 ? ops / seconds : 0)
+      << ",\"latency_us\":{";
+  bool first = true;
+  for (const auto &h : merged) {
+    if (!first) out << ",";
+    first = false;
+    out << "\"" << h.first << "\":{\"count\":" << h.second->Count()
+        << ",\"mean\":" << h.second->Mean()
+        << ",\"p50\":" << h.second->Percentile(0.5)
+        << ",\"p99\":" << h.second->Percentile(0.99)
+        << ",\"p999\":" << h.second->Percentile(0.999)
+        << ",\"max\":" << h.second->Max() << "}";
+  }
+  out << "}}";
+  std::cout << out.str() << std::endl;
+}
+
+int main(int argc, char **argv) {
+  BenchOptions opts;
+  // parse args
+  {
+    int o = -1;
+    const char *optstring = "t:w:T:c:n:ld:W:R:r:k:v:s:C:";
+    while ((o = getopt(argc, argv, optstring)) != -1) {
+      switch (o) {
+      case 't': opts.target = optarg; break;
+      case 'w': opts.workload = optarg[0]; break;
+      case 'T': opts.threads = std::max(atoi(optarg), 1); break;
+      case 'c': opts.connections = std::max(atoi(optarg), 1); break;
+      case 'n': opts.records = std::max(atoll(optarg), 1LL); break;
+      case 'l': opts.load = true; break;
+      case 'd': opts.duration_s = std::max(atof(optarg), 0.0); break;
+      case 'W': opts.warmup_s = std::max(atof(optarg), 0.0); break;
+      case 'R': opts.target_ops = std::max(atof(optarg), 0.0); break;
+      case 'r': opts.request_dist = optarg; break;
+      case 'k': opts.key_bytes = atoi(optarg); break;
+      case 'v': opts.value_bytes = std::max(atoi(optarg), 1); break;
+      case 's': opts.value_dist = optarg; break;
+      case 'C': opts.consistency = kvdefs::parse_consistency(optarg); break;
+      }
+    }
+    if (opts.target.empty()) {
+      std::cerr << "Must set -t <addr>" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (mix_for(opts.workload).read < 0) {
+      std::cerr << "-w must be one of a|b|c|d|e|f" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (opts.consistency < 0) {
+      std::cerr << "-C must be one of strong|bounded|index" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (opts.request_dist != "uniform" && opts.request_dist != "zipfian") {
+      std::cerr << "-r must be one of uniform|zipfian" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (opts.value_dist != "fixed" && opts.value_dist != "uniform" &&
+        opts.value_dist != "zipfian") {
+      std::cerr << "-s must be one of fixed|uniform|zipfian" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  const ZipfianGenerator zipf(opts.records);
+  const ZipfianGenerator size_zipf(opts.value_bytes);
+  std::atomic<uint64_t> next_insert(opts.records);
+  std::vector<std::unique_ptr<BenchWorker>> workers;
+  for (int i = 0; i < opts.threads; ++i)
+    workers.emplace_back(
+        new BenchWorker(opts, i, &zipf, &size_zipf, &next_insert));
+
+  if (opts.load) {
+    const bench_clock::time_point start = bench_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < opts.threads; ++i) {
+      const uint64_t first = opts.records * i / opts.threads;
+      const uint64_t last = opts.records * (i + 1) / opts.threads;
+      threads.emplace_back([&workers, i, first, last]() {
+        workers[i]->Load(first, last);
+      });
+    }
+    for (auto &t : threads) t.join();
+    report("load", opts, workers,
+           std::chrono::duration<double>(bench_clock::now() - start).count());
+    // the run phase reports its own numbers
+    for (int i = 0; i < opts.threads; ++i)
+      workers[i].reset(
+          new BenchWorker(opts, i, &zipf, &size_zipf, &next_insert));
+  }
+
+  const bench_clock::time_point start = bench_clock::now();
+  const bench_clock::time_point record_from =
+      start + std::chrono::duration_cast<bench_clock::duration>(
+                  std::chrono::duration<double>(opts.warmup_s));
+  const bench_clock::time_point end =
+      record_from + std::chrono::duration_cast<bench_clock::duration>(
+                        std::chrono::duration<double>(opts.duration_s));
+  std::vector<std::thread> threads;
+  for (auto &w : workers) {
+    BenchWorker *worker = w.get();
+    threads.emplace_back([worker, record_from, end]() {
+      worker->Run(record_from, end);
+    });
+  }
+  for (auto &t : threads) t.join();
+  report("run", opts, workers,
+         std::chrono::duration<double>(bench_clock::now() - record_from).count());
+
+  return 0;
+}
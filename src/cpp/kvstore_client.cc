@@ -1,9 +1,16 @@
 #include <iostream>
+#include <algorithm>
+#include <map>
 #include <memory>
+#include <sstream>
 #include <string>
+#include <utility>
+#include <vector>
 #include <unistd.h>
 
+#include "channel_pool.h"
 #include "defines.h"
+#include "hash_ring.h"
 
 #include <grpcpp/grpcpp.h>
 
@@ -11,9 +18,10 @@
 
 class KvStoreClient {
  public:
-   KvStoreClient(std::shared_ptr<grpc::Channel> channel)
+   KvStoreClient(std::shared_ptr<grpc::Channel> channel, int consistency)
        : stub_(kvStore::KvNodeService::NewStub(channel)),
-         old_stub_(nullptr) {}
+         consistency_(consistency), route_epoch_(0), routing_(true),
+         next_replica_(0) {}
 
    int SayHello(const std::string &user) {
      kvStore::HelloRequest request;
@@ -35,15 +43,16 @@ class KvStoreClient {
      }
   }
 
-  void RequestPut(const std::string &key, const std::string &value) {
+  void RequestPut(const std::string &key, const std::string &value,
+                  int64_t ttl_ms = 0) {
     kvStore::RequestContent keyValue;
     keyValue.set_key(key);
     keyValue.set_value(value);
     keyValue.set_op(kvdefs::PUT);
+    keyValue.set_ttl_ms(ttl_ms);
     kvStore::RequestResult result;
-    grpc::ClientContext context;
 
-    grpc::Status status = stub_->Request(&context, keyValue, &result);
+    grpc::Status status = Send(&keyValue, &result);
     if(!status.ok() || result.err() == kvdefs::FAILED) {
       std::cout << "Put request failed." << std::endl;
       return;
@@ -52,11 +61,6 @@ class KvStoreClient {
     if(result.err() == kvdefs::OK) {
       std::cout << "Put request success." << std::endl;
     }
-    else if(result.err() == kvdefs::REDIRECT)  {
-      RedirectToDatanode(result.value());
-      RequestPut(key, value);
-      RedirectToMasternode();
-    }
   }
 
   void RequestRead(const std::string &key) {
@@ -64,11 +68,12 @@ class KvStoreClient {
     keyString.set_key(key);
     keyString.set_value("");
     keyString.set_op(kvdefs::READ);
+    keyString.set_consistency(consistency_);
     kvStore::RequestResult result;
-    grpc::ClientContext context;
 
-    grpc::Status status = stub_->Request(&context, keyString, &result);
-    if(!status.ok() || result.err() == kvdefs::FAILED) {
+    grpc::Status status = Send(&keyString, &result);
+    if(!status.ok() || result.err() == kvdefs::FAILED ||
+       result.err() == kvdefs::BEHIND) {
       std::cout << "Read request failed." << std::endl;
       return;
     }
@@ -77,10 +82,6 @@ class KvStoreClient {
       std::cout << result.value() << std::endl;
     } else if (result.err() == kvdefs::NOTFOUND) {
       std::cout << "not found" << std::endl;
-    } else if (result.err() == kvdefs::REDIRECT) {
-      RedirectToDatanode(result.value());
-      RequestRead(key);
-      RedirectToMasternode();
     }
   }
 
@@ -90,9 +91,8 @@ class KvStoreClient {
     keyString.set_value("");
     keyString.set_op(kvdefs::DELETE);
     kvStore::RequestResult result;
-    grpc::ClientContext context;
 
-    grpc::Status status = stub_->Request(&context, keyString, &result);
+    grpc::Status status = Send(&keyString, &result);
     if(!status.ok() || result.err() == kvdefs::FAILED) {
       std::cout << "Delete request failed." << std::endl;
       return;
@@ -102,53 +102,428 @@ class KvStoreClient {
       std::cout << "Delete request success." << std::endl;
     } else if (result.err() == kvdefs::NOTFOUND) {
       std::cout << "not found" << std::endl;
-    } else if (result.err() == kvdefs::REDIRECT) {
-      RedirectToDatanode(result.value());
-      RequestDelete(key);
-      RedirectToMasternode();
     }
   }
 
+  void RequestMultiPut(
+      const std::vector<std::pair<std::string, std::string>> &kvs) {
+    kvStore::MultiRequestContent batch;
+    for (const auto &kv : kvs) {
+      kvStore::RequestContent *req = batch.add_reqs();
+      req->set_key(kv.first);
+      req->set_value(kv.second);
+      req->set_op(kvdefs::PUT);
+    }
+    PrintMultiResult(batch, "Put");
+  }
+
+  void RequestMultiRead(const std::vector<std::string> &keys) {
+    kvStore::MultiRequestContent batch;
+    for (const std::string &key : keys) {
+      kvStore::RequestContent *req = batch.add_reqs();
+      req->set_key(key);
+      req->set_op(kvdefs::READ);
+      req->set_consistency(consistency_);
+    }
+    PrintMultiResult(batch, "Read");
+  }
+
+  void RequestMultiDelete(const std::vector<std::string> &keys) {
+    kvStore::MultiRequestContent batch;
+    for (const std::string &key : keys) {
+      kvStore::RequestContent *req = batch.add_reqs();
+      req->set_key(key);
+      req->set_op(kvdefs::DELETE);
+    }
+    PrintMultiResult(batch, "Delete");
+  }
+
+  // Open a Scan stream on every datanode group and k-way merge them, each
+  // group only holds the keys the master hashed to it.
+  void RequestScan(const kvStore::ScanRequest &scan) {
+    std::vector<std::unique_ptr<ScanStream>> streams;
+    for (const std::string &addr : ScanTargets()) {
+      std::unique_ptr<ScanStream> stream(new ScanStream);
+      stream->stub =
+          kvStore::KvNodeService::NewStub(kvdefs::get_channel(addr));
+      stream->reader = stream->stub->Scan(&stream->context, scan);
+      stream->pos = 0;
+      if (stream->Next()) streams.push_back(std::move(stream));
+    }
+
+    // min-heap of streams ordered by their current key
+    auto greater = [](const std::unique_ptr<ScanStream> &a,
+                      const std::unique_ptr<ScanStream> &b) {
+      return a->Key() > b->Key();
+    };
+    std::make_heap(streams.begin(), streams.end(), greater);
+
+    int64_t count = 0;
+    while (streams.size() && (scan.limit() <= 0 || count < scan.limit())) {
+      std::pop_heap(streams.begin(), streams.end(), greater);
+      ScanStream &stream = *streams.back();
+      const kvStore::RequestContent &kv = stream.chunk.kvs(stream.pos);
+      std::cout << kv.key() << ": " << kv.value() << std::endl;
+      ++count;
+
+      ++stream.pos;
+      if (stream.Next())
+        std::push_heap(streams.begin(), streams.end(), greater);
+      else
+        streams.pop_back();
+    }
+    // the limit was hit, stop the groups still streaming
+    for (auto &stream : streams) {
+      stream->context.TryCancel();
+      stream->reader->Finish();
+    }
+    std::cout << count << " keys scanned." << std::endl;
+  }
+
+  // print the metrics of the target, or of the node at addr when given
+  int RequestStats(const std::string &addr) {
+    kvStore::KvNodeService::Stub *target =
+        addr.empty() ? stub_.get() : DatanodeStub(addr);
+
+    kvStore::StatsRequest request;
+    request.set_text(true);
+    kvStore::StatsReply reply;
+    grpc::ClientContext context;
+
+    grpc::Status status = target->Stats(&context, request, &reply);
+    if (!status.ok()) {
+      std::cout << "Stats request failed: " << status.error_message()
+                << std::endl;
+      return -1;
+    }
+    std::cout << reply.text();
+    return 0;
+  }
+
 private:
+  // one group's side of a scan, chunk.kvs(pos) is its current key
+  struct ScanStream {
+    std::unique_ptr<kvStore::KvNodeService::Stub> stub;
+    grpc::ClientContext context;
+    std::unique_ptr<grpc::ClientReader<kvStore::ScanChunk>> reader;
+    kvStore::ScanChunk chunk;
+    int pos;
+
+    // make sure a current key exists, reading chunks as needed
+    bool Next() {
+      while (pos >= chunk.kvs_size()) {
+        pos = 0;
+        if (!reader->Read(&chunk)) {
+          grpc::Status status = reader->Finish();
+          if (!status.ok())
+            std::cout << "Scan stream failed: " << status.error_message()
+                      << std::endl;
+          return false;
+        }
+      }
+      return true;
+    }
+    const std::string &Key() const { return chunk.kvs(pos).key(); }
+  };
+
   std::unique_ptr<kvStore::KvNodeService::Stub> stub_;
-  std::unique_ptr<kvStore::KvNodeService::Stub> old_stub_;
+  // a READ_CONSISTENCY for every read
+  const int consistency_;
+
+  // the master's routing table as of route_epoch_, empty until fetched
+  std::map<std::string, std::string> routes_;
+  std::map<std::string, std::vector<std::string>> replicas_;
+  kvdefs::HashRing ring_;
+  int64_t route_epoch_;
+  // cleared when the target does not serve Route, e.g. it is a datanode
+  bool routing_;
+  // follower reads go round robin over a group's members
+  std::size_t next_replica_;
+  // the highest log index each group answered us with, bounded reads ask
+  // for at least as much so they never go back in time
+  std::map<std::string, int64_t> seen_index_;
+  std::map<std::string, std::unique_ptr<kvStore::KvNodeService::Stub>>
+      datanode_stubs_;
+
+  kvStore::KvNodeService::Stub *DatanodeStub(const std::string &addr) {
+    std::unique_ptr<kvStore::KvNodeService::Stub> &stub = datanode_stubs_[addr];
+    if (!stub)
+      stub = kvStore::KvNodeService::NewStub(kvdefs::get_channel(addr));
+    return stub.get();
+  }
+
+  bool RefreshRoutes() {
+    routes_.clear();
+    replicas_.clear();
+    ring_ = kvdefs::HashRing();
+    route_epoch_ = 0;
+    if (!routing_) return false;
+
+    kvStore::RouteRequest request;
+    kvStore::RouteTable table;
+    grpc::ClientContext context;
+    grpc::Status status = stub_->Route(&context, request, &table);
+    if (status.error_code() == grpc::StatusCode::UNIMPLEMENTED)
+      routing_ = false;
+    if (!status.ok()) return false;
+
+    for (const auto &entry : table.entries()) {
+      routes_[entry.node()] = entry.addr();
+      replicas_[entry.node()].assign(entry.replicas().begin(),
+                                     entry.replicas().end());
+    }
+    ring_ = kvdefs::ring_from_table(table);
+    route_epoch_ = table.epoch();
+    return true;
+  }
+
+  bool HaveRoutes() { return routes_.size() || RefreshRoutes(); }
+
+  // The cached address to send req to: its group's primary, or for a
+  // follower read the group's members in turn. "" if the table has no such
+  // group.
+  std::string RouteFor(const kvStore::RequestContent &req) {
+    const std::string node = ring_.NodeFor(req.key());
+    auto it = routes_.find(node);
+    if (it == routes_.end()) return "";
+    if (req.op() != kvdefs::READ || req.consistency() == kvdefs::READ_STRONG)
+      return it->second;
+    const std::vector<std::string> &replicas = replicas_[node];
+    const std::size_t pick = next_replica_++ % (replicas.size() + 1);
+    return pick ? replicas[pick - 1] : it->second;
+  }
+
+  // set a routed read's floor and remember the index result answered with
+  void PrepareRead(kvStore::RequestContent *req) {
+    if (req->op() == kvdefs::READ)
+      req->set_min_index(seen_index_[ring_.NodeFor(req->key())]);
+  }
+  void NoteIndex(const kvStore::RequestContent &req,
+                 const kvStore::RequestResult &result) {
+    int64_t &seen = seen_index_[ring_.NodeFor(req.key())];
+    seen = std::max(seen, result.index());
+  }
+
+  // Send req straight to its datanode through the cached routing table. A
+  // STALE answer or an unreachable node refreshes the table and tries once
+  // more, a follower read answered BEHIND is asked of the primary. Returns
+  // false if the request could not be routed this way.
+  bool SendRouted(kvStore::RequestContent *req,
+                  kvStore::RequestResult *result) {
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      if (!HaveRoutes()) return false;
+      const std::string addr = RouteFor(*req);
+      if (addr.empty()) return false;
 
-  void RedirectToDatanode(const std::string& addr) {
-    std::shared_ptr<grpc::Channel> channel = grpc::CreateChannel(
-        addr, grpc::InsecureChannelCredentials());
-    std::unique_ptr<kvStore::KvNodeService::Stub> new_stub(kvStore::KvNodeService::NewStub(channel));
-    stub_.swap(new_stub);
-    old_stub_.swap(new_stub);
+      req->set_epoch(route_epoch_);
+      PrepareRead(req);
+      result->Clear();
+      grpc::ClientContext context;
+      grpc::Status status = DatanodeStub(addr)->Request(&context, *req, result);
+      if (status.ok() && result->err() == kvdefs::BEHIND) {
+        req->set_consistency(kvdefs::READ_STRONG);
+        continue;
+      }
+      if (status.ok() && result->err() != kvdefs::STALE) {
+        NoteIndex(*req, *result);
+        return true;
+      }
+      RefreshRoutes();
+    }
+    return false;
   }
 
-  void RedirectToMasternode() {
-    stub_.swap(old_stub_);
-    old_stub_.reset(nullptr);
+  // One hop when the routing table is usable, otherwise ask the target and
+  // follow its redirect. A redirect that went STALE because its keys moved
+  // to another group meanwhile is asked for once more.
+  grpc::Status Send(kvStore::RequestContent *req,
+                    kvStore::RequestResult *result) {
+    if (SendRouted(req, result)) return grpc::Status::OK;
+
+    req->set_epoch(0);
+    grpc::Status status;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      result->Clear();
+      grpc::ClientContext context;
+      status = stub_->Request(&context, *req, result);
+      if (!status.ok() || result->err() != kvdefs::REDIRECT) break;
+
+      const std::string addr = result->value();
+      result->Clear();
+      grpc::ClientContext redirect_context;
+      status = DatanodeStub(addr)->Request(&redirect_context, *req, result);
+      if (!status.ok() || result->err() != kvdefs::STALE) break;
+    }
+    return status;
+  }
+
+  // every datanode group to scan, from the routing table or else asked from
+  // the target; a datanode answers with just its own address
+  std::vector<std::string> ScanTargets() {
+    if (HaveRoutes()) {
+      std::vector<std::string> addrs;
+      for (const auto &e : routes_) addrs.push_back(e.second);
+      return addrs;
+    }
+
+    kvStore::RequestContent request;
+    request.set_op(kvdefs::NODES);
+    kvStore::RequestResult result;
+    grpc::ClientContext context;
+
+    grpc::Status status = stub_->Request(&context, request, &result);
+    if (!status.ok() || result.err() != kvdefs::OK) {
+      std::cout << "Listing datanodes failed." << std::endl;
+      return std::vector<std::string>();
+    }
+    return kvdefs::split_addrs(result.value());
+  }
+
+  // Send every datanode its keys of batch in one sub-batch tagged with
+  // epoch, groups maps addresses to indices into batch. Returns the indices
+  // whose group was unreachable or answered STALE or BEHIND; their results
+  // stay FAILED.
+  std::vector<int> SendGroups(
+      const kvStore::MultiRequestContent &batch,
+      const std::map<std::string, std::vector<int>> &groups, int64_t epoch,
+      kvStore::MultiRequestResult *results) {
+    std::vector<int> retry;
+    for (const auto &group : groups) {
+      kvStore::MultiRequestContent sub_batch;
+      for (int i : group.second) {
+        kvStore::RequestContent *req = sub_batch.add_reqs();
+        req->CopyFrom(batch.reqs(i));
+        req->set_epoch(epoch);
+        if (epoch) PrepareRead(req);
+      }
+
+      kvStore::MultiRequestResult sub_results;
+      grpc::ClientContext context;
+      grpc::Status status =
+          DatanodeStub(group.first)
+              ->MultiRequest(&context, sub_batch, &sub_results);
+      const bool ok =
+          status.ok() && sub_results.results_size() == sub_batch.reqs_size();
+
+      for (std::size_t j = 0; j < group.second.size(); ++j) {
+        if (!ok) {
+          retry.push_back(group.second[j]);
+          continue;
+        }
+        const kvStore::RequestResult &result = sub_results.results(j);
+        if (result.err() != kvdefs::STALE && result.err() != kvdefs::BEHIND) {
+          results->mutable_results(group.second[j])->CopyFrom(result);
+          if (epoch) NoteIndex(sub_batch.reqs(j), result);
+        } else {
+          retry.push_back(group.second[j]);
+        }
+      }
+    }
+    return retry;
+  }
+
+  // Group batch by datanode, from the routing table when there is one, else
+  // by asking the target, and send each group one sub-batch. Keys a stale
+  // table sent astray, and follower reads a replica could not serve, go
+  // through the target as strong reads. results->results(i) answers
+  // batch.reqs(i).
+  int RequestMulti(const kvStore::MultiRequestContent &batch,
+                   kvStore::MultiRequestResult *results) {
+    results->Clear();
+    std::vector<int> pending;
+    for (int i = 0; i < batch.reqs_size(); ++i) {
+      results->add_results()->set_err(kvdefs::FAILED);
+      pending.push_back(i);
+    }
+
+    std::map<std::string, std::vector<int>> groups;
+    bool retried = false;
+    if (HaveRoutes()) {
+      for (int i : pending) groups[RouteFor(batch.reqs(i))].push_back(i);
+      if (groups.count("") == 0) {
+        pending = SendGroups(batch, groups, route_epoch_, results);
+        if (pending.empty()) return 0;
+        RefreshRoutes();
+        retried = true;
+      }
+      groups.clear();
+    }
+
+    kvStore::MultiRequestContent rest;
+    for (int i : pending) {
+      kvStore::RequestContent *req = rest.add_reqs();
+      req->CopyFrom(batch.reqs(i));
+      if (retried) req->set_consistency(kvdefs::READ_STRONG);
+    }
+    kvStore::MultiRequestResult redirects;
+    grpc::ClientContext context;
+    grpc::Status status = stub_->MultiRequest(&context, rest, &redirects);
+    if (!status.ok() || redirects.results_size() != rest.reqs_size())
+      return -1;
+
+    for (std::size_t j = 0; j < pending.size(); ++j) {
+      if (redirects.results(j).err() == kvdefs::REDIRECT)
+        groups[redirects.results(j).value()].push_back(pending[j]);
+      else
+        results->mutable_results(pending[j])->CopyFrom(redirects.results(j));
+    }
+    SendGroups(batch, groups, 0, results);
+    return 0;
+  }
+
+  void PrintMultiResult(const kvStore::MultiRequestContent &batch,
+                        const std::string &what) {
+    kvStore::MultiRequestResult results;
+    if (RequestMulti(batch, &results)) {
+      std::cout << "Multi " << what << " request failed." << std::endl;
+      return;
+    }
+
+    for (int i = 0; i < batch.reqs_size(); ++i) {
+      const kvStore::RequestResult &result = results.results(i);
+      std::cout << batch.reqs(i).key() << ": ";
+      if (result.err() == kvdefs::OK && batch.reqs(i).op() == kvdefs::READ)
+        std::cout << result.value() << std::endl;
+      else if (result.err() == kvdefs::OK)
+        std::cout << what << " request success." << std::endl;
+      else if (result.err() == kvdefs::NOTFOUND)
+        std::cout << "not found" << std::endl;
+      else
+        std::cout << what << " request failed." << std::endl;
+    }
   }
 };
 
 int main(int argc, char** argv) {
   std::string target_str;
+  std::string consistency = "strong";
   // parse args
   {
     int o = -1;
-    const char *optstring = "t:";
+    const char *optstring = "t:C:";
     while ((o = getopt(argc, argv, optstring)) != -1) {
       switch (o) {
         case 't':
           target_str = optarg;
           break;
+        case 'C':
+          consistency = optarg;
+          break;
       }
     }
     if (target_str.empty()) {
       std::cerr << "Must set -t <addr>" << std::endl;
       exit(EXIT_FAILURE);
     }
+    if (kvdefs::parse_consistency(consistency) < 0) {
+      std::cerr << "-C must be one of strong|bounded|index" << std::endl;
+      exit(EXIT_FAILURE);
+    }
   }
 
   // establish connection then do hello check
-  KvStoreClient client(grpc::CreateChannel(
-      target_str, grpc::InsecureChannelCredentials()));
+  KvStoreClient client(kvdefs::get_channel(target_str),
+                       kvdefs::parse_consistency(consistency));
   std::string user("Hello ");
   if (client.SayHello(user))
     return 1;
@@ -156,23 +531,30 @@ int main(int argc, char** argv) {
   // hello check passed, loop client operation
   std::cout << "Connect established with " << target_str << std::endl
             << "=====================================" << std::endl
-            << "(p)ut <key> <value>" << std::endl
+            << "(p)ut <key> <value> [<ttl ms>]" << std::endl
             << "(d)elete <key>" << std::endl
             << "(r)ead <key>" << std::endl
+            << "(P)ut <key> <value> [<key> <value> ...]" << std::endl
+            << "(D)elete <key> [<key> ...]" << std::endl
+            << "(R)ead <key> [<key> ...]" << std::endl
+            << "(s)can <start> <end|-> [<limit>]" << std::endl
+            << "(S)can <prefix> [<limit>]" << std::endl
+            << "(i)nfo [<addr>]" << std::endl
             << "(q)uit" << std::endl
             << "=====================================" << std::endl;
   char op;
-  std::string key, value;
+  std::string key, value, line;
   while (1) {
     std::cin >> op;
 
     switch (op) {
-    case 'p':
-      std::cin >> key >> value;
-      client.RequestPut(key, value);
-      std::cin.clear();
-      std::cin.ignore(INT_MAX, '\n');
-      break;
+    case 'p': {
+      std::getline(std::cin, line);
+      std::istringstream strm(line);
+      int64_t ttl_ms = 0;
+      strm >> key >> value >> ttl_ms;
+      client.RequestPut(key, value, ttl_ms);
+    } break;
 
     case 'd':
       std::cin >> key;
@@ -188,6 +570,55 @@ int main(int argc, char** argv) {
       std::cin.ignore(INT_MAX, '\n');
       break;
 
+    case 'P': {
+      std::getline(std::cin, line);
+      std::istringstream strm(line);
+      std::vector<std::pair<std::string, std::string>> kvs;
+      while (strm >> key >> value)
+        kvs.emplace_back(key, value);
+      client.RequestMultiPut(kvs);
+    } break;
+
+    case 'D':
+    case 'R': {
+      std::getline(std::cin, line);
+      std::istringstream strm(line);
+      std::vector<std::string> keys;
+      while (strm >> key)
+        keys.push_back(key);
+      if (op == 'D')
+        client.RequestMultiDelete(keys);
+      else
+        client.RequestMultiRead(keys);
+    } break;
+
+    case 's':
+    case 'S': {
+      std::getline(std::cin, line);
+      std::istringstream strm(line);
+      kvStore::ScanRequest scan;
+      int64_t limit = 0;
+      value = "-";
+      if (op == 's') {
+        strm >> key >> value >> limit;
+        scan.set_start(key);
+        if (value != "-") scan.set_end(value);
+      } else {
+        strm >> key >> limit;
+        scan.set_prefix(key);
+      }
+      scan.set_limit(limit);
+      client.RequestScan(scan);
+    } break;
+
+    case 'i': {
+      std::getline(std::cin, line);
+      std::istringstream strm(line);
+      std::string addr;
+      strm >> addr;
+      client.RequestStats(addr);
+    } break;
+
     case 'q':
       return 0;
 
@@ -0,0 +1,189 @@
+// A whole cluster in one process, for benchmarks and tests that need the
+// same layout every run without a zookeeper ensemble.
+//
+//   kvstore_cluster [-h host] [-p base port] [-g groups] [-r replicas]
+//                   [-w wal dir] [-f none|group|periodic] [-n entries] [-a]
+//                   [-x none|deflate] [-X min bytes] [-e map|lsm]
+//
+// The master listens on host:port and the datanodes on the ports after it,
+// group by group: data0 takes port+1 .. port+r, data1 the next r and so on.
+// The first member of a group starts as its primary, the rest as backups.
+// All of them coordinate through one in-memory MemStore, each with its own
+// session, so a node leaving still looks like an expired zookeeper session
+// to the others. Without -w the datanodes keep no wal; with it each one
+// writes <dir>/data<g>_<r>.wal. Once the master routes every group the
+// master address is printed; ctrl-c stops the cluster. -x and -X have the
+// datanodes store and replicate PUT values of at least that many bytes
+// compressed. -e lsm keeps each datanode's dict in sorted tables under
+// <dir>/data<g>_<r>.wal.lsm instead of in memory, it needs -w. A datanode
+// whose wal or index leases fail leaves its group and answers FAILED, the
+// master fails the group over and the rest of the cluster goes on.
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <signal.h>
+
+#include "compress.h"
+#include "coordinator.h"
+#include "datanode.h"
+#include "defines.h"
+#include "logger.h"
+#include "storage_engine.h"
+#include "masternode.h"
+#include "wal.h"
+
+#include <grpcpp/grpcpp.h>
+
+#include "kvstore.grpc.pb.h"
+
+// the master has to route every group within this long after they started
+const int kClusterReadyTimeoutMs = 30000;
+
+// Poll the master until its routing table holds groups entries.
+bool wait_routed(const std::string& master_addr, int groups) {
+  std::unique_ptr<kvStore::KvNodeService::Stub> stub(
+      kvStore::KvNodeService::NewStub(grpc::CreateChannel(
+          master_addr, grpc::InsecureChannelCredentials())));
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(kClusterReadyTimeoutMs);
+  while (std::chrono::steady_clock::now() < deadline) {
+    kvStore::RouteRequest request;
+    kvStore::RouteTable table;
+    grpc::ClientContext context;
+    if (stub->Route(&context, request, &table).ok() &&
+        table.entries_size() == groups)
+      return true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  return false;
+}
+
+int main(int argc, char** argv) {
+  std::string host = "127.0.0.1";
+  int base_port = 50100;
+  int groups = 2;
+  int replicas = 2;
+  std::string wal_dir = "";
+  kvdefs::DataNode::Options data_opts;
+  kvdefs::MasterNode::Options master_opts;
+  // parse args
+  {
+    int o = -1;
+    const char *optstring = "h:p:g:r:w:f:n:ax:X:e:";
+    while ((o = getopt(argc, argv, optstring)) != -1) {
+      switch (o) {
+        case 'h':
+          host = optarg;
+          break;
+        case 'p':
+          base_port = atoi(optarg);
+          break;
+        case 'g':
+          groups = std::max(atoi(optarg), 1);
+          break;
+        case 'r':
+          replicas = std::max(atoi(optarg), 1);
+          break;
+        case 'w':
+          wal_dir = optarg;
+          break;
+        case 'f':
+          data_opts.wal_policy = kvdefs::parse_wal_sync_policy(optarg);
+          break;
+        case 'n':
+          data_opts.snapshot_interval = std::max(atoi(optarg), 1);
+          break;
+        case 'a':
+          data_opts.async_threads =
+              std::max<int>(std::thread::hardware_concurrency(), 1);
+          master_opts.async_threads = data_opts.async_threads;
+          break;
+        case 'x':
+          data_opts.value_codec = kvdefs::parse_codec(optarg);
+          break;
+        case 'X':
+          data_opts.compress_threshold = std::max(atoll(optarg), 1LL);
+          break;
+        case 'e':
+          data_opts.storage_engine = kvdefs::parse_storage_engine(optarg);
+          break;
+      }
+    }
+    if (base_port <= 0 || base_port + groups * replicas > 65535) {
+      KV_LOG(ERROR) << "-p must leave room for " << groups * replicas
+                    << " datanode ports after it";
+      exit(EXIT_FAILURE);
+    }
+    if (data_opts.wal_policy < 0) {
+      KV_LOG(ERROR) << "-f must be one of none|group|periodic";
+      exit(EXIT_FAILURE);
+    }
+    if (data_opts.value_codec < 0) {
+      KV_LOG(ERROR) << "-x must be one of none|deflate";
+      exit(EXIT_FAILURE);
+    }
+    if (data_opts.storage_engine < 0) {
+      KV_LOG(ERROR) << "-e must be one of map|lsm";
+      exit(EXIT_FAILURE);
+    }
+    if (data_opts.storage_engine == kvdefs::ENGINE_LSM && wal_dir.empty()) {
+      KV_LOG(ERROR) << "-e lsm needs -w";
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // ctrl-c is taken with sigwait below, every thread started from here on
+  // inherits the mask
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+
+  std::shared_ptr<kvdefs::MemStore> store = std::make_shared<kvdefs::MemStore>();
+
+  master_opts.addr = host + ":" + std::to_string(base_port);
+  kvdefs::MemCoordinator master_coord(store);
+  kvdefs::MasterNode master(master_opts, &master_coord);
+  if (master.Start()) exit(EXIT_FAILURE);
+
+  std::vector<std::unique_ptr<kvdefs::MemCoordinator>> coords;
+  std::vector<std::unique_ptr<kvdefs::DataNode>> nodes;
+  int port = base_port;
+  for (int g = 0; g < groups; ++g) {
+    for (int r = 0; r < replicas; ++r) {
+      kvdefs::DataNode::Options opts = data_opts;
+      opts.id = g;
+      opts.addr = host + ":" + std::to_string(++port);
+      if (!wal_dir.empty())
+        opts.wal_path = wal_dir + "/data" + std::to_string(g) + "_" +
+                        std::to_string(r) + ".wal";
+      coords.emplace_back(new kvdefs::MemCoordinator(store));
+      nodes.emplace_back(new kvdefs::DataNode(opts, coords.back().get()));
+      if (nodes.back()->Start()) {
+        master.Stop();
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  if (!wait_routed(master_opts.addr, groups)) {
+    KV_LOG(ERROR) << "master did not route all " << groups << " groups";
+    master.Stop();
+    exit(EXIT_FAILURE);
+  }
+  KV_LOG(INFO) << "cluster ready, master at " << master_opts.addr;
+
+  int sig = 0;
+  sigwait(&sigs, &sig);
+  // the master goes first, so it does not reshuffle keys among the
+  // datanodes as they leave
+  master.Stop();
+  for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) (*it)->Stop();
+  return 0;
+}
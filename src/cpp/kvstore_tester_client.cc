@@ -4,6 +4,7 @@
 #include <string>
 #include <unistd.h>
 
+#include "channel_pool.h"
 #include "defines.h"
 
 #include <grpcpp/grpcpp.h>
@@ -171,8 +172,7 @@ private:
   std::map<std::string, std::string> dict;
 
   void RedirectToDatanode(const std::string &addr) {
-    std::shared_ptr<grpc::Channel> channel =
-        grpc::CreateChannel(addr, grpc::InsecureChannelCredentials());
+    std::shared_ptr<grpc::Channel> channel = kvdefs::get_channel(addr);
     std::unique_ptr<kvStore::KvNodeService::Stub> new_stub(
         kvStore::KvNodeService::NewStub(channel));
     stub_.swap(new_stub);
@@ -219,8 +219,7 @@ int main(int argc, char **argv) {
   }
 
   // establish connection then do hello check
-  KvTesterClient client(
-      grpc::CreateChannel(target_str, grpc::InsecureChannelCredentials()));
+  KvTesterClient client(kvdefs::get_channel(target_str));
   std::string user("Hello ");
   if (client.SayHello(user)) {
     std::cout << "failed saying hello" << std::endl;
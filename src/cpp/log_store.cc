@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <cstring>
+
+#include "log_store.h"
+
+kvdefs::LogStore::LogStore(std::size_t segment_bytes)
+    : segment_bytes_(segment_bytes), entries_(0), bytes_(0), last_index_(-1) {}
+
+void kvdefs::LogStore::Append(int64_t index, const std::string &payload) {
+  if (segments_.empty() ||
+      segments_.back().capacity - segments_.back().used < payload.size()) {
+    segments_.emplace_back();
+    Segment &seg = segments_.back();
+    seg.capacity = std::max(segment_bytes_, payload.size());
+    seg.data.reset(new char[seg.capacity]);
+    seg.used = 0;
+  }
+
+  Segment &seg = segments_.back();
+  memcpy(seg.data.get() + seg.used, payload.data(), payload.size());
+  seg.indices.push_back(index);
+  seg.offsets.push_back(static_cast<uint32_t>(seg.used));
+  seg.used += payload.size();
+
+  ++entries_;
+  bytes_ += payload.size() + sizeof(int64_t) + sizeof(uint32_t);
+  last_index_ = index;
+}
+
+void kvdefs::LogStore::ForEach(int64_t after, const EntryFn &fn) const {
+  // skip the segments that end at or below after
+  auto seg = std::upper_bound(segments_.begin(), segments_.end(), after,
+                              [](int64_t index, const Segment &s) {
+                                return index < s.indices.back();
+                              });
+  for (; seg != segments_.end(); ++seg) {
+    const std::size_t n = seg->indices.size();
+    std::size_t i = std::upper_bound(seg->indices.begin(), seg->indices.end(),
+                                     after) -
+                    seg->indices.begin();
+    for (; i < n; ++i) {
+      const std::size_t end = i + 1 < n ? seg->offsets[i + 1] : seg->used;
+      if (!fn(seg->indices[i], seg->data.get() + seg->offsets[i],
+              end - seg->offsets[i]))
+        return;
+    }
+  }
+}
+
+void kvdefs::LogStore::TruncatePrefix(int64_t index) {
+  while (!segments_.empty() && segments_.front().indices.back() <= index) {
+    const Segment &seg = segments_.front();
+    entries_ -= seg.indices.size();
+    bytes_ -= seg.used +
+              seg.indices.size() * (sizeof(int64_t) + sizeof(uint32_t));
+    segments_.pop_front();
+  }
+  if (segments_.empty()) last_index_ = -1;
+}
+
+std::size_t kvdefs::LogStore::CountAfter(int64_t after) const {
+  std::size_t count = 0;
+  for (auto seg = segments_.rbegin(); seg != segments_.rend(); ++seg) {
+    const auto first = std::upper_bound(seg->indices.begin(),
+                                        seg->indices.end(), after);
+    count += seg->indices.end() - first;
+    if (first != seg->indices.begin()) break;
+  }
+  return count;
+}
+
+int64_t kvdefs::LogStore::IndexBeforeLast(std::size_t n) const {
+  if (n >= entries_) return -1;
+  for (auto seg = segments_.rbegin(); seg != segments_.rend(); ++seg) {
+    if (n < seg->indices.size())
+      return seg->indices[seg->indices.size() - 1 - n];
+    n -= seg->indices.size();
+  }
+  return -1;
+}
+
+void kvdefs::LogStore::Clear() {
+  segments_.clear();
+  entries_ = 0;
+  bytes_ = 0;
+  last_index_ = -1;
+}
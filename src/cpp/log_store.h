@@ -0,0 +1,71 @@
+#ifndef KVSTORE_LOG_STORE_H
+#define KVSTORE_LOG_STORE_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "defines.h"
+
+namespace kvdefs {
+
+// In-memory log of serialized SyncContent entries, in increasing index
+// order.
+//
+// Entries are packed back to back into fixed-size append-only segments, each
+// with a table of its entries' indices and offsets, so the log costs a few
+// bytes per entry on top of the payloads, never moves them once written and
+// is shipped by walking the segments in order. An entry larger than a
+// segment gets a segment of its own.
+//
+// Not thread safe, the datanode guards it with its log_mutex_.
+class LogStore {
+public:
+  typedef std::function<bool(int64_t index, const char *data, std::size_t len)>
+      EntryFn;
+
+  explicit LogStore(std::size_t segment_bytes = kLogSegmentBytes);
+
+  // index must be above LastIndex()
+  void Append(int64_t index, const std::string &payload);
+  // call fn on every entry with an index above after, in order, until fn
+  // returns false
+  void ForEach(int64_t after, const EntryFn &fn) const;
+  // drop the segments holding only entries up to index
+  void TruncatePrefix(int64_t index);
+  // how many entries have an index above after
+  std::size_t CountAfter(int64_t after) const;
+  // the index the newest n entries come after, -1 if no more are held
+  int64_t IndexBeforeLast(std::size_t n) const;
+  void Clear();
+
+  bool empty() const { return !entries_; }
+  std::size_t size() const { return entries_; }
+  // payload and table bytes held
+  std::size_t Bytes() const { return bytes_; }
+  // -1 when empty
+  int64_t LastIndex() const { return last_index_; }
+
+private:
+  struct Segment {
+    std::unique_ptr<char[]> data;
+    std::size_t capacity;
+    std::size_t used;
+    std::vector<int64_t> indices;
+    // entry i starts at offsets[i] and ends where the next one starts
+    std::vector<uint32_t> offsets;
+  };
+
+  std::size_t segment_bytes_;
+  std::deque<Segment> segments_;
+  std::size_t entries_;
+  std::size_t bytes_;
+  int64_t last_index_;
+};
+
+}
+
+#endif
@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "logger.h"
+
+// Lines only wait this long for the writer when nothing wakes it up.
+static const int kLogFlushIntervalMs = 5;
+
+// Registers the calling thread's ring, and retires it when the thread exits.
+class kvdefs::Logger::LocalRing {
+public:
+  explicit LocalRing(Logger *logger) : ring(std::make_shared<Ring>()) {
+    std::lock_guard<std::mutex> guard(logger->mutex_);
+    logger->rings_.push_back(ring);
+  }
+  ~LocalRing() { ring->retired.store(true, std::memory_order_release); }
+
+  std::shared_ptr<Ring> ring;
+};
+
+kvdefs::Logger &kvdefs::Logger::Instance() {
+  // never destroyed, detached threads may still log while the process exits
+  static Logger *logger = new Logger;
+  return *logger;
+}
+
+kvdefs::Logger::Logger() : stop_(false), stopped_(false) {
+  writer_ = std::thread(&Logger::WriterLoop, this);
+  std::atexit([]() { Instance().Shutdown(); });
+}
+
+kvdefs::Logger::Ring *kvdefs::Logger::ThreadRing() {
+  static thread_local LocalRing local(this);
+  return local.ring.get();
+}
+
+void kvdefs::Logger::Append(LOG_LEVEL level, const char *file, int line,
+                            std::string msg) {
+  Ring *ring = ThreadRing();
+  const std::size_t head = ring->head.load(std::memory_order_relaxed);
+  while (head - ring->tail.load(std::memory_order_acquire) >= kRingSize) {
+    if (stopped_.load(std::memory_order_acquire)) {
+      DrainAndWrite();
+    } else {
+      cv_.notify_one();
+      std::this_thread::yield();
+    }
+  }
+
+  Record &record = ring->records[head % kRingSize];
+  record.level = level;
+  record.time = clock::now();
+  record.file = file;
+  record.line = line;
+  record.msg = std::move(msg);
+  ring->head.store(head + 1, std::memory_order_release);
+
+  // nobody is left to write it
+  if (stopped_.load(std::memory_order_acquire)) DrainAndWrite();
+}
+
+void kvdefs::Logger::Shutdown() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (stop_) return;
+    stop_ = true;
+  }
+  cv_.notify_one();
+  writer_.join();
+  stopped_.store(true, std::memory_order_release);
+  // lines appended between the writer's last pass and stopped_
+  DrainAndWrite();
+}
+
+void kvdefs::Logger::WriterLoop() {
+  std::vector<Record> records;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    if (!Drain(&records)) {
+      if (stop_) break;
+      cv_.wait_for(lock, std::chrono::milliseconds(kLogFlushIntervalMs));
+      continue;
+    }
+    lock.unlock();
+    WriteAll(&records);
+    lock.lock();
+  }
+}
+
+void kvdefs::Logger::DrainAndWrite() {
+  std::vector<Record> records;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    Drain(&records);
+  }
+  WriteAll(&records);
+}
+
+// mutex_ must be held, it makes the caller the rings' only consumer
+bool kvdefs::Logger::Drain(std::vector<Record> *out) {
+  const std::size_t before = out->size();
+  for (auto it = rings_.begin(); it != rings_.end();) {
+    Ring &ring = **it;
+    // read before head, a retired ring has published its last line
+    const bool retired = ring.retired.load(std::memory_order_acquire);
+    const std::size_t head = ring.head.load(std::memory_order_acquire);
+    std::size_t tail = ring.tail.load(std::memory_order_relaxed);
+    for (; tail != head; ++tail)
+      out->push_back(std::move(ring.records[tail % kRingSize]));
+    ring.tail.store(tail, std::memory_order_release);
+
+    if (retired)
+      it = rings_.erase(it);
+    else
+      ++it;
+  }
+  return out->size() != before;
+}
+
+void kvdefs::Logger::WriteAll(std::vector<Record> *records) {
+  // each ring is in order, interleave the threads by time
+  std::stable_sort(records->begin(), records->end(),
+                   [](const Record &a, const Record &b) {
+                     return a.time < b.time;
+                   });
+  for (const Record &record : *records) Write(record);
+  records->clear();
+  fflush(stdout);
+  fflush(stderr);
+}
+
+void kvdefs::Logger::Write(const Record &record) {
+  const std::time_t secs = clock::to_time_t(record.time);
+  std::tm tm;
+  localtime_r(&secs, &tm);
+  char stamp[32];
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+  const long us = std::chrono::duration_cast<std::chrono::microseconds>(
+                      record.time.time_since_epoch())
+                      .count() %
+                  1000000;
+
+  const char *file = strrchr(record.file, '/');
+  file = file ? file + 1 : record.file;
+  fprintf(record.level >= LOG_WARN ? stderr : stdout, "%c %s.%06ld %s:%d] %s\n",
+          "DIWE"[record.level - LOG_DEBUG], stamp, us, file, record.line,
+          record.msg.c_str());
+}
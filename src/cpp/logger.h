@@ -0,0 +1,118 @@
+#ifndef KVSTORE_LOGGER_H
+#define KVSTORE_LOGGER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kvdefs {
+
+enum LOG_LEVEL {
+  LOG_DEBUG = 600,
+  LOG_INFO,
+  LOG_WARN,   // this level and above go to stderr
+  LOG_ERROR
+};
+
+// Lines below this level are compiled out, the build sets it from the
+// KVSTORE_LOG_LEVEL cmake option.
+#ifndef KVSTORE_LOG_LEVEL
+#define KVSTORE_LOG_LEVEL kvdefs::LOG_INFO
+#endif
+
+// Process-wide asynchronous logger. Each thread appends to its own
+// single-producer ring without taking a lock, and a background thread drains
+// the rings, orders their lines by time and writes them out, so logging on
+// the request path costs a string format and a couple of atomic stores.
+//
+// A thread whose ring is full waits for the writer rather than drop lines.
+// Lines still queued at exit are written by an atexit handler; lines logged
+// after it ran are written synchronously.
+class Logger {
+public:
+  static Logger &Instance();
+
+  void Append(LOG_LEVEL level, const char *file, int line, std::string msg);
+  // stop the writer once everything queued is written
+  void Shutdown();
+
+private:
+  typedef std::chrono::system_clock clock;
+
+  struct Record {
+    LOG_LEVEL level;
+    clock::time_point time;
+    const char *file;
+    int line;
+    std::string msg;
+  };
+
+  static const std::size_t kRingSize = 1024;
+
+  // written by its thread only, read by the writer only
+  struct Ring {
+    Ring() : records(kRingSize), head(0), tail(0), retired(false) {}
+    std::vector<Record> records;
+    std::atomic<std::size_t> head;  // next slot the thread writes
+    std::atomic<std::size_t> tail;  // next slot the writer reads
+    std::atomic<bool> retired;      // the thread exited
+  };
+  class LocalRing;
+
+  Logger();
+  Ring *ThreadRing();
+  void WriterLoop();
+  void DrainAndWrite();
+  // move every queued record to out, true if there were any
+  bool Drain(std::vector<Record> *out);
+  static void WriteAll(std::vector<Record> *records);
+  static void Write(const Record &record);
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<std::shared_ptr<Ring>> rings_;
+  bool stop_;
+  std::atomic<bool> stopped_;
+  std::thread writer_;
+};
+
+// Formats one line and hands it to the Logger when it goes out of scope.
+class LogLine {
+public:
+  LogLine(LOG_LEVEL level, const char *file, int line)
+      : level_(level), file_(file), line_(line) {}
+  ~LogLine() {
+    Logger::Instance().Append(level_, file_, line_, strm_.str());
+  }
+  std::ostream &stream() { return strm_; }
+
+private:
+  LOG_LEVEL level_;
+  const char *file_;
+  int line_;
+  std::ostringstream strm_;
+};
+
+// Turns a whole KV_LOG statement into void, so the macro is one expression
+// and needs no braces around it under an if.
+struct LogVoidify {
+  void operator&(std::ostream &) {}
+};
+
+}
+
+// KV_LOG(INFO) << "joined " << addr; a trailing newline is added. Below
+// KVSTORE_LOG_LEVEL the statement, arguments included, is never evaluated.
+#define KV_LOG(level)                                                   \
+  (kvdefs::LOG_##level < KVSTORE_LOG_LEVEL)                             \
+      ? (void)0                                                         \
+      : kvdefs::LogVoidify() &                                          \
+            kvdefs::LogLine(kvdefs::LOG_##level, __FILE__, __LINE__).stream()
+
+#endif
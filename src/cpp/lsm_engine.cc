@@ -0,0 +1,718 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "defines.h"
+#include "logger.h"
+#include "lsm_engine.h"
+#include "wal.h"
+
+namespace {
+
+using kvdefs::Table;
+using kvdefs::TableLevels;
+using kvdefs::Version;
+using kvdefs::VersionMap;
+
+// what a memtable entry costs besides its key and value
+const std::size_t kMemEntryOverhead = 96;
+
+// entries in key order, at most one per key. A source that hit a corrupt
+// table stops there with corrupt() set.
+class Source {
+public:
+  virtual ~Source() {}
+  virtual bool Valid() const = 0;
+  virtual bool corrupt() const { return false; }
+  virtual const std::string &key() const = 0;
+  virtual const std::shared_ptr<const Version> &version() const = 0;
+  virtual void Next() = 0;
+};
+
+// a memtable read in runs as the merge advances, stopping before end
+class DictSource : public Source {
+public:
+  DictSource(std::shared_ptr<const kvdefs::ShardedDict> dict,
+             const std::string &start, const std::string &end)
+      : dict_(std::move(dict)), cursor_(*dict_, start, end) {}
+  bool Valid() const override { return cursor_.Valid(); }
+  const std::string &key() const override { return cursor_.key(); }
+  const std::shared_ptr<const Version> &version() const override {
+    return cursor_.version();
+  }
+  void Next() override { cursor_.Next(); }
+
+private:
+  std::shared_ptr<const kvdefs::ShardedDict> dict_;
+  kvdefs::ShardedDict::Cursor cursor_;
+};
+
+// disjoint tables sorted by key, read one after the other
+class TablesSource : public Source {
+public:
+  TablesSource(const std::vector<std::shared_ptr<Table>> &tables,
+               const std::string &start, bool fill_cache)
+      : tables_(tables), fill_cache_(fill_cache), corrupt_(false) {
+    next_ = std::lower_bound(tables_.begin(), tables_.end(), start,
+                             [](const std::shared_ptr<Table> &t,
+                                const std::string &k) {
+                               return t->largest() < k;
+                             }) -
+            tables_.begin();
+    Advance(start);
+  }
+  bool Valid() const override { return it_ && it_->Valid(); }
+  bool corrupt() const override { return corrupt_; }
+  const std::string &key() const override { return it_->entry().first; }
+  const std::shared_ptr<const Version> &version() const override {
+    return it_->entry().second;
+  }
+  void Next() override {
+    it_->Next();
+    if (!it_->Valid()) Advance("");
+  }
+
+private:
+  void Advance(const std::string &start) {
+    while (!(it_ && it_->corrupt()) && next_ < tables_.size()) {
+      it_.reset(new Table::Iterator(tables_[next_++], fill_cache_));
+      it_->Seek(start);
+      if (it_->Valid()) return;
+    }
+    // rather than go on past the keys the corrupt block held
+    if (it_ && it_->corrupt()) corrupt_ = true;
+    it_.reset();
+  }
+
+  std::vector<std::shared_ptr<Table>> tables_;
+  bool fill_cache_;
+  bool corrupt_;
+  std::size_t next_;
+  std::unique_ptr<Table::Iterator> it_;
+};
+
+// Merges sources given newest first: each key comes out once, with the
+// version of the newest source holding it. Once one source is corrupt the
+// merge stops, the others would show older versions of its keys.
+class MergingSource : public Source {
+public:
+  explicit MergingSource(std::vector<std::unique_ptr<Source>> sources)
+      : sources_(std::move(sources)), corrupt_(false) {
+    FindCurrent();
+  }
+  bool Valid() const override { return current_ < sources_.size(); }
+  bool corrupt() const override { return corrupt_; }
+  const std::string &key() const override { return sources_[current_]->key(); }
+  const std::shared_ptr<const Version> &version() const override {
+    return sources_[current_]->version();
+  }
+  void Next() override {
+    const std::string key = this->key();
+    for (auto &source : sources_)
+      if (source->Valid() && source->key() == key) source->Next();
+    FindCurrent();
+  }
+
+private:
+  // a handful of sources at most, so a linear pass beats keeping a heap
+  void FindCurrent() {
+    current_ = sources_.size();
+    for (const auto &source : sources_)
+      if (source->corrupt()) corrupt_ = true;
+    if (corrupt_) return;
+    for (std::size_t i = 0; i < sources_.size(); ++i) {
+      if (!sources_[i]->Valid()) continue;
+      if (current_ == sources_.size() ||
+          sources_[i]->key() < sources_[current_]->key())
+        current_ = i;
+    }
+  }
+
+  std::vector<std::unique_ptr<Source>> sources_;
+  std::size_t current_;
+  bool corrupt_;
+};
+
+// mem and imm are the memtable sources, positioned at start; imm may be
+// null when there is no immutable memtable
+std::unique_ptr<Source> make_merged(std::unique_ptr<Source> mem,
+                                    std::unique_ptr<Source> imm,
+                                    const TableLevels &levels,
+                                    const std::string &start,
+                                    bool fill_cache) {
+  std::vector<std::unique_ptr<Source>> sources;
+  sources.push_back(std::move(mem));
+  if (imm) sources.push_back(std::move(imm));
+  for (auto it = levels[0].rbegin(); it != levels[0].rend(); ++it)
+    sources.emplace_back(new TablesSource({*it}, start, fill_cache));
+  for (std::size_t level = 1; level < levels.size(); ++level)
+    if (!levels[level].empty())
+      sources.emplace_back(new TablesSource(levels[level], start, fill_cache));
+  return std::unique_ptr<Source>(new MergingSource(std::move(sources)));
+}
+
+// -1 if source ran into a corrupt table before the scan was done
+int scan_live(Source *source, const std::string &end, std::size_t limit,
+              const kvdefs::ShardedDict::ScanFn &fn) {
+  for (std::size_t n = 0; source->Valid(); source->Next()) {
+    if (!end.empty() && source->key() >= end) return 0;
+    if (source->version()->tombstone) continue;
+    if (!fn(source->key(), *source->version())) return 0;
+    if (limit && ++n >= limit) return 0;
+  }
+  return source->corrupt() ? -1 : 0;
+}
+
+// the newest version the tables hold for key, null if none; -1 if a table
+// that may hold it is corrupt, a deeper one would only have an older one
+int find_in_tables(const TableLevels &levels, const std::string &key,
+                   std::shared_ptr<const Version> *version) {
+  version->reset();
+  for (auto it = levels[0].rbegin(); it != levels[0].rend(); ++it) {
+    if ((*it)->Get(key, version)) return -1;
+    if (*version) return 0;
+  }
+  for (std::size_t level = 1; level < levels.size(); ++level) {
+    const std::vector<std::shared_ptr<Table>> &tables = levels[level];
+    auto it = std::lower_bound(
+        tables.begin(), tables.end(), key,
+        [](const std::shared_ptr<Table> &t, const std::string &k) {
+          return t->largest() < k;
+        });
+    if (it == tables.end()) continue;
+    if ((*it)->Get(key, version)) return -1;
+    if (*version) return 0;
+  }
+  return 0;
+}
+
+bool overlaps(const Table &table, const std::string &smallest,
+              const std::string &largest) {
+  return !(table.largest() < smallest || largest < table.smallest());
+}
+
+std::size_t level_bytes(const std::vector<std::shared_ptr<Table>> &tables) {
+  std::size_t bytes = 0;
+  for (const auto &table : tables) bytes += table->file_size();
+  return bytes;
+}
+
+}
+
+kvdefs::LsmEngine::LsmEngine(const std::string &dir, std::size_t shard_bits,
+                             Metrics *metrics)
+    : dir_(dir), shard_bits_(shard_bits), cache_(kBlockCacheBytes),
+      lock_wait_(nullptr), mem_(std::make_shared<ShardedDict>(shard_bits)),
+      imm_index_(0), levels_(std::make_shared<const TableLevels>(kLsmLevels)),
+      flushed_index_(0), failed_(false), stop_(false), mem_bytes_(0),
+      mem_index_(0), cleared_(false), checkpoint_index_(0), next_file_(1),
+      compact_pointer_(kLsmLevels) {
+  flushes_ = metrics->GetCounter("lsm.flushes");
+  compactions_ = metrics->GetCounter("lsm.compactions");
+  compaction_bytes_ = metrics->GetCounter("lsm.compaction_bytes");
+  flush_latency_ = metrics->GetHistogram("lsm.flush_us");
+  compaction_latency_ = metrics->GetHistogram("lsm.compaction_us");
+  stall_latency_ = metrics->GetHistogram("lsm.stall_us");
+  metrics->AddGauge("lsm.tables", [this] {
+    std::shared_ptr<const TableLevels> levels = Current().levels;
+    int64_t tables = 0;
+    for (const auto &level : *levels) tables += level.size();
+    return tables;
+  });
+  metrics->AddGauge("lsm.l0_tables", [this] {
+    return static_cast<int64_t>((*Current().levels)[0].size());
+  });
+  metrics->AddGauge("lsm.table_bytes", [this] {
+    std::shared_ptr<const TableLevels> levels = Current().levels;
+    int64_t bytes = 0;
+    for (const auto &level : *levels) bytes += level_bytes(level);
+    return bytes;
+  });
+  metrics->AddGauge("lsm.cache_hits", [this] { return cache_.Hits(); });
+  metrics->AddGauge("lsm.cache_misses", [this] { return cache_.Misses(); });
+  metrics->AddGauge("lsm.cache_bytes", [this] {
+    return static_cast<int64_t>(cache_.Charge());
+  });
+}
+
+kvdefs::LsmEngine::~LsmEngine() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (worker_.joinable()) worker_.join();
+}
+
+std::string kvdefs::LsmEngine::TablePath(uint64_t number) const {
+  char name[32];
+  snprintf(name, sizeof(name), "/%06llu.sst",
+           static_cast<unsigned long long>(number));
+  return dir_ + name;
+}
+
+int kvdefs::LsmEngine::Open(int64_t *index) {
+  if (mkdir(dir_.c_str(), 0755) && errno != EEXIST) {
+    KV_LOG(ERROR) << "Failed creating " << dir_ << ": " << strerror(errno);
+    return -1;
+  }
+
+  std::shared_ptr<TableLevels> levels =
+      std::make_shared<TableLevels>(kLsmLevels);
+  int64_t flushed = 0;
+  uint64_t next = 1;
+  std::set<uint64_t> live;
+  const std::string manifest = dir_ + "/MANIFEST";
+  int fd = open(manifest.c_str(), O_RDONLY);
+  if (fd < 0 && errno != ENOENT) {
+    KV_LOG(ERROR) << "Failed opening " << manifest << ": " << strerror(errno);
+    return -1;
+  }
+  if (fd >= 0) {
+    std::string data;
+    int ret = read_fully(fd, &data);
+    close(fd);
+    if (ret) return -1;
+
+    std::istringstream in(data);
+    std::string word;
+    while (in >> word) {
+      std::size_t level = kLsmLevels;
+      uint64_t number = 0;
+      if (word == "index") {
+        in >> flushed;
+      } else if (word == "next") {
+        in >> next;
+      } else if (word == "table" && in >> level >> number &&
+                 level < kLsmLevels) {
+        std::shared_ptr<Table> table =
+            Table::Open(TablePath(number), number, &cache_);
+        if (!table) return -1;
+        (*levels)[level].push_back(table);
+        live.insert(number);
+      } else {
+        in.setstate(std::ios::failbit);
+      }
+      if (!in) {
+        KV_LOG(ERROR) << "Corrupt " << manifest;
+        return -1;
+      }
+    }
+  }
+
+  next_file_ = next;
+  // tables at index 0 are what a snapshot install got to before a crash,
+  // the snapshot is sent again in full
+  if (!flushed && !live.empty()) {
+    KV_LOG(WARN) << "dropping the tables of an interrupted snapshot install";
+    levels = std::make_shared<TableLevels>(kLsmLevels);
+    live.clear();
+    if (WriteManifest(*levels, 0)) return -1;
+  }
+
+  // tables a flush or compaction wrote before a crash kept the manifest
+  // from naming them
+  if (DIR *dir = opendir(dir_.c_str())) {
+    while (struct dirent *ent = readdir(dir)) {
+      const std::string name = ent->d_name;
+      if (name.size() < 4 || name.compare(name.size() - 4, 4, ".sst")) continue;
+      if (live.count(strtoull(name.c_str(), nullptr, 10))) continue;
+      unlink((dir_ + "/" + name).c_str());
+    }
+    closedir(dir);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    levels_ = levels;
+    flushed_index_ = flushed;
+  }
+  mem_index_ = flushed;
+  *index = flushed;
+  worker_ = std::thread(&LsmEngine::CompactLoop, this);
+  return 0;
+}
+
+kvdefs::LsmEngine::Parts kvdefs::LsmEngine::Current() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Parts parts;
+  parts.mem = mem_;
+  parts.imm = imm_;
+  parts.levels = levels_;
+  return parts;
+}
+
+std::shared_ptr<const kvdefs::Version>
+kvdefs::LsmEngine::GetVersion(const std::string &key) const {
+  std::shared_ptr<const Version> version;
+  Get(key, &version);
+  return version;
+}
+
+int kvdefs::LsmEngine::Get(const std::string &key,
+                           std::shared_ptr<const Version> *version) const {
+  Parts parts = Current();
+  *version = parts.mem->GetVersion(key);
+  if (!*version && parts.imm) *version = parts.imm->GetVersion(key);
+  if (!*version && find_in_tables(*parts.levels, key, version)) return -1;
+  if (*version && (*version)->tombstone) version->reset();
+  return 0;
+}
+
+void kvdefs::LsmEngine::Put(const std::string &key, const std::string &value,
+                            int64_t index, int codec, int64_t expire_at) {
+  Write(key, std::make_shared<const Version>(value, index, codec, expire_at));
+}
+
+bool kvdefs::LsmEngine::Erase(const std::string &key, int64_t index) {
+  // a key we cannot read gets its tombstone all the same
+  std::shared_ptr<const Version> version;
+  if (!Get(key, &version) && !version) return false;
+  Write(key,
+        std::make_shared<const Version>(std::string(), index, 0, 0, true));
+  return true;
+}
+
+void kvdefs::LsmEngine::Write(const std::string &key,
+                              std::shared_ptr<const Version> version) {
+  // rotate between log entries, so a flushed memtable is the state at an
+  // exact index; while a snapshot installs the index means nothing yet
+  if (mem_bytes_ >= kLsmMemtableBytes &&
+      (cleared_ || version->index > mem_index_))
+    Rotate(cleared_ ? 0 : mem_index_);
+  mem_bytes_ += key.size() + version->value.size() + kMemEntryOverhead;
+  mem_index_ = std::max(mem_index_, version->index);
+  mem_->Put(key, std::move(version));
+}
+
+void kvdefs::LsmEngine::Rotate(int64_t index) {
+  ScopedTimer timer(stall_latency_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return !imm_ || failed_ || stop_; });
+  // after a failed flush the memtable keeps growing, the log still has it
+  if (failed_ || stop_) return;
+  imm_ = mem_;
+  imm_index_ = index;
+  mem_ = std::make_shared<ShardedDict>(shard_bits_);
+  if (lock_wait_) mem_->SetLockWaitHistogram(lock_wait_);
+  mem_bytes_ = 0;
+  cv_.notify_all();
+}
+
+void kvdefs::LsmEngine::BeginCheckpoint(int64_t index) {
+  Rotate(index);
+  cleared_ = false;
+  checkpoint_index_ = index;
+}
+
+// later rotations flush after ours, so the tables reaching the index is
+// what tells ours went through
+int kvdefs::LsmEngine::FinishCheckpoint() {
+  const int64_t index = checkpoint_index_;
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this, index] {
+    return flushed_index_ >= index || failed_ || stop_;
+  });
+  if (flushed_index_ < index) {
+    KV_LOG(ERROR) << "Failed flushing memtable at " << index;
+    return -1;
+  }
+  return 0;
+}
+
+void kvdefs::LsmEngine::Clear() {
+  std::lock_guard<std::mutex> guard(compaction_mutex_);
+  std::shared_ptr<const TableLevels> empty =
+      std::make_shared<const TableLevels>(kLsmLevels);
+  WriteManifest(*empty, 0);
+  std::shared_ptr<ShardedDict> mem = std::make_shared<ShardedDict>(shard_bits_);
+  if (lock_wait_) mem->SetLockWaitHistogram(lock_wait_);
+
+  std::shared_ptr<const TableLevels> old;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    old = levels_;
+    levels_ = empty;
+    mem_ = mem;
+    imm_.reset();
+    flushed_index_ = 0;
+    failed_ = false;
+  }
+  cv_.notify_all();
+  mem_bytes_ = 0;
+  mem_index_ = 0;
+  cleared_ = true;
+  compact_pointer_.assign(kLsmLevels, std::string());
+  for (const auto &level : *old)
+    for (const auto &table : level) table->MarkObsolete();
+}
+
+std::size_t kvdefs::LsmEngine::Size() const {
+  Parts parts = Current();
+  std::size_t size = parts.mem->Size();
+  if (parts.imm) size += parts.imm->Size();
+  for (const auto &level : *parts.levels)
+    for (const auto &table : level) size += table->entries();
+  return size;
+}
+
+int kvdefs::LsmEngine::Scan(const std::string &start, const std::string &end,
+                            std::size_t limit, const ScanFn &fn) const {
+  Parts parts = Current();
+  // the memtables are read as the merge reaches their keys rather than
+  // copied up front, so a scan with a limit reads about that many of them.
+  // A pass over the whole dict, a snapshot or a migration, would only
+  // push hot blocks out of the cache.
+  std::unique_ptr<Source> imm;
+  if (parts.imm) imm.reset(new DictSource(parts.imm, start, end));
+  std::unique_ptr<Source> merged = make_merged(
+      std::unique_ptr<Source>(new DictSource(parts.mem, start, end)),
+      std::move(imm), *parts.levels, start, !start.empty() || !end.empty());
+  return scan_live(merged.get(), end, limit, fn);
+}
+
+void kvdefs::LsmEngine::SetLockWaitHistogram(Histogram *histogram) {
+  lock_wait_ = histogram;
+  mem_->SetLockWaitHistogram(histogram);
+}
+
+void kvdefs::LsmEngine::CompactLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    if (imm_ && !failed_) {
+      lock.unlock();
+      int ret = FlushMemtable();
+      lock.lock();
+      if (ret) {
+        failed_ = true;
+        cv_.notify_all();
+      }
+      continue;
+    }
+    lock.unlock();
+    int ret = CompactLevel();
+    lock.lock();
+    // a corrupt table would only get worse with every compaction over it
+    if (ret == -2) {
+      KV_LOG(ERROR) << "compaction read a corrupt table, stopping";
+      failed_ = true;
+      cv_.notify_all();
+    }
+    // a failed compaction is retried after the next flush
+    if (ret <= 0)
+      cv_.wait(lock, [this] { return stop_ || (imm_ && !failed_); });
+  }
+}
+
+int kvdefs::LsmEngine::FlushMemtable() {
+  std::lock_guard<std::mutex> guard(compaction_mutex_);
+  Parts parts = Current();
+  int64_t index;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    index = imm_index_;
+  }
+  // Clear dropped it meanwhile
+  if (!parts.imm) return 0;
+
+  ScopedTimer timer(flush_latency_);
+  VersionMap entries;
+  parts.imm->CopyTo(&entries);
+  std::shared_ptr<TableLevels> levels =
+      std::make_shared<TableLevels>(*parts.levels);
+  std::shared_ptr<Table> table;
+  if (!entries.empty()) {
+    const uint64_t number = next_file_++;
+    TableBuilder builder(TablePath(number));
+    for (const auto &kv : entries) builder.Add(kv.first, *kv.second);
+    if (builder.Finish()) return -1;
+    table = Table::Open(TablePath(number), number, &cache_);
+    if (!table) return -1;
+    (*levels)[0].push_back(table);
+  }
+  if (WriteManifest(*levels, index)) {
+    if (table) table->MarkObsolete();
+    return -1;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    levels_ = levels;
+    flushed_index_ = index;
+    imm_.reset();
+  }
+  cv_.notify_all();
+  flushes_->Add(1);
+  return 0;
+}
+
+int kvdefs::LsmEngine::CompactLevel() {
+  std::lock_guard<std::mutex> guard(compaction_mutex_);
+  std::shared_ptr<const TableLevels> current;
+  int64_t index;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    current = levels_;
+    index = flushed_index_;
+  }
+  const TableLevels &levels = *current;
+
+  std::size_t level = kLsmLevels;
+  if (levels[0].size() >= kLsmL0Tables) level = 0;
+  std::size_t budget = kLsmLevelBaseBytes;
+  for (std::size_t l = 1; level == kLsmLevels && l + 1 < kLsmLevels; ++l) {
+    if (level_bytes(levels[l]) > budget) level = l;
+    budget *= 10;
+  }
+  if (level == kLsmLevels) return 0;
+
+  ScopedTimer timer(compaction_latency_);
+  std::vector<std::shared_ptr<Table>> inputs;
+  if (level == 0) {
+    inputs.assign(levels[0].rbegin(), levels[0].rend());
+  } else {
+    // the first table past where the level's last compaction ended
+    const std::vector<std::shared_ptr<Table>> &tables = levels[level];
+    auto it = std::find_if(tables.begin(), tables.end(),
+                           [&](const std::shared_ptr<Table> &t) {
+                             return t->smallest() > compact_pointer_[level];
+                           });
+    inputs.push_back(it == tables.end() ? tables.front() : *it);
+  }
+  std::string smallest = inputs[0]->smallest();
+  std::string largest = inputs[0]->largest();
+  for (const auto &table : inputs) {
+    smallest = std::min(smallest, table->smallest());
+    largest = std::max(largest, table->largest());
+  }
+
+  std::vector<std::shared_ptr<Table>> overlapping;
+  for (const auto &table : levels[level + 1])
+    if (overlaps(*table, smallest, largest)) overlapping.push_back(table);
+  bool bottom = true;
+  for (std::size_t l = level + 2; l < kLsmLevels; ++l)
+    for (const auto &table : levels[l])
+      if (overlaps(*table, smallest, largest)) bottom = false;
+
+  // newest first: the inputs, then what they land on
+  std::vector<std::shared_ptr<Table>> sources(inputs);
+  sources.insert(sources.end(), overlapping.begin(), overlapping.end());
+  std::vector<std::shared_ptr<Table>> outputs;
+  const int written = WriteTables(sources, bottom, &outputs);
+  if (written) return written;
+
+  std::set<const Table *> replaced;
+  for (const auto &table : sources) replaced.insert(table.get());
+  std::shared_ptr<TableLevels> next = std::make_shared<TableLevels>(levels);
+  for (std::size_t l : {level, level + 1}) {
+    std::vector<std::shared_ptr<Table>> &tables = (*next)[l];
+    tables.erase(std::remove_if(tables.begin(), tables.end(),
+                                [&](const std::shared_ptr<Table> &t) {
+                                  return replaced.count(t.get()) > 0;
+                                }),
+                 tables.end());
+  }
+  std::vector<std::shared_ptr<Table>> &target = (*next)[level + 1];
+  target.insert(target.end(), outputs.begin(), outputs.end());
+  std::sort(target.begin(), target.end(),
+            [](const std::shared_ptr<Table> &a,
+               const std::shared_ptr<Table> &b) {
+              return a->smallest() < b->smallest();
+            });
+  if (WriteManifest(*next, index)) {
+    for (const auto &table : outputs) table->MarkObsolete();
+    return -1;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    levels_ = next;
+  }
+  for (const auto &table : sources) table->MarkObsolete();
+  compact_pointer_[level] = largest;
+  compactions_->Add(1);
+  return 1;
+}
+
+int kvdefs::LsmEngine::WriteTables(
+    const std::vector<std::shared_ptr<Table>> &inputs, bool drop_tombstones,
+    std::vector<std::shared_ptr<Table>> *outputs) {
+  std::vector<std::unique_ptr<Source>> sources;
+  for (const auto &table : inputs)
+    sources.emplace_back(new TablesSource({table}, "", false));
+  MergingSource merged(std::move(sources));
+
+  std::unique_ptr<TableBuilder> builder;
+  uint64_t number = 0;
+  bool ok = true;
+  auto finish = [&]() {
+    std::shared_ptr<Table> table;
+    ok = !builder->Finish() &&
+         (table = Table::Open(TablePath(number), number, &cache_)) != nullptr;
+    if (ok) {
+      compaction_bytes_->Add(table->file_size());
+      outputs->push_back(table);
+    }
+    builder.reset();
+  };
+  for (; ok && merged.Valid(); merged.Next()) {
+    if (drop_tombstones && merged.version()->tombstone) continue;
+    if (!builder) {
+      number = next_file_++;
+      builder.reset(new TableBuilder(TablePath(number)));
+    }
+    builder->Add(merged.key(), *merged.version());
+    if (builder->Bytes() >= kLsmTableBytes) finish();
+  }
+  if (ok && builder) finish();
+  const bool corrupt = merged.corrupt();
+
+  if (!ok || corrupt) {
+    for (const auto &table : *outputs) table->MarkObsolete();
+    outputs->clear();
+    return corrupt ? -2 : -1;
+  }
+  return 0;
+}
+
+int kvdefs::LsmEngine::WriteManifest(const TableLevels &levels,
+                                     int64_t index) {
+  std::ostringstream out;
+  out << "index " << index << "\nnext " << next_file_ << "\n";
+  for (std::size_t level = 0; level < levels.size(); ++level)
+    for (const auto &table : levels[level])
+      out << "table " << level << " " << table->number() << "\n";
+  const std::string data = out.str();
+
+  const std::string path = dir_ + "/MANIFEST";
+  const std::string tmp_path = path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    KV_LOG(ERROR) << "Failed creating " << tmp_path << ": " << strerror(errno);
+    return -1;
+  }
+  bool ok =
+      write_fully(fd, data.data(), data.size()) == 0 && fdatasync(fd) == 0;
+  close(fd);
+  if (!ok || rename(tmp_path.c_str(), path.c_str())) {
+    KV_LOG(ERROR) << "Failed writing " << path << ": " << strerror(errno);
+    unlink(tmp_path.c_str());
+    return -1;
+  }
+  // the tables it names were created in dir_ too, this syncs their entries
+  if (sync_parent_dir(path)) {
+    KV_LOG(ERROR) << "Failed syncing " << path << ": " << strerror(errno);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,128 @@
+#ifndef KVSTORE_LSM_ENGINE_H
+#define KVSTORE_LSM_ENGINE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+#include "sstable.h"
+#include "storage_engine.h"
+
+namespace kvdefs {
+
+// tables by level; level 0 tables may overlap and go oldest first, deeper
+// levels are disjoint and sorted by key
+typedef std::vector<std::vector<std::shared_ptr<Table>>> TableLevels;
+
+// Log-structured merge tree in a directory of sorted tables.
+//
+// Writes go to a ShardedDict memtable, deletes as tombstones. A full
+// memtable becomes immutable and a background worker flushes it to a new
+// level 0 table, then compacts: level 0 into level 1 once it holds
+// kLsmL0Tables tables, and a table at a time from any deeper level over its
+// byte budget into the next, round robin through its key range. Tombstones
+// are dropped once nothing deeper could hold the key.
+//
+// The MANIFEST file names the live tables and the log index they cover;
+// it is rewritten (to a temp file, then renamed) after every flush and
+// compaction, so a crash leaves either the old or the new set of tables.
+// Tables it does not name are deleted on Open.
+//
+// Reads look in the memtables, then in level 0 newest first, then in each
+// deeper level's one candidate table, skipping tables whose bloom filter
+// rules the key out. Table versions are shared immutable snapshots, so
+// readers never block the worker swapping them out.
+class LsmEngine : public StorageEngine {
+public:
+  // metrics must outlive the engine
+  LsmEngine(const std::string &dir, std::size_t shard_bits, Metrics *metrics);
+  ~LsmEngine();
+
+  int Open(int64_t *index) override;
+  std::shared_ptr<const Version> GetVersion(
+      const std::string &key) const override;
+  int Get(const std::string &key,
+          std::shared_ptr<const Version> *version) const override;
+  void Put(const std::string &key, const std::string &value, int64_t index,
+           int codec, int64_t expire_at) override;
+  bool Erase(const std::string &key, int64_t index) override;
+  std::size_t Size() const override;
+  int Scan(const std::string &start, const std::string &end,
+           std::size_t limit, const ScanFn &fn) const override;
+  // flushes the memtable, FinishCheckpoint waits for that
+  void BeginCheckpoint(int64_t index) override;
+  int FinishCheckpoint() override;
+  void Clear() override;
+  void SetLockWaitHistogram(Histogram *histogram) override;
+
+private:
+  // what a reader needs, taken together under mutex_
+  struct Parts {
+    std::shared_ptr<ShardedDict> mem;
+    std::shared_ptr<ShardedDict> imm;
+    std::shared_ptr<const TableLevels> levels;
+  };
+
+  Parts Current() const;
+  void Write(const std::string &key, std::shared_ptr<const Version> version);
+  // make the memtable immutable as the state at log index, waiting for
+  // the previous one to finish flushing
+  void Rotate(int64_t index);
+  void CompactLoop();
+  int FlushMemtable();
+  // one compaction step if a level needs one: 1 done, 0 nothing to do,
+  // -1 on failure, -2 if an input table is corrupt
+  int CompactLevel();
+  int WriteTables(const std::vector<std::shared_ptr<Table>> &inputs,
+                  bool drop_tombstones,
+                  std::vector<std::shared_ptr<Table>> *outputs);
+  int WriteManifest(const TableLevels &levels, int64_t index);
+  std::string TablePath(uint64_t number) const;
+
+  std::string dir_;
+  std::size_t shard_bits_;
+  BlockCache cache_;
+  Histogram *lock_wait_;
+
+  // guards the fields below
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::shared_ptr<ShardedDict> mem_;
+  std::shared_ptr<ShardedDict> imm_;  // null unless a flush is pending
+  int64_t imm_index_;                 // the log index imm_ is the state at
+  std::shared_ptr<const TableLevels> levels_;
+  int64_t flushed_index_;  // the log index the tables are the state at
+  // a flush failed or a compaction read a corrupt table, stop rotating
+  // memtables and compacting
+  bool failed_;
+  bool stop_;
+
+  // only the writer touches these
+  std::size_t mem_bytes_;
+  int64_t mem_index_;  // of the last write to mem_
+  bool cleared_;       // Clear ran and no Checkpoint since
+  int64_t checkpoint_index_;  // of the last BeginCheckpoint
+
+  // held by the worker for a flush or compaction step and by Clear, so the
+  // table set only changes under it
+  std::mutex compaction_mutex_;
+  uint64_t next_file_;
+  std::vector<std::string> compact_pointer_;  // per level, for round robin
+  std::thread worker_;
+
+  Counter *flushes_;
+  Counter *compactions_;
+  Counter *compaction_bytes_;
+  Histogram *flush_latency_;
+  Histogram *compaction_latency_;
+  Histogram *stall_latency_;
+};
+
+}
+
+#endif
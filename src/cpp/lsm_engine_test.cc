@@ -0,0 +1,255 @@
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+
+#include "defines.h"
+#include "lsm_engine.h"
+#include "metrics.h"
+#include "test_util.h"
+
+namespace {
+
+using kvdefs::LsmEngine;
+using kvdefs::Version;
+
+std::string key(int i) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "key%06d", i);
+  return buf;
+}
+
+std::string value(int i, int round) {
+  return "value" + std::to_string(i) + "." + std::to_string(round);
+}
+
+// the .sst files in dir
+std::vector<std::string> tables(const std::string &dir) {
+  std::vector<std::string> names;
+  if (DIR *d = opendir(dir.c_str())) {
+    while (struct dirent *ent = readdir(d)) {
+      const std::string name = ent->d_name;
+      if (name.size() > 4 && name.compare(name.size() - 4, 4, ".sst") == 0)
+        names.push_back(name);
+    }
+    closedir(d);
+  }
+  return names;
+}
+
+// the live keys of [start, end) as Scan hands them out
+std::vector<std::string> scan(const LsmEngine &engine,
+                              const std::string &start,
+                              const std::string &end, std::size_t limit,
+                              int *ret = nullptr) {
+  std::vector<std::string> keys;
+  const int scanned = engine.Scan(
+      start, end, limit, [&keys](const std::string &k, const Version &) {
+        keys.push_back(k);
+        return true;
+      });
+  if (ret) *ret = scanned;
+  return keys;
+}
+
+bool has(const LsmEngine &engine, int i, int round) {
+  std::shared_ptr<const Version> version;
+  return engine.Get(key(i), &version) == 0 && version &&
+         version->value == value(i, round);
+}
+
+bool missing(const LsmEngine &engine, int i) {
+  std::shared_ptr<const Version> version;
+  return engine.Get(key(i), &version) == 0 && !version;
+}
+
+// Checkpoints flush to tables, the MANIFEST brings them back on reopen with
+// the index they cover. Later writes only live in the memtable, the log
+// replays those.
+void TestRecover() {
+  kvdefs::TestDir dir;
+  KV_CHECK(dir.ok());
+  const std::string path = dir.File("lsm");
+  int64_t index = -1;
+  {
+    kvdefs::Metrics metrics;
+    LsmEngine engine(path, 2, &metrics);
+    KV_CHECK(engine.Open(&index) == 0 && index == 0);
+    // five checkpoints of overwrites, enough for a level 0 compaction
+    for (int round = 0; round < 5; ++round) {
+      for (int i = 0; i < 500; ++i)
+        engine.Put(key(i), value(i, round), round * 1000 + i + 1, 0, 0);
+      KV_CHECK(engine.Checkpoint(round * 1000 + 500) == 0);
+    }
+    for (int i = 0; i < 500; i += 3) KV_CHECK(engine.Erase(key(i), 5000 + i));
+    KV_CHECK(!engine.Erase(key(9999), 6000));
+    KV_CHECK(engine.Checkpoint(6000) == 0);
+    engine.Put(key(1), value(1, 9), 6001, 0, 0);
+    KV_CHECK(has(engine, 1, 9));
+  }
+  {
+    kvdefs::Metrics metrics;
+    LsmEngine engine(path, 2, &metrics);
+    KV_CHECK(engine.Open(&index) == 0 && index == 6000);
+    for (int i = 0; i < 500; ++i)
+      KV_CHECK(i % 3 ? has(engine, i, 4) : missing(engine, i));
+    KV_CHECK(missing(engine, 9999));
+  }
+}
+
+// Scans merge the memtable over the tables, newest version first, skip
+// tombstones and stop at the limit.
+void TestScan() {
+  kvdefs::TestDir dir;
+  KV_CHECK(dir.ok());
+  kvdefs::Metrics metrics;
+  LsmEngine engine(dir.File("lsm"), 2, &metrics);
+  int64_t index = -1;
+  KV_CHECK(engine.Open(&index) == 0);
+
+  // even keys in a table, odd ones in the memtable with some even ones
+  // overwritten or deleted on top
+  for (int i = 0; i < 200; i += 2) engine.Put(key(i), value(i, 0), i + 1, 0, 0);
+  KV_CHECK(engine.Checkpoint(200) == 0);
+  for (int i = 1; i < 200; i += 2)
+    engine.Put(key(i), value(i, 1), 200 + i, 0, 0);
+  for (int i = 0; i < 200; i += 10)
+    engine.Put(key(i), value(i, 1), 400 + i, 0, 0);
+  for (int i = 4; i < 200; i += 10) KV_CHECK(engine.Erase(key(i), 600 + i));
+
+  std::vector<std::string> want;
+  for (int i = 0; i < 200; ++i)
+    if (i % 10 != 4) want.push_back(key(i));
+  KV_CHECK(scan(engine, "", "", 0) == want);
+
+  std::vector<std::string> range;
+  for (int i = 50; i < 80; ++i)
+    if (i % 10 != 4) range.push_back(key(i));
+  KV_CHECK(scan(engine, key(50), key(80), 0) == range);
+  // the limit counts live keys only
+  range.resize(10);
+  KV_CHECK(scan(engine, key(50), key(80), 10) == range);
+
+  std::vector<std::string> values;
+  engine.Scan(key(0), key(3), 0, [&values](const std::string &,
+                                           const Version &v) {
+    values.push_back(v.value);
+    return true;
+  });
+  KV_CHECK(values.size() == 3 && values[0] == value(0, 1) &&
+           values[1] == value(1, 1) && values[2] == value(2, 0));
+
+  // a snapshot streams the same keys
+  std::vector<std::string> streamed;
+  KV_CHECK(kvdefs::LiveDictView(engine).Scan(
+               [&streamed](const std::string &k, const Version &) {
+                 streamed.push_back(k);
+                 return true;
+               }) == 0);
+  KV_CHECK(streamed == want);
+}
+
+// A snapshot install clears the engine and writes the snapshot in; its
+// flushes are at index 0 until the install's checkpoint. Tables a crash
+// left behind at index 0 are dropped on reopen, the snapshot comes again.
+void TestInterruptedInstall() {
+  kvdefs::TestDir dir;
+  KV_CHECK(dir.ok());
+  const std::string path = dir.File("lsm");
+  int64_t index = -1;
+  {
+    kvdefs::Metrics metrics;
+    LsmEngine engine(path, 2, &metrics);
+    KV_CHECK(engine.Open(&index) == 0);
+    engine.Put(key(0), value(0, 0), 1, 0, 0);
+    KV_CHECK(engine.Checkpoint(1) == 0);
+
+    engine.Clear();
+    KV_CHECK(missing(engine, 0));
+    // a bit over two memtables, so at least one has been flushed
+    const std::string big(4096, 'x');
+    const int count = 2 * kvdefs::kLsmMemtableBytes / 4096 + 100;
+    for (int i = 0; i < count; ++i) engine.Put(key(i), big, 7, 0, 0);
+    KV_CHECK(!tables(path).empty());
+    KV_CHECK(kvdefs::read_file(path + "/MANIFEST").find("index 0\n") == 0);
+  }
+  {
+    kvdefs::Metrics metrics;
+    LsmEngine engine(path, 2, &metrics);
+    KV_CHECK(engine.Open(&index) == 0 && index == 0);
+    KV_CHECK(missing(engine, 0) && missing(engine, 1));
+    KV_CHECK(tables(path).empty());
+  }
+}
+
+// Tables the MANIFEST does not name are leftovers of a flush or compaction
+// that crashed, Open deletes them; a table it names that is corrupt fails
+// Open, or the reads that hit its bad block.
+void TestCorruptAndStrayTables() {
+  kvdefs::TestDir dir;
+  KV_CHECK(dir.ok());
+  const std::string path = dir.File("lsm");
+  int64_t index = -1;
+  {
+    kvdefs::Metrics metrics;
+    LsmEngine engine(path, 2, &metrics);
+    KV_CHECK(engine.Open(&index) == 0);
+    for (int i = 0; i < 100; ++i) engine.Put(key(i), value(i, 0), i + 1, 0, 0);
+    KV_CHECK(engine.Checkpoint(100) == 0);
+  }
+  std::vector<std::string> names = tables(path);
+  KV_CHECK(names.size() == 1);
+  if (names.size() != 1) return;
+  const std::string table = path + "/" + names[0];
+  const std::string good = kvdefs::read_file(table);
+
+  kvdefs::write_file(path + "/999999.sst", "leftover");
+  {
+    kvdefs::Metrics metrics;
+    LsmEngine engine(path, 2, &metrics);
+    KV_CHECK(engine.Open(&index) == 0 && index == 100);
+    KV_CHECK(has(engine, 42, 0));
+  }
+  KV_CHECK(!kvdefs::file_exists(path + "/999999.sst"));
+
+  // a bad footer fails Open
+  std::string data = good;
+  data[data.size() - 1] ^= 0x01;
+  kvdefs::write_file(table, data);
+  {
+    kvdefs::Metrics metrics;
+    LsmEngine engine(path, 2, &metrics);
+    KV_CHECK(engine.Open(&index) == -1);
+  }
+
+  // a bad block fails the reads and scans that reach it
+  data = good;
+  data.replace(0, 5, "\xff\xff\xff\xff\x0f", 5);
+  kvdefs::write_file(table, data);
+  {
+    kvdefs::Metrics metrics;
+    LsmEngine engine(path, 2, &metrics);
+    KV_CHECK(engine.Open(&index) == 0);
+    std::shared_ptr<const Version> version;
+    KV_CHECK(engine.Get(key(0), &version) == -1);
+    KV_CHECK(!engine.GetVersion(key(0)));
+    int ret = 0;
+    scan(engine, "", "", 0, &ret);
+    KV_CHECK(ret == -1);
+    KV_CHECK(kvdefs::LiveDictView(engine).Scan(
+                 [](const std::string &, const Version &) { return true; }) ==
+             -1);
+  }
+}
+
+}
+
+int main() {
+  TestRecover();
+  TestScan();
+  TestInterruptedInstall();
+  TestCorruptAndStrayTables();
+  return kvdefs::test_failures() ? 1 : 0;
+}
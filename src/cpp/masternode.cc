@@ -0,0 +1,566 @@
+#include <memory>
+#include <string>
+#include <map>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+#include <thread>
+
+#include "async_server.h"
+#include "channel_pool.h"
+#include "defines.h"
+#include "logger.h"
+#include "masternode.h"
+
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/health_check_service_interface.h>
+#include <grpcpp/ext/proto_server_reflection_plugin.h>
+
+namespace {
+
+typedef std::map<std::string, std::string> strmap_t;
+typedef std::map<std::string, int64_t> weightmap_t;
+typedef std::map<std::string, std::vector<std::string>> replicamap_t;
+
+// Sends one request to a set of datanodes at once through the async API and
+// waits for every answer or its deadline, so a round costs the slowest
+// node's answer, capped by the deadline, rather than the sum of them all.
+class MasterRequester {
+public:
+  explicit MasterRequester(const std::vector<std::string>& addrs)
+      : addrs_(addrs) {}
+
+  // each node's last log index, -1 where it did not answer in time
+  std::vector<int64_t> RequestLogVersion() {
+    kvStore::RequestContent request;
+    request.set_op(kvdefs::LOGVERSION);
+
+    std::vector<kvStore::RequestResult> replies;
+    std::vector<bool> oks = RequestAll(request, kvdefs::kProbeTimeoutMs, &replies);
+
+    std::vector<int64_t> versions(addrs_.size(), -1);
+    for (std::size_t i = 0; i < addrs_.size(); ++i) {
+      if (oks[i] && replies[i].err() == kvdefs::OK) {
+        versions[i] = std::stoll(replies[i].value());
+      } else {
+        KV_LOG(WARN) << "request version of " << addrs_[i] << " failed";
+      }
+    }
+    return versions;
+  }
+
+  // tell backups the table, and so who their primary is
+  void RequestRoute(const kvStore::RouteTable& table) {
+    kvStore::RequestContent request;
+    request.set_op(kvdefs::ROUTE);
+    request.set_epoch(table.epoch());
+    table.SerializeToString(request.mutable_value());
+
+    std::vector<kvStore::RequestResult> replies;
+    RequestAll(request, kvdefs::kProbeTimeoutMs, &replies);
+  }
+
+  void RequestPrimarySync(const kvStore::RouteTable& table) {
+    kvStore::RequestContent request;
+    request.set_op(kvdefs::PRIMARY);
+    request.set_epoch(table.epoch());
+    table.SerializeToString(request.mutable_value());
+
+    // a late answer only means the catch-up it starts is still running
+    std::vector<kvStore::RequestResult> replies;
+    RequestAll(request, kvdefs::kProbeTimeoutMs, &replies);
+  }
+
+  // ask primaries to hand the keys table moves away from their groups over
+  // to the new owners, true once they all arrived
+  bool RequestMigrate(const kvStore::RouteTable& table) {
+    kvStore::RequestContent request;
+    request.set_op(kvdefs::MIGRATE);
+    table.SerializeToString(request.mutable_value());
+
+    std::vector<kvStore::RequestResult> replies;
+    std::vector<bool> oks = RequestAll(request, kvdefs::kMigrateTimeoutMs, &replies);
+
+    bool migrated = true;
+    for (std::size_t i = 0; i < addrs_.size(); ++i) {
+      if (!oks[i] || replies[i].err() != kvdefs::OK) {
+        KV_LOG(ERROR) << "failed migrating keys off " << addrs_[i];
+        migrated = false;
+      }
+    }
+    return migrated;
+  }
+
+private:
+  struct Call {
+    grpc::ClientContext context;
+    grpc::Status status;
+    std::unique_ptr<kvStore::KvNodeService::Stub> stub;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<kvStore::RequestResult>> reader;
+  };
+
+  // which calls completed, their answers are in replies
+  std::vector<bool> RequestAll(const kvStore::RequestContent& request,
+                               int timeout_ms,
+                               std::vector<kvStore::RequestResult>* replies) {
+    grpc::CompletionQueue cq;
+    std::vector<Call> calls(addrs_.size());
+    replies->assign(addrs_.size(), kvStore::RequestResult());
+    const auto deadline = std::chrono::system_clock::now() +
+                          std::chrono::milliseconds(timeout_ms);
+
+    for (std::size_t i = 0; i < addrs_.size(); ++i) {
+      Call& call = calls[i];
+      call.stub = kvStore::KvNodeService::NewStub(kvdefs::get_channel(addrs_[i]));
+      call.context.set_deadline(deadline);
+      call.reader = call.stub->PrepareAsyncRequest(&call.context, request, &cq);
+      call.reader->StartCall();
+      call.reader->Finish(&(*replies)[i], &call.status, &call);
+    }
+
+    void* tag;
+    bool ok;
+    for (std::size_t i = 0; i < calls.size() && cq.Next(&tag, &ok); ++i) {}
+    cq.Shutdown();
+    while (cq.Next(&tag, &ok)) {}
+
+    std::vector<bool> oks(calls.size());
+    for (std::size_t i = 0; i < calls.size(); ++i) {
+      oks[i] = calls[i].status.ok();
+      if (!oks[i]) {
+        KV_LOG(WARN) << addrs_[i] << ": " << calls[i].status.error_code() << ": "
+                     << calls[i].status.error_message();
+      }
+    }
+    return oks;
+  }
+
+  std::vector<std::string> addrs_;
+};
+
+void fill_route_table(const strmap_t& addrs, const weightmap_t& weights,
+                      const replicamap_t& replicas, int64_t epoch,
+                      kvStore::RouteTable* table) {
+  table->set_epoch(epoch);
+  for (const auto& e : addrs) {
+    kvStore::RouteEntry *entry = table->add_entries();
+    entry->set_node(e.first);
+    entry->set_addr(e.second);
+    entry->set_weight(weights.at(e.first));
+    auto it = replicas.find(e.first);
+    if (it == replicas.end()) continue;
+    for (const std::string& addr : it->second) entry->add_replicas(addr);
+  }
+}
+
+}
+
+// The gRPC face of a MasterNode. The async server wraps it in
+// WithAsyncMethod_ templates, which need it default constructible, so the
+// node is bound after.
+class kvdefs::MasterNode::ServiceImpl : public kvStore::KvNodeService::Service {
+  public:
+    ServiceImpl() : node_(nullptr) {}
+    void Bind(MasterNode *node) { node_ = node; }
+
+  private:
+    grpc::Status SayHello(grpc::ServerContext* context, const kvStore::HelloRequest* request,
+                    kvStore::HelloReply* reply) override {
+      std::string suffix("master");
+      reply->set_message(request->name() + suffix);
+      return grpc::Status::OK;
+    }
+
+    grpc::Status Request(grpc::ServerContext *context,
+                         const kvStore::RequestContent *keyValue,
+                         kvStore::RequestResult *result) override {
+      return node_->RedirectToDatanode(*keyValue, result);
+    }
+
+    grpc::Status MultiRequest(grpc::ServerContext *context,
+                              const kvStore::MultiRequestContent *batch,
+                              kvStore::MultiRequestResult *results) override {
+      return node_->SplitToDatanodes(*batch, results);
+    }
+
+    grpc::Status Route(grpc::ServerContext *context,
+                       const kvStore::RouteRequest *request,
+                       kvStore::RouteTable *table) override {
+      return node_->GetRouteTable(table);
+    }
+
+    grpc::Status Stats(grpc::ServerContext *context,
+                       const kvStore::StatsRequest *req,
+                       kvStore::StatsReply *reply) override {
+      node_->metrics_.Fill(reply);
+      if (req->text()) reply->set_text(stats_text(*reply));
+      return grpc::Status::OK;
+    }
+
+    MasterNode *node_;
+};
+
+kvdefs::MasterNode::MasterNode(const Options &opts, Coordinator *coord)
+    : opts_(opts), coord_(coord), next_replica_(0), route_epoch_(0),
+      membership_changed_(false), membership_stop_(false) {
+  request_latency_ = metrics_.GetHistogram("op.request_us");
+  multi_latency_ = metrics_.GetHistogram("op.multi_us");
+  route_latency_ = metrics_.GetHistogram("op.route_us");
+  metrics_.AddGauge("route.epoch", [this]() {
+    std::lock_guard<std::mutex> guard(route_mutex_);
+    return route_epoch_;
+  });
+  metrics_.AddGauge("route.groups", [this]() {
+    std::lock_guard<std::mutex> guard(route_mutex_);
+    return static_cast<int64_t>(datanodes_addr_.size());
+  });
+}
+
+kvdefs::MasterNode::~MasterNode() { Stop(); }
+
+int kvdefs::MasterNode::Start() {
+  int ret = coord_->Create("/master", opts_.addr, COORD_PERSISTENT, nullptr);
+  if(ret) {
+    KV_LOG(ERROR) << "Failed creating znode: " << ret;
+    Cleanup();
+    return -1;
+  }
+
+  // changes seen before the worker starts are already flagged for it
+  coord_->WatchChildren("/master", [this]() {
+    std::lock_guard<std::mutex> guard(membership_mutex_);
+    membership_changed_ = true;
+    membership_cv_.notify_one();
+  });
+  membership_worker_ = std::thread(&MasterNode::MembershipLoop, this);
+
+  if (StartServer()) {
+    Cleanup();
+    return -1;
+  }
+  return 0;
+}
+
+// With async_threads set, Request, MultiRequest and Route are served from one
+// completion queue and polling thread each. None of them block, so each call
+// completes inline on its loop.
+int kvdefs::MasterNode::StartServer() {
+  typedef kvStore::KvNodeService::WithAsyncMethod_Request<
+      kvStore::KvNodeService::WithAsyncMethod_MultiRequest<
+          kvStore::KvNodeService::WithAsyncMethod_Route<ServiceImpl>>>
+      AsyncService;
+  typedef AsyncUnaryCall<AsyncService, kvStore::RequestContent,
+                         kvStore::RequestResult>
+      RequestCall;
+  typedef AsyncUnaryCall<AsyncService, kvStore::MultiRequestContent,
+                         kvStore::MultiRequestResult>
+      MultiRequestCall;
+  typedef AsyncUnaryCall<AsyncService, kvStore::RouteRequest,
+                         kvStore::RouteTable>
+      RouteCall;
+
+  AsyncService *async_service = nullptr;
+  if (opts_.async_threads > 0) {
+    async_service = new AsyncService;
+    async_service->Bind(this);
+    service_.reset(async_service);
+  } else {
+    ServiceImpl *service = new ServiceImpl;
+    service->Bind(this);
+    service_.reset(service);
+  }
+
+  grpc::EnableDefaultHealthCheckService(true);
+  grpc::reflection::InitProtoReflectionServerBuilderPlugin();
+  grpc::ServerBuilder builder;
+  // Listen on the given address without any authentication mechanism.
+  builder.AddListeningPort(opts_.addr, grpc::InsecureServerCredentials());
+  builder.RegisterService(service_.get());
+  for (int i = 0; i < opts_.async_threads; ++i)
+    cqs_.emplace_back(builder.AddCompletionQueue());
+  server_ = builder.BuildAndStart();
+  if (!server_) {
+    KV_LOG(ERROR) << "Failed listening on " << opts_.addr;
+    return -1;
+  }
+  KV_LOG(INFO) << "Server listening on " << opts_.addr;
+
+  if (!async_service) return 0;
+  for (auto &cq : cqs_) {
+    RequestCall::Arm(async_service, &AsyncService::RequestRequest, cq.get(),
+                     [this](const kvStore::RequestContent &req,
+                            kvStore::RequestResult *result,
+                            const RequestCall::Finisher &finish) {
+                       finish(RedirectToDatanode(req, result));
+                     });
+    MultiRequestCall::Arm(
+        async_service, &AsyncService::RequestMultiRequest, cq.get(),
+        [this](const kvStore::MultiRequestContent &batch,
+               kvStore::MultiRequestResult *results,
+               const MultiRequestCall::Finisher &finish) {
+          finish(SplitToDatanodes(batch, results));
+        });
+    RouteCall::Arm(async_service, &AsyncService::RequestRoute, cq.get(),
+                   [this](const kvStore::RouteRequest &request,
+                          kvStore::RouteTable *table,
+                          const RouteCall::Finisher &finish) {
+                     finish(GetRouteTable(table));
+                   });
+  }
+  event_loops_ = std::thread([this]() { run_event_loops(cqs_); });
+  return 0;
+}
+
+void kvdefs::MasterNode::Stop() {
+  if (server_) {
+    server_->Shutdown(std::chrono::system_clock::now() +
+                      std::chrono::milliseconds(kSyncTimeoutMs));
+    for (auto &cq : cqs_) cq->Shutdown();
+    if (event_loops_.joinable()) event_loops_.join();
+    server_.reset();
+  }
+  Cleanup();
+}
+
+void kvdefs::MasterNode::Cleanup() {
+  // a waiting worker would keep membership_cv_ from being destroyed
+  {
+    std::lock_guard<std::mutex> guard(membership_mutex_);
+    if (membership_stop_) return;
+    membership_stop_ = true;
+  }
+  membership_cv_.notify_all();
+  if (membership_worker_.joinable() &&
+      membership_worker_.get_id() != std::this_thread::get_id())
+    membership_worker_.join();
+  delete_recursive(coord_, "/master");
+  coord_->Close();
+}
+
+// The whole routing table, clients cache it and go to the datanodes
+// directly until one of them answers STALE.
+grpc::Status kvdefs::MasterNode::GetRouteTable(kvStore::RouteTable *table) {
+  ScopedTimer timer(route_latency_);
+  std::lock_guard<std::mutex> guard(route_mutex_);
+  if(datanodes_addr_.empty()) return grpc::Status::CANCELLED;
+  fill_route_table(datanodes_addr_, datanodes_weight_, datanodes_replicas_,
+                   route_epoch_, table);
+  return grpc::Status::OK;
+}
+
+// Answer every key of batch with the datanode group owning it. The
+// client sends one sub-batch per group, so a batch costs one master
+// round trip plus one per group instead of two per key.
+grpc::Status kvdefs::MasterNode::SplitToDatanodes(
+    const kvStore::MultiRequestContent &batch,
+    kvStore::MultiRequestResult *results) {
+  ScopedTimer timer(multi_latency_);
+  std::lock_guard<std::mutex> guard(route_mutex_);
+  if(datanodes_addr_.empty()) return grpc::Status::CANCELLED;
+  for (const auto &req : batch.reqs()) {
+    kvStore::RequestResult *result = results->add_results();
+    result->set_err(kvdefs::REDIRECT);
+    result->set_value(PickDatanode(req));
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status kvdefs::MasterNode::RedirectToDatanode(
+    const kvStore::RequestContent& req, kvStore::RequestResult *result) {
+  ScopedTimer timer(request_latency_);
+  std::lock_guard<std::mutex> guard(route_mutex_);
+  if(datanodes_addr_.empty()) return grpc::Status::CANCELLED;
+  // scans read every group, hand out all of them
+  if (req.op() == kvdefs::NODES) {
+    std::string addrs;
+    for (const auto& e : datanodes_addr_) {
+      if (addrs.size()) addrs += ",";
+      addrs += e.second;
+    }
+    result->set_err(kvdefs::OK);
+    result->set_value(addrs);
+    return grpc::Status::OK;
+  }
+  result->set_err(kvdefs::REDIRECT);
+  result->set_value(PickDatanode(req));
+  return grpc::Status::OK;
+}
+
+// The member of req's group to send it to: the primary, or for a follower
+// read the next of the group's members in turn. route_mutex_ must be held.
+std::string kvdefs::MasterNode::PickDatanode(
+    const kvStore::RequestContent& req) {
+  const std::string node = route_ring_.NodeFor(req.key());
+  const std::string& primary = datanodes_addr_[node];
+  if (req.op() != kvdefs::READ || req.consistency() == kvdefs::READ_STRONG)
+    return primary;
+  auto it = datanodes_replicas_.find(node);
+  if (it == datanodes_replicas_.end()) return primary;
+  const std::size_t pick = next_replica_++ % (it->second.size() + 1);
+  return pick ? it->second[pick - 1] : primary;
+}
+
+// Epochs come from a coordinator counter rather than a local one, so a
+// restarted master never hands out an epoch the datanodes have seen before.
+// Without the coordinator there is no epoch to hand out, so that fails.
+int kvdefs::MasterNode::NextRouteEpoch(int64_t *epoch) {
+  ScopedTimer timer(metrics_.GetHistogram("coord.epoch_us"));
+  int ret = lease_seq_block(coord_, "/routeepoch", 1, epoch);
+  if (ret) {
+    KV_LOG(ERROR) << "Failed bumping route epoch: " << ret;
+    return -1;
+  }
+  return 0;
+}
+
+// Bring the routing table in line with the datanodes registered under
+// /master. Every step talks to all nodes at once: one probe round picks the
+// primaries, one MIGRATE round moves keys if the ring changed, and the new
+// table is published before the PRIMARY round that tells the nodes about it.
+void kvdefs::MasterNode::ReconcileMembership() {
+  ScopedTimer round_timer(metrics_.GetHistogram("membership.reconcile_us"));
+  metrics_.GetCounter("membership.rounds")->Add(1);
+  std::vector<std::string> children;
+  {
+    ScopedTimer timer(metrics_.GetHistogram("coord.children_us"));
+    if (coord_->GetChildren("/master", &children)) return;
+  }
+
+  std::vector<std::string> nodes, names, addrs;
+  std::vector<int64_t> weights;
+  for (const std::string& child_name : children) {
+    std::string data;
+    if (coord_->Get("/master/" + child_name, &data, nullptr)) continue;
+    std::string addr;
+    int64_t weight;
+    kvdefs::parse_node_data(data.c_str(), &addr, &weight);
+
+    nodes.push_back(kvdefs::extract_data_node(child_name.c_str()));
+    names.push_back(child_name);
+    addrs.push_back(addr);
+    weights.push_back(weight);
+  }
+
+  // the member with the latest log version becomes its group's primary,
+  // the sitting one on a tie. A node that does not answer in time cannot
+  // be chosen; a group none of whose nodes answer drops out of the table
+  // until the next change.
+  std::vector<int64_t> log_versions;
+  {
+    ScopedTimer timer(metrics_.GetHistogram("membership.probe_us"));
+    log_versions = MasterRequester(addrs).RequestLogVersion();
+  }
+  strmap_t new_datanodes_addr;  // updated datanode router map
+  weightmap_t new_datanodes_weight;  // weights as announced by the primaries
+  std::map<std::string, int64_t> primary_versions;
+  for (std::size_t i = 0; i < nodes.size(); ++i) {
+    if (log_versions[i] < 0) continue;
+    auto sitting = datanodes_addr_.find(nodes[i]);
+    const bool is_sitting =
+        sitting != datanodes_addr_.end() && sitting->second == addrs[i];
+    if (new_datanodes_addr.count(nodes[i]) == 0 ||
+        primary_versions[nodes[i]] < log_versions[i] ||
+        (primary_versions[nodes[i]] == log_versions[i] && is_sitting)) {
+      new_datanodes_addr[nodes[i]] = addrs[i];
+      new_datanodes_weight[nodes[i]] = weights[i];
+      primary_versions[nodes[i]] = log_versions[i];
+      KV_LOG(INFO) << "set " << names[i] << " as " << nodes[i] << " to " << addrs[i];
+    }
+  }
+  // every other member that answered serves follower reads
+  replicamap_t new_datanodes_replicas;
+  for (std::size_t i = 0; i < nodes.size(); ++i) {
+    if (log_versions[i] >= 0 && addrs[i] != new_datanodes_addr[nodes[i]])
+      new_datanodes_replicas[nodes[i]].push_back(addrs[i]);
+  }
+
+  // If the ring changes, every surviving group first copies the keys it
+  // loses to their new owners, about 1/N of the data for a group joining
+  // N-1 others, and keeps serving while it does. A group that left
+  // takes its keys along, there is nobody to copy them from. Only this
+  // thread writes the routing state, so it may read it without the lock.
+  if (datanodes_weight_.size() && new_datanodes_weight != datanodes_weight_) {
+    kvStore::RouteTable table;
+    fill_route_table(new_datanodes_addr, new_datanodes_weight,
+                     new_datanodes_replicas, 0, &table);
+    std::vector<std::string> sources;
+    for (const auto& e : datanodes_addr_)
+      if (new_datanodes_addr.count(e.first)) sources.push_back(new_datanodes_addr[e.first]);
+
+    // rather keep the old layout than route keys to a group missing
+    // them, joining groups wait for the next change to retry
+    ScopedTimer timer(metrics_.GetHistogram("membership.migrate_us"));
+    if (!MasterRequester(sources).RequestMigrate(table)) {
+      metrics_.GetCounter("membership.migrate_failures")->Add(1);
+      for (auto it = new_datanodes_weight.begin(); it != new_datanodes_weight.end();) {
+        if (datanodes_weight_.count(it->first) == 0) {
+          new_datanodes_addr.erase(it->first);
+          new_datanodes_replicas.erase(it->first);
+          it = new_datanodes_weight.erase(it);
+        } else {
+          it->second = datanodes_weight_[it->first];
+          ++it;
+        }
+      }
+    }
+  }
+
+  // update datanode router in one swap, a new epoch marks every cached copy
+  // of the old table stale, which also makes clients pick up new backups.
+  // Without a fresh epoch the old table stays for this round, the next
+  // membership event tries again.
+  int64_t epoch = route_epoch_;
+  if ((new_datanodes_addr != datanodes_addr_ ||
+       new_datanodes_weight != datanodes_weight_ ||
+       new_datanodes_replicas != datanodes_replicas_) &&
+      NextRouteEpoch(&epoch)) {
+    metrics_.GetCounter("membership.epoch_failures")->Add(1);
+    return;
+  }
+  kvStore::RouteTable table;
+  fill_route_table(new_datanodes_addr, new_datanodes_weight,
+                   new_datanodes_replicas, epoch, &table);
+  {
+    HashRing ring(new_datanodes_weight);
+    std::lock_guard<std::mutex> guard(route_mutex_);
+    datanodes_addr_.swap(new_datanodes_addr);
+    datanodes_weight_.swap(new_datanodes_weight);
+    datanodes_replicas_.swap(new_datanodes_replicas);
+    std::swap(route_ring_, ring);
+    route_epoch_ = epoch;
+  }
+
+  // sending primarys complete sync request, which also tells them the
+  // epoch to check clients against and settles any migration
+  std::vector<std::string> primaries;
+  for (const auto& e : datanodes_addr_) primaries.push_back(e.second);
+  {
+    ScopedTimer timer(metrics_.GetHistogram("membership.primary_us"));
+    MasterRequester(primaries).RequestPrimarySync(table);
+  }
+
+  // and backups who their primary is, for read-index checks
+  std::vector<std::string> backups;
+  for (const auto& e : datanodes_replicas_)
+    backups.insert(backups.end(), e.second.begin(), e.second.end());
+  ScopedTimer timer(metrics_.GetHistogram("membership.route_us"));
+  MasterRequester(backups).RequestRoute(table);
+}
+
+// Run ReconcileMembership whenever the watch saw /master change. Changes
+// arriving during a round fold into a single next round.
+void kvdefs::MasterNode::MembershipLoop() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(membership_mutex_);
+      membership_cv_.wait(lock, [this] {
+        return membership_stop_ || membership_changed_;
+      });
+      if (membership_stop_) return;
+      membership_changed_ = false;
+    }
+    ReconcileMembership();
+  }
+}
@@ -0,0 +1,101 @@
+#ifndef KVSTORE_MASTERNODE_H
+#define KVSTORE_MASTERNODE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "coordinator.h"
+#include "hash_ring.h"
+#include "metrics.h"
+
+#include "kvstore.grpc.pb.h"
+
+namespace kvdefs {
+
+// The master: tracks the datanode groups registered under /master, picks
+// their primaries, moves keys when the ring changes and hands out the
+// routing table.
+class MasterNode {
+public:
+  struct Options {
+    Options() : async_threads(0) {}
+    std::string addr;
+    int async_threads;  // 0 serves on the sync thread pool
+  };
+
+  // coord must outlive the node
+  MasterNode(const Options &opts, Coordinator *coord);
+  ~MasterNode();
+
+  // create /master and start serving, 0 on success
+  int Start();
+  // stop serving and remove /master with everything below it
+  void Stop();
+
+private:
+  class ServiceImpl;
+  typedef std::map<std::string, std::string> strmap_t;
+  typedef std::map<std::string, int64_t> weightmap_t;
+  typedef std::map<std::string, std::vector<std::string>> replicamap_t;
+
+  int StartServer();
+  void Cleanup();
+
+  grpc::Status GetRouteTable(kvStore::RouteTable *table);
+  grpc::Status SplitToDatanodes(const kvStore::MultiRequestContent &batch,
+                                kvStore::MultiRequestResult *results);
+  grpc::Status RedirectToDatanode(const kvStore::RequestContent &req,
+                                  kvStore::RequestResult *result);
+  std::string PickDatanode(const kvStore::RequestContent &req);
+  int NextRouteEpoch(int64_t *epoch);
+  void ReconcileMembership();
+  void MembershipLoop();
+
+  Options opts_;
+  Coordinator *coord_;
+
+  // served by the Stats RPC, timings in microseconds
+  Metrics metrics_;
+  Histogram *request_latency_;
+  Histogram *multi_latency_;
+  Histogram *route_latency_;
+
+  strmap_t datanodes_addr_;
+  // each group's share of the keys, route_ring_ is built from it
+  weightmap_t datanodes_weight_;
+  // each group's live backups, follower reads are spread over them and the
+  // primary round robin by next_replica_
+  replicamap_t datanodes_replicas_;
+  uint64_t next_replica_;
+  HashRing route_ring_;
+  // bumped whenever datanodes_addr_ changes, so a client routing with an
+  // older table is told STALE by the datanodes and refetches it
+  int64_t route_epoch_;
+  // guards the routing state above against the membership worker's updates
+  std::mutex route_mutex_;
+
+  // set by the coordinator watch, the membership worker reconciles the
+  // routing state
+  std::mutex membership_mutex_;
+  std::condition_variable membership_cv_;
+  bool membership_changed_;
+  bool membership_stop_;
+  std::thread membership_worker_;
+
+  std::unique_ptr<grpc::Service> service_;
+  std::unique_ptr<grpc::Server> server_;
+  std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs_;
+  std::thread event_loops_;
+};
+
+}
+
+#endif
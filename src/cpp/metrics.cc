@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include "metrics.h"
+
+kvdefs::Histogram::Histogram(int sub_bits)
+    : sub_bits_(sub_bits), buckets_(64 << sub_bits), count_(0), sum_(0),
+      max_(0) {
+  for (auto &bucket : buckets_) bucket.store(0, std::memory_order_relaxed);
+}
+
+std::size_t kvdefs::Histogram::Index(uint64_t v) const {
+  if (v < (1u << sub_bits_)) return v;
+  int msb = 63;
+  while (!(v >> msb)) --msb;
+  const int group = msb - sub_bits_ + 1;
+  return (group << sub_bits_) + ((v >> (group - 1)) - (1u << sub_bits_));
+}
+
+// the upper end of bucket i
+uint64_t kvdefs::Histogram::Bound(std::size_t i) const {
+  if (i < (1u << sub_bits_)) return i;
+  const int group = i >> sub_bits_;
+  const uint64_t sub = i & ((1u << sub_bits_) - 1);
+  return (((1u << sub_bits_) + sub + 1) << (group - 1)) - 1;
+}
+
+static void raise_max(std::atomic<uint64_t> *max_value, uint64_t value) {
+  uint64_t max = max_value->load(std::memory_order_relaxed);
+  while (value > max && !max_value->compare_exchange_weak(
+                            max, value, std::memory_order_relaxed)) {
+  }
+}
+
+void kvdefs::Histogram::Record(uint64_t value) {
+  buckets_[Index(value)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+  raise_max(&max_, value);
+}
+
+void kvdefs::Histogram::Merge(const Histogram &other) {
+  for (std::size_t i = 0; i < buckets_.size(); ++i)
+    buckets_[i].fetch_add(other.buckets_[i].load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+  count_.fetch_add(other.Count(), std::memory_order_relaxed);
+  sum_.fetch_add(other.Sum(), std::memory_order_relaxed);
+  raise_max(&max_, other.Max());
+}
+
+uint64_t kvdefs::Histogram::Percentile(double p) const {
+  const uint64_t count = Count();
+  if (!count) return 0;
+  const uint64_t rank = std::max<uint64_t>(std::ceil(p * count), 1);
+  uint64_t seen = 0;
+  for (std::size_t i = 0; i < buckets_.size(); ++i) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) return std::min(Bound(i), Max());
+  }
+  return Max();
+}
+
+kvdefs::Counter *kvdefs::Metrics::GetCounter(const std::string &name) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  std::unique_ptr<Counter> &counter = counters_[name];
+  if (!counter) counter.reset(new Counter);
+  return counter.get();
+}
+
+kvdefs::Histogram *kvdefs::Metrics::GetHistogram(const std::string &name) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  std::unique_ptr<Histogram> &histogram = histograms_[name];
+  if (!histogram) histogram.reset(new Histogram);
+  return histogram.get();
+}
+
+void kvdefs::Metrics::AddGauge(const std::string &name,
+                               const std::function<int64_t()> &fn) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  gauges_[name] = fn;
+}
+
+void kvdefs::Metrics::Fill(kvStore::StatsReply *reply) const {
+  std::map<std::string, int64_t> values;
+  std::map<std::string, std::function<int64_t()>> gauges;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (const auto &e : counters_) values[e.first] = e.second->Value();
+    for (const auto &e : histograms_) {
+      const Histogram &h = *e.second;
+      kvStore::HistogramValue *value = reply->add_histograms();
+      value->set_name(e.first);
+      value->set_count(h.Count());
+      value->set_sum(h.Sum());
+      value->set_max(h.Max());
+      value->set_p50(h.Percentile(0.5));
+      value->set_p90(h.Percentile(0.9));
+      value->set_p99(h.Percentile(0.99));
+      value->set_p999(h.Percentile(0.999));
+    }
+    gauges = gauges_;
+  }
+  // gauges may take the owner's locks, never call them under ours
+  for (const auto &e : gauges) values[e.first] = e.second();
+  for (const auto &e : values) {
+    kvStore::CounterValue *value = reply->add_counters();
+    value->set_name(e.first);
+    value->set_value(e.second);
+  }
+}
+
+std::string kvdefs::Metrics::Text() const {
+  kvStore::StatsReply reply;
+  Fill(&reply);
+  return stats_text(reply);
+}
+
+std::string kvdefs::stats_text(const kvStore::StatsReply &reply) {
+  std::ostringstream strm;
+  for (const auto &c : reply.counters())
+    strm << c.name() << " " << c.value() << "\n";
+  for (const auto &h : reply.histograms()) {
+    strm << h.name() << " count=" << h.count()
+         << " mean=" << (h.count() ? h.sum() / h.count() : 0)
+         << " p50=" << h.p50() << " p90=" << h.p90() << " p99=" << h.p99()
+         << " p999=" << h.p999() << " max=" << h.max() << "\n";
+  }
+  return strm.str();
+}
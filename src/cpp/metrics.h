@@ -0,0 +1,105 @@
+#ifndef KVSTORE_METRICS_H
+#define KVSTORE_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "kvstore.pb.h"
+
+namespace kvdefs {
+
+class Counter {
+public:
+  Counter() : value_(0) {}
+  void Add(int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+  int64_t Value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<int64_t> value_;
+};
+
+// Log-linear histogram of non-negative samples: 2^sub_bits buckets per
+// power of two, so with the default 3 a percentile is within about 12% of
+// the true value. Record is a couple of relaxed atomic adds and never locks,
+// readers may see a sample's bucket before its sum.
+class Histogram {
+public:
+  explicit Histogram(int sub_bits = 3);
+
+  void Record(uint64_t value);
+  // add other's samples, it must have the same sub_bits
+  void Merge(const Histogram &other);
+  uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t Sum() const { return sum_.load(std::memory_order_relaxed); }
+  uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+  double Mean() const {
+    const uint64_t count = Count();
+    return count ? static_cast<double>(Sum()) / count : 0;
+  }
+  // the smallest bucket bound at or above fraction p of the samples
+  uint64_t Percentile(double p) const;
+
+private:
+  std::size_t Index(uint64_t value) const;
+  uint64_t Bound(std::size_t index) const;
+
+  const int sub_bits_;
+  std::vector<std::atomic<uint64_t>> buckets_;
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> max_;
+};
+
+// The named counters, gauges and histograms of one server. Metrics are made
+// on first use and live as long as the registry, so hot paths look theirs up
+// once and keep the pointer. Timings are in microseconds and named *_us.
+class Metrics {
+public:
+  Counter *GetCounter(const std::string &name);
+  Histogram *GetHistogram(const std::string &name);
+  // fn is called for the current value whenever the metrics are read
+  void AddGauge(const std::string &name, const std::function<int64_t()> &fn);
+
+  // counters and gauges go to reply->counters, sorted by name
+  void Fill(kvStore::StatsReply *reply) const;
+  // one line per metric, the format of StatsReply.text
+  std::string Text() const;
+
+private:
+  mutable std::mutex mutex_;
+  std::map<std::string, std::unique_ptr<Counter>> counters_;
+  std::map<std::string, std::unique_ptr<Histogram>> histograms_;
+  std::map<std::string, std::function<int64_t()>> gauges_;
+};
+
+// Records the microseconds between its construction and destruction.
+class ScopedTimer {
+public:
+  explicit ScopedTimer(Histogram *histogram)
+      : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() { histogram_->Record(ElapsedUs()); }
+
+  uint64_t ElapsedUs() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - start_)
+        .count();
+  }
+
+private:
+  Histogram *histogram_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// render a StatsReply the way Metrics::Text does
+std::string stats_text(const kvStore::StatsReply &reply);
+
+}
+
+#endif
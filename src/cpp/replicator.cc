@@ -0,0 +1,241 @@
+#include <algorithm>
+#include <chrono>
+
+#include "channel_pool.h"
+#include "defines.h"
+#include "logger.h"
+#include "replicator.h"
+
+kvdefs::Replicator::Replicator(Metrics *metrics)
+    : metrics_(metrics), poller_(&Replicator::Poll, this) {}
+
+kvdefs::Replicator::~Replicator() {
+  cq_.Shutdown();
+  poller_.join();
+}
+
+kvdefs::Replicator::Peer *kvdefs::Replicator::PeerFor(const std::string &addr) {
+  std::unique_ptr<Peer> &peer = peers_[addr];
+  if (!peer) {
+    peer.reset(new Peer);
+    peer->addr = addr;
+    peer->retry_at = std::chrono::steady_clock::now();
+    if (metrics_) {
+      peer->sync_latency = metrics_->GetHistogram("repl.sync_us." + addr);
+      peer->sync_failures = metrics_->GetCounter("repl.sync_failures." + addr);
+    }
+  } else if (peer->removed) {
+    // back before its last Sync returned, as good as a new one
+    peer->removed = false;
+    peer->lagging = true;
+    peer->voter = false;
+    peer->retry_at = std::chrono::steady_clock::now();
+  }
+  return peer.get();
+}
+
+void kvdefs::Replicator::Answer(Round *round, bool acked) {
+  std::lock_guard<std::mutex> guard(round->mutex);
+  ++round->answered;
+  if (acked) ++round->acks;
+  round->cv.notify_all();
+}
+
+void kvdefs::Replicator::FailQueueLocked(Peer *peer) {
+  for (const Pending &pending : peer->queue)
+    if (pending.round) Answer(pending.round.get(), false);
+  peer->queue.clear();
+}
+
+std::shared_ptr<kvdefs::Replicator::Round> kvdefs::Replicator::Send(
+    const std::vector<std::string> &peers,
+    const std::shared_ptr<const kvStore::SyncContent> &ent) {
+  std::shared_ptr<Round> round = std::make_shared<Round>();
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  for (const std::string &addr : peers) {
+    KV_LOG(DEBUG) << "syncing " << addr;
+    Peer *peer = PeerFor(addr);
+    if (peer->voter) ++round->voters;
+    // it would see a gap, the catch-up brings it the entry instead
+    if (peer->lagging) continue;
+    if (peer->queue.size() >= kReplicationQueueMax) {
+      KV_LOG(WARN) << "dropping the replication queue of " << addr;
+      FailQueueLocked(peer);
+      peer->lagging = true;
+      peer->retry_at = std::chrono::steady_clock::now();
+      continue;
+    }
+    Pending pending;
+    pending.ent = ent;
+    if (!peer->held) {
+      pending.round = round;
+      ++round->asked;
+    }
+    peer->queue.push_back(pending);
+    SendNextLocked(peer);
+  }
+  return round;
+}
+
+bool kvdefs::Replicator::Settled(Round *round) {
+  std::lock_guard<std::mutex> guard(round->mutex);
+  return round->acks >= Quorum(round->voters) ||
+         round->answered >= round->asked;
+}
+
+std::size_t kvdefs::Replicator::Wait(Round *round) {
+  const std::size_t quorum = Quorum(round->voters);
+  std::unique_lock<std::mutex> lock(round->mutex);
+  round->cv.wait(lock, [round, quorum] {
+    return round->acks >= quorum || round->answered >= round->asked;
+  });
+  return round->acks;
+}
+
+void kvdefs::Replicator::Hold(const std::string &addr) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  Peer *peer = PeerFor(addr);
+  peer->held = true;
+  for (Pending &pending : peer->queue) {
+    if (pending.round) Answer(pending.round.get(), false);
+    pending.round.reset();
+  }
+  idle_cv_.wait(lock, [peer] { return !peer->busy; });
+  // the catch-up reads our state after this, so it covers whatever the peer
+  // lost before
+  peer->lagging = false;
+}
+
+bool kvdefs::Replicator::Release(const std::string &addr, int64_t index) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  Peer *peer = PeerFor(addr);
+  peer->held = false;
+  if (index < 0 || peer->lagging) {
+    peer->queue.clear();
+    peer->lagging = true;
+    peer->retry_at = std::chrono::steady_clock::now() +
+                     std::chrono::milliseconds(kCatchUpRetryMs);
+    return false;
+  }
+  peer->voter = true;
+  // the catch-up already brought these
+  while (peer->queue.size() && peer->queue.front().ent->index() <= index)
+    peer->queue.pop_front();
+  SendNextLocked(peer);
+  return true;
+}
+
+std::vector<std::string> kvdefs::Replicator::Lagging() {
+  std::vector<std::string> due;
+  const auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> guard(mutex_);
+  for (auto &e : peers_) {
+    Peer *peer = e.second.get();
+    if (!peer->lagging || peer->held || peer->removed || peer->retry_at > now)
+      continue;
+    peer->retry_at = now + std::chrono::milliseconds(kCatchUpRetryMs);
+    due.push_back(peer->addr);
+  }
+  return due;
+}
+
+void kvdefs::Replicator::Retain(const std::vector<std::string> &peers) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  for (auto it = peers_.begin(); it != peers_.end();) {
+    Peer *peer = it->second.get();
+    if (std::find(peers.begin(), peers.end(), it->first) != peers.end()) {
+      ++it;
+      continue;
+    }
+    FailQueueLocked(peer);
+    if (peer->busy) {
+      // Poll still gets its last Sync back, it drops the peer then
+      peer->removed = true;
+      ++it;
+    } else {
+      it = peers_.erase(it);
+    }
+  }
+}
+
+void kvdefs::Replicator::SendNextLocked(Peer *peer) {
+  if (peer->busy || peer->held || peer->queue.empty()) return;
+
+  if (!peer->stub)
+    peer->stub = kvStore::KvNodeService::NewStub(get_channel(peer->addr));
+
+  Call *call = new Call;
+  call->peer = peer;
+  std::size_t bytes = 0;
+  while (peer->queue.size() && call->pendings.size() < kSyncBatchEntries &&
+         bytes < kSyncBatchBytes) {
+    bytes += peer->queue.front().ent->ByteSizeLong();
+    call->pendings.push_back(peer->queue.front());
+    peer->queue.pop_front();
+  }
+  peer->busy = true;
+
+  call->start = std::chrono::steady_clock::now();
+  call->context.set_deadline(std::chrono::system_clock::now() +
+                             std::chrono::milliseconds(kSyncTimeoutMs));
+  if (call->pendings.size() == 1) {
+    call->reader = peer->stub->PrepareAsyncSync(
+        &call->context, *call->pendings.front().ent, &cq_);
+  } else {
+    for (const Pending &pending : call->pendings)
+      *call->batch.add_ents() = *pending.ent;
+    call->reader =
+        peer->stub->PrepareAsyncMultiSync(&call->context, call->batch, &cq_);
+  }
+  call->reader->StartCall();
+  call->reader->Finish(&call->reply, &call->status, call);
+}
+
+void kvdefs::Replicator::Poll() {
+  void *tag;
+  bool ok;
+  while (cq_.Next(&tag, &ok)) {
+    Call *call = static_cast<Call *>(tag);
+    const bool acked = ok && call->status.ok() &&
+                       call->reply.err() == kvdefs::SYNC_SUCC;
+    if (call->peer->sync_latency) {
+      call->peer->sync_latency->Record(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now() - call->start)
+              .count());
+      if (!acked) call->peer->sync_failures->Add(1);
+    }
+    if (!call->status.ok()) {
+      KV_LOG(WARN) << "RPC failed: " << call->status.error_code() << ": "
+                   << call->status.error_message();
+    }
+
+    for (const Pending &pending : call->pendings)
+      if (pending.round) Answer(pending.round.get(), acked);
+
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      Peer *peer = call->peer;
+      if (call->status.error_code() == grpc::StatusCode::UNAVAILABLE) {
+        // reconnect on the next send rather than wait out channel backoff
+        ChannelPool::Instance().Invalidate(peer->addr);
+        peer->stub.reset();
+      }
+      peer->busy = false;
+      if (!acked && !peer->removed && !peer->lagging) {
+        // whatever it missed would leave a gap in its log, a catch-up
+        // brings it instead of the entries queued behind it
+        FailQueueLocked(peer);
+        peer->lagging = true;
+        peer->retry_at = std::chrono::steady_clock::now();
+      }
+      if (peer->removed)
+        peers_.erase(peer->addr);
+      else
+        SendNextLocked(peer);
+    }
+    idle_cv_.notify_all();
+    delete call;
+  }
+}
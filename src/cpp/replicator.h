@@ -0,0 +1,142 @@
+#ifndef KVSTORE_REPLICATOR_H
+#define KVSTORE_REPLICATOR_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "metrics.h"
+
+#include "kvstore.grpc.pb.h"
+
+namespace kvdefs {
+
+// Fans SyncContent entries out to backups with the async gRPC API.
+//
+// All peers of a round are sent to at once and the caller only waits for
+// enough of the voting ones to ack for a majority of the group, counting
+// itself, see Quorum; slower peers finish in the
+// background. Backups reject entries that are not newer than their log
+// tail, so each peer keeps its own queue with at most one Sync in flight,
+// and sees entries in the order they were replicated even when it lags
+// behind the rest. What queued up for a peer while its last Sync was in
+// flight goes in one MultiSync, which the peer syncs to disk once.
+//
+// A peer gets nothing until a first catch-up brought it up to our log, and
+// only votes from then on. A peer being caught up is held: its entries
+// queue up unsent until the catch-up is through. A queue that reaches
+// kReplicationQueueMax is dropped, and so is the queue of a peer that
+// failed a Sync; the peer gets nothing more until a catch-up brings it
+// back, see Lagging. Held and lagging peers still count towards the
+// quorum, they just do not ack.
+//
+// With metrics, each peer's Sync round trips go to repl.sync_us.<addr> and
+// its failed ones to repl.sync_failures.<addr>.
+class Replicator {
+public:
+  explicit Replicator(Metrics *metrics = nullptr);
+  ~Replicator();
+
+  // acks out of voters peers that make a majority of the group, the
+  // sender being the one member not counted in voters
+  static std::size_t Quorum(std::size_t voters) { return (voters + 1) / 2; }
+
+  // the sends of one entry
+  struct Round {
+    Round() : voters(0), asked(0), acks(0), answered(0) {}
+    std::size_t voters;  // of the peers it was sent to
+    std::size_t asked;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::size_t acks;
+    std::size_t answered;
+  };
+
+  // Queue ent to every one of peers that is caught up and return the round
+  // to Wait on; entries sent one after another reach each peer in that
+  // order. Sends to slower peers keep a reference to ent, so it must not
+  // change afterwards.
+  std::shared_ptr<Round> Send(
+      const std::vector<std::string> &peers,
+      const std::shared_ptr<const kvStore::SyncContent> &ent);
+  // Returns the number of peers that acked round once its quorum did, or
+  // once every peer it was sent to answered, whichever comes first.
+  std::size_t Wait(Round *round);
+  // whether Wait on round would return at once
+  static bool Settled(Round *round);
+  // stop sending to addr once its Sync in flight is answered, for a
+  // catch-up; what was queued for it stops counting towards its rounds
+  void Hold(const std::string &addr);
+  // the catch-up brought addr up to index: send it what queued up after
+  // that. false, with addr left lagging, if its queue overflowed meanwhile
+  // or index is negative for a failed catch-up.
+  bool Release(const std::string &addr, int64_t index);
+  // the peers that are not caught up and are due a catch-up, each is
+  // returned once every kCatchUpRetryMs
+  std::vector<std::string> Lagging();
+  // forget every peer but those in peers
+  void Retain(const std::vector<std::string> &peers);
+
+private:
+  struct Pending {
+    std::shared_ptr<const kvStore::SyncContent> ent;
+    std::shared_ptr<Round> round;  // null once it no longer votes
+  };
+
+  struct Peer {
+    Peer()
+        : busy(false), held(false), lagging(true), voter(false),
+          removed(false),
+          sync_latency(nullptr), sync_failures(nullptr) {}
+    std::string addr;
+    std::unique_ptr<kvStore::KvNodeService::Stub> stub;
+    std::deque<Pending> queue;
+    bool busy;
+    bool held;
+    bool lagging;  // not caught up or lost entries, needs a catch-up
+    bool voter;    // caught up at least once
+    bool removed;  // Retain dropped it while a Sync was in flight
+    std::chrono::steady_clock::time_point retry_at;
+    Histogram *sync_latency;
+    Counter *sync_failures;
+  };
+
+  struct Call {
+    Peer *peer;
+    std::vector<Pending> pendings;
+    kvStore::SyncBatch batch;  // the entries of pendings, if more than one
+    std::chrono::steady_clock::time_point start;
+    grpc::ClientContext context;
+    kvStore::SyncResult reply;
+    grpc::Status status;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<kvStore::SyncResult>>
+        reader;
+  };
+
+  Peer *PeerFor(const std::string &addr);
+  void SendNextLocked(Peer *peer);
+  static void Answer(Round *round, bool acked);
+  // count what is queued for peer as not acked, then drop it
+  void FailQueueLocked(Peer *peer);
+  void Poll();
+
+  Metrics *metrics_;
+  std::mutex mutex_;
+  std::condition_variable idle_cv_;
+  std::map<std::string, std::unique_ptr<Peer>> peers_;
+
+  grpc::CompletionQueue cq_;
+  std::thread poller_;
+};
+
+}
+
+#endif
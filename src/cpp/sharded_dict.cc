@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <functional>
+#include <utility>
+
+#include "metrics.h"
+#include "sharded_dict.h"
+
+kvdefs::ShardedDict::ShardedDict(std::size_t shard_bits)
+    : shard_bits_(shard_bits), lock_wait_(nullptr) {
+  for (std::size_t i = 0; i < (std::size_t(1) << shard_bits_); ++i)
+    shards_.emplace_back(new Shard);
+}
+
+std::size_t kvdefs::ShardedDict::ShardIndex(const std::string &key) const {
+  // std::hash makes no promise about its low bits, Fibonacci-mix and take
+  // the high bits.
+  uint64_t h = std::hash<std::string>()(key);
+  h *= 0x9E3779B97F4A7C15ull;
+  return shard_bits_ ? h >> (64 - shard_bits_) : 0;
+}
+
+kvdefs::ShardedDict::Shard &
+kvdefs::ShardedDict::ShardFor(const std::string &key) const {
+  return *shards_[ShardIndex(key)];
+}
+
+void kvdefs::ShardedDict::LockShared(const Shard &shard) const {
+  if (shard.lock.TryLockShared()) return;
+  if (!lock_wait_) {
+    shard.lock.LockShared();
+    return;
+  }
+  ScopedTimer timer(lock_wait_);
+  shard.lock.LockShared();
+}
+
+void kvdefs::ShardedDict::Lock(Shard &shard) const {
+  if (shard.lock.TryLock()) return;
+  if (!lock_wait_) {
+    shard.lock.Lock();
+    return;
+  }
+  ScopedTimer timer(lock_wait_);
+  shard.lock.Lock();
+}
+
+std::shared_ptr<const kvdefs::Version>
+kvdefs::ShardedDict::GetVersion(const std::string &key) const {
+  Shard &shard = ShardFor(key);
+  std::shared_ptr<const Version> found;
+  LockShared(shard);
+  auto it = shard.map.find(key);
+  if (it != shard.map.end()) found = it->second;
+  shard.lock.UnlockShared();
+  return found;
+}
+
+bool kvdefs::ShardedDict::Get(const std::string &key, std::string *value,
+                              int64_t *index) const {
+  std::shared_ptr<const Version> found = GetVersion(key);
+  if (!found) return false;
+  *value = found->value;
+  if (index) *index = found->index;
+  return true;
+}
+
+void kvdefs::ShardedDict::Put(const std::string &key, const std::string &value,
+                              int64_t index, int codec, int64_t expire_at) {
+  Put(key, std::make_shared<const Version>(value, index, codec, expire_at));
+}
+
+void kvdefs::ShardedDict::Put(const std::string &key,
+                              std::shared_ptr<const Version> version) {
+  Shard &shard = ShardFor(key);
+  Lock(shard);
+  shard.map[key].swap(version);
+  shard.lock.Unlock();
+  // the replaced version, if any, is released here outside the lock, or by
+  // the last reader still holding it
+}
+
+bool kvdefs::ShardedDict::Erase(const std::string &key) {
+  std::shared_ptr<const Version> old;
+  Shard &shard = ShardFor(key);
+  Lock(shard);
+  auto it = shard.map.find(key);
+  if (it != shard.map.end()) {
+    old.swap(it->second);
+    shard.map.erase(it);
+  }
+  shard.lock.Unlock();
+  return old != nullptr;
+}
+
+std::size_t kvdefs::ShardedDict::Size() const {
+  std::size_t n = 0;
+  for (const auto &shard : shards_) {
+    LockShared(*shard);
+    n += shard->map.size();
+    shard->lock.UnlockShared();
+  }
+  return n;
+}
+
+namespace {
+
+// keys copied out of a shard per lock acquisition during a scan, the first
+// run of each shard is short and every refill doubles it up to the maximum
+const std::size_t kScanFirstRunKeys = 8;
+const std::size_t kScanRunKeys = 256;
+
+}
+
+void kvdefs::ShardedDict::Scan(const std::string &start,
+                               const std::string &end, std::size_t limit,
+                               const ScanFn &fn) const {
+  std::size_t emitted = 0;
+  for (Cursor c(*this, start, end); c.Valid() && (!limit || emitted < limit);
+       c.Next()) {
+    if (!fn(c.key(), *c.version())) return;
+    ++emitted;
+  }
+}
+
+kvdefs::ShardedDict::Cursor::Cursor(const ShardedDict &dict,
+                                    const std::string &start,
+                                    const std::string &end)
+    : dict_(dict), end_(end), runs_(dict.shards_.size()) {
+  for (std::size_t i = 0; i < runs_.size(); ++i) {
+    runs_[i].size = kScanFirstRunKeys;
+    runs_[i].next = start;
+    Refill(i);
+    if (runs_[i].entries.size()) heap_.push_back(i);
+  }
+  std::make_heap(heap_.begin(), heap_.end(),
+                 [this](std::size_t a, std::size_t b) { return After(a, b); });
+}
+
+bool kvdefs::ShardedDict::Cursor::After(std::size_t a, std::size_t b) const {
+  return runs_[a].entries[runs_[a].pos].first >
+         runs_[b].entries[runs_[b].pos].first;
+}
+
+void kvdefs::ShardedDict::Cursor::Refill(std::size_t i) {
+  Run &run = runs_[i];
+  run.entries.clear();
+  run.pos = 0;
+  const Shard &shard = *dict_.shards_[i];
+  dict_.LockShared(shard);
+  for (auto it = shard.map.lower_bound(run.next);
+       it != shard.map.end() && (end_.empty() || it->first < end_) &&
+       run.entries.size() < run.size;
+       ++it)
+    run.entries.emplace_back(it->first, it->second);
+  shard.lock.UnlockShared();
+
+  run.exhausted = run.entries.size() < run.size;
+  // the smallest key greater than the last one copied
+  if (!run.exhausted) run.next = run.entries.back().first + '\0';
+  run.size = std::min(run.size * 2, kScanRunKeys);
+}
+
+void kvdefs::ShardedDict::Cursor::Next() {
+  auto after = [this](std::size_t a, std::size_t b) { return After(a, b); };
+  std::pop_heap(heap_.begin(), heap_.end(), after);
+  const std::size_t i = heap_.back();
+  Run &run = runs_[i];
+  if (++run.pos == run.entries.size()) {
+    if (!run.exhausted) Refill(i);
+    if (run.pos == run.entries.size()) {
+      heap_.pop_back();
+      return;
+    }
+  }
+  std::push_heap(heap_.begin(), heap_.end(), after);
+}
+
+void kvdefs::ShardedDict::CopyTo(VersionMap *out, const std::string &start,
+                                 const std::string &end) const {
+  out->clear();
+  for (const auto &shard : shards_) {
+    LockShared(*shard);
+    auto last = end.empty() ? shard->map.end() : shard->map.lower_bound(end);
+    for (auto it = shard->map.lower_bound(start); it != last; ++it)
+      out->emplace_hint(out->end(), *it);
+    shard->lock.UnlockShared();
+  }
+}
+
+void kvdefs::ShardedDict::Assign(VersionMap &&entries) {
+  std::vector<VersionMap> parts(shards_.size());
+  for (auto &kv : entries) {
+    const std::size_t i = ShardIndex(kv.first);
+    parts[i].emplace_hint(parts[i].end(), kv.first, std::move(kv.second));
+  }
+  entries.clear();
+
+  for (std::size_t i = 0; i < shards_.size(); ++i) {
+    Lock(*shards_[i]);
+    shards_[i]->map.swap(parts[i]);
+    shards_[i]->lock.Unlock();
+  }
+}
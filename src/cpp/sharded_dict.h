@@ -0,0 +1,158 @@
+#ifndef KVSTORE_SHARDED_DICT_H
+#define KVSTORE_SHARDED_DICT_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+namespace kvdefs {
+
+class Histogram;
+
+class RwLock {
+public:
+  RwLock() { pthread_rwlock_init(&lock_, nullptr); }
+  ~RwLock() { pthread_rwlock_destroy(&lock_); }
+  void LockShared() { pthread_rwlock_rdlock(&lock_); }
+  bool TryLockShared() { return !pthread_rwlock_tryrdlock(&lock_); }
+  void UnlockShared() { pthread_rwlock_unlock(&lock_); }
+  void Lock() { pthread_rwlock_wrlock(&lock_); }
+  bool TryLock() { return !pthread_rwlock_trywrlock(&lock_); }
+  void Unlock() { pthread_rwlock_unlock(&lock_); }
+
+private:
+  RwLock(const RwLock &) = delete;
+  RwLock &operator=(const RwLock &) = delete;
+  pthread_rwlock_t lock_;
+};
+
+// One committed value of a key, tagged with the log index that wrote it,
+// the VALUE_CODEC value is stored in and when a TTL runs out (see now_ms, 0
+// for never). Versions are immutable once published; readers hold on to the
+// one they found while writers install a replacement.
+// A tombstone records a delete where older data may still hold the key, the
+// lsm engine's memtable and sorted files keep them.
+struct Version {
+  Version(const std::string &v, int64_t i, int c = 0, int64_t e = 0,
+          bool t = false)
+      : value(v), index(i), codec(c), expire_at(e), tombstone(t) {}
+  // reads treat an expired key as gone until an EXPIRE entry reclaims it
+  bool Expired(int64_t now) const { return expire_at && expire_at <= now; }
+  const std::string value;
+  const int64_t index;
+  const int codec;
+  const int64_t expire_at;
+  const bool tombstone;
+};
+
+// keys and their versions, in key order; snapshots are taken and installed
+// in this form, so copying dict out never copies a value
+typedef std::map<std::string, std::shared_ptr<const Version>> VersionMap;
+
+// String map split into independently locked shards, so operations on
+// different keys rarely contend. Each shard stays an ordered std::map.
+//
+// The shard lock only ever covers a map lookup and a pointer swap: writers
+// build the new Version before locking and readers copy the value out after
+// unlocking, so a read never waits on a value copy, the wal or replication.
+class ShardedDict {
+public:
+  class Cursor;
+
+  explicit ShardedDict(std::size_t shard_bits = 6);
+
+  bool Get(const std::string &key, std::string *value,
+           int64_t *index = nullptr) const;
+  std::shared_ptr<const Version> GetVersion(const std::string &key) const;
+  void Put(const std::string &key, const std::string &value, int64_t index,
+           int codec = 0, int64_t expire_at = 0);
+  void Put(const std::string &key, std::shared_ptr<const Version> version);
+  bool Erase(const std::string &key);
+  std::size_t Size() const;
+
+  typedef std::function<bool(const std::string &, const Version &)> ScanFn;
+  // Feeds fn the keys in [start, end) in order, at most limit of them (0 for
+  // no limit), until fn returns false. An empty end means no upper bound.
+  // Each shard is read in short runs under its lock and the runs are merged,
+  // so a long scan never holds a lock while fn runs; it is not a consistent
+  // cut across shards either.
+  void Scan(const std::string &start, const std::string &end,
+            std::size_t limit, const ScanFn &fn) const;
+
+  // Copies every shard's keys in [start, end) into one ordered map, an
+  // empty end means no upper bound. Shards are locked one at a time,
+  // callers that need a consistent cut must hold off writers.
+  void CopyTo(VersionMap *out, const std::string &start = "",
+              const std::string &end = "") const;
+  // replaces the whole content with entries
+  void Assign(VersionMap &&entries);
+
+  // record how long each contended shard lock acquisition waited, in
+  // microseconds; uncontended ones cost a trylock and are not recorded
+  void SetLockWaitHistogram(Histogram *histogram) { lock_wait_ = histogram; }
+
+private:
+  struct Shard {
+    mutable RwLock lock;
+    VersionMap map;
+  };
+
+  std::size_t ShardIndex(const std::string &key) const;
+  Shard &ShardFor(const std::string &key) const;
+  void LockShared(const Shard &shard) const;
+  void Lock(Shard &shard) const;
+
+  std::size_t shard_bits_;
+  Histogram *lock_wait_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+// Walks the keys in [start, end) in order, an empty end meaning no upper
+// bound, the way Scan does: each shard is read in runs under its lock and
+// the runs are merged. Runs start short and grow, so a walk that stops
+// after a few keys reads little more than those. No lock is held between
+// calls, and keys a shard has yet to hand out show their latest version.
+class ShardedDict::Cursor {
+public:
+  Cursor(const ShardedDict &dict, const std::string &start,
+         const std::string &end);
+
+  bool Valid() const { return !heap_.empty(); }
+  const std::string &key() const { return Current().first; }
+  const std::shared_ptr<const Version> &version() const {
+    return Current().second;
+  }
+  void Next();
+
+private:
+  typedef std::pair<std::string, std::shared_ptr<const Version>> Entry;
+  struct Run {
+    std::vector<Entry> entries;
+    std::size_t pos;
+    std::size_t size;  // keys the next refill reads
+    std::string next;  // where it starts
+    bool exhausted;
+  };
+
+  const Entry &Current() const {
+    const Run &run = runs_[heap_.front()];
+    return run.entries[run.pos];
+  }
+  void Refill(std::size_t shard);
+  // orders heap_ so the shard with the smallest current key comes first
+  bool After(std::size_t a, std::size_t b) const;
+
+  const ShardedDict &dict_;
+  std::string end_;
+  std::vector<Run> runs_;
+  std::vector<std::size_t> heap_;
+};
+
+}
+
+#endif
@@ -0,0 +1,109 @@
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defines.h"
+#include "logger.h"
+#include "snapshot.h"
+#include "wal.h"
+
+bool kvdefs::for_each_snapshot_chunk(
+    int64_t index, const StorageView &view,
+    std::size_t chunk_keys,
+    const std::function<bool(const kvStore::SnapshotChunk &)> &fn) {
+  kvStore::SnapshotChunk chunk;
+  chunk.set_index(index);
+  chunk.set_first(true);
+
+  bool ok = true;
+  const int ret = view.Scan([&](const std::string &key,
+                                const Version &version) {
+    kvStore::RequestContent *ent = chunk.add_kvs();
+    ent->set_key(key);
+    ent->set_value(version.value);
+    ent->set_codec(version.codec);
+    ent->set_expire_at(version.expire_at);
+    if (static_cast<std::size_t>(chunk.kvs_size()) >= chunk_keys) {
+      ok = fn(chunk);
+      chunk.clear_kvs();
+      chunk.set_first(false);
+    }
+    return ok;
+  });
+  // a snapshot missing keys must not pass for the whole dict
+  if (!ok || ret) return false;
+
+  chunk.set_last(true);
+  return fn(chunk);
+}
+
+int kvdefs::save_snapshot(const std::string &path, int64_t index,
+                          const StorageView &view) {
+  const std::string tmp_path = path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    KV_LOG(ERROR) << "Failed creating snapshot " << tmp_path << ": "
+                  << strerror(errno);
+    return -1;
+  }
+
+  std::string buf, payload;
+  bool ok = for_each_snapshot_chunk(
+      index, view, kSnapshotChunkKeys,
+      [&](const kvStore::SnapshotChunk &chunk) {
+        chunk.SerializeToString(&payload);
+        buf.clear();
+        append_record(&buf, payload);
+        return write_fully(fd, buf.data(), buf.size()) == 0;
+      });
+  if (ok) ok = fdatasync(fd) == 0;
+  close(fd);
+
+  if (!ok || rename(tmp_path.c_str(), path.c_str())) {
+    KV_LOG(ERROR) << "Failed writing snapshot " << path << ": " << strerror(errno);
+    unlink(tmp_path.c_str());
+    return -1;
+  }
+  if (sync_parent_dir(path)) {
+    KV_LOG(ERROR) << "Failed syncing snapshot " << path << ": "
+                  << strerror(errno);
+    return -1;
+  }
+  return 0;
+}
+
+int kvdefs::load_snapshot(const std::string &path, int64_t *index,
+                          VersionMap *dict) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return errno == ENOENT ? 0 : -1;
+
+  std::string data;
+  int ret = read_fully(fd, &data);
+  close(fd);
+  if (ret) return -1;
+
+  VersionMap loaded;
+  int64_t loaded_index = 0;
+  bool complete = false;
+  parse_records(data, [&](const char *payload, std::size_t len) {
+    kvStore::SnapshotChunk chunk;
+    if (complete || !chunk.ParseFromArray(payload, len)) return false;
+    loaded_index = chunk.index();
+    for (const auto &kv : chunk.kvs())
+      loaded[kv.key()] = std::make_shared<const Version>(
+          kv.value(), chunk.index(), kv.codec(), kv.expire_at());
+    complete = chunk.last();
+    return true;
+  });
+
+  if (!complete) {
+    KV_LOG(ERROR) << "snapshot " << path << " is incomplete";
+    return -1;
+  }
+  *index = loaded_index;
+  dict->swap(loaded);
+  return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef KVSTORE_SNAPSHOT_H
+#define KVSTORE_SNAPSHOT_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "sharded_dict.h"
+#include "storage_engine.h"
+
+#include "kvstore.pb.h"
+
+namespace kvdefs {
+
+// Cuts view into chunks of at most chunk_keys pairs, in key order, tagged
+// with the log index it reflects. Values go out in the codec they are
+// stored in. Stops early once fn returns false; false too if view could
+// not be read whole.
+bool for_each_snapshot_chunk(
+    int64_t index, const StorageView &view,
+    std::size_t chunk_keys,
+    const std::function<bool(const kvStore::SnapshotChunk &)> &fn);
+
+// Snapshot files hold the same chunks, framed like wal records. They are
+// written to a temp file and renamed into place, so a reader only ever sees
+// a complete snapshot.
+int save_snapshot(const std::string &path, int64_t index,
+                  const StorageView &view);
+// a missing file is not an error, it leaves index at 0 and dict untouched;
+// loaded versions are tagged with the snapshot's index
+int load_snapshot(const std::string &path, int64_t *index, VersionMap *dict);
+
+}
+
+#endif
@@ -0,0 +1,423 @@
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "defines.h"
+#include "logger.h"
+#include "sstable.h"
+#include "wal.h"
+
+namespace {
+
+const uint64_t kTableMagic = 0x6b7673746232ULL;  // "kvstb2"
+const std::size_t kFooterLen = 6 * 8;
+// the crc32 following every block, the index and the bloom filter
+const std::size_t kCrcLen = 4;
+// per entry bookkeeping a decoded block costs on top of its keys and values
+const std::size_t kEntryOverhead = 64;
+
+void put_fixed32(std::string *dst, uint32_t v) {
+  for (int i = 0; i < 4; ++i) dst->push_back(static_cast<char>(v >> (8 * i)));
+}
+
+void put_fixed64(std::string *dst, uint64_t v) {
+  for (int i = 0; i < 8; ++i) dst->push_back(static_cast<char>(v >> (8 * i)));
+}
+
+void put_varint(std::string *dst, uint64_t v) {
+  while (v >= 0x80) {
+    dst->push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  dst->push_back(static_cast<char>(v));
+}
+
+void put_bytes(std::string *dst, const std::string &s) {
+  put_varint(dst, s.size());
+  dst->append(s);
+}
+
+uint32_t checksum(const char *data, std::size_t len) {
+  return ::crc32(0, reinterpret_cast<const Bytef *>(data), len);
+}
+
+// part followed by its crc32
+void put_checked(std::string *dst, const std::string &part) {
+  dst->append(part);
+  put_fixed32(dst, checksum(part.data(), part.size()));
+}
+
+// whether len bytes at off and their crc32 end by limit, without overflow
+bool fits(uint64_t off, uint64_t len, uint64_t limit) {
+  return off <= limit && kCrcLen <= limit - off &&
+         len <= limit - off - kCrcLen;
+}
+
+// whether the len bytes at p match the crc32 after them
+bool checked(const char *p, std::size_t len) {
+  uint32_t crc = 0;
+  for (std::size_t i = 0; i < kCrcLen; ++i)
+    crc |= static_cast<uint32_t>(static_cast<unsigned char>(p[len + i]))
+           << (8 * i);
+  return checksum(p, len) == crc;
+}
+
+// Decodes from [p, end); every getter leaves ok() false once the data runs
+// out instead of reading past it.
+class Reader {
+public:
+  Reader(const char *p, std::size_t len) : p_(p), end_(p + len), ok_(true) {}
+
+  bool ok() const { return ok_; }
+  bool done() const { return p_ == end_; }
+
+  uint64_t Fixed(int bytes) {
+    if (end_ - p_ < bytes) return Fail();
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; ++i)
+      v |= static_cast<uint64_t>(static_cast<unsigned char>(p_[i])) << (8 * i);
+    p_ += bytes;
+    return v;
+  }
+
+  uint64_t Varint() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64 && p_ < end_; shift += 7) {
+      unsigned char b = *p_++;
+      v |= static_cast<uint64_t>(b & 0x7f) << shift;
+      if (!(b & 0x80)) return v;
+    }
+    return Fail();
+  }
+
+  std::string Bytes() {
+    uint64_t len = Varint();
+    if (!ok_ || static_cast<uint64_t>(end_ - p_) < len) {
+      Fail();
+      return std::string();
+    }
+    std::string s(p_, len);
+    p_ += len;
+    return s;
+  }
+
+private:
+  uint64_t Fail() {
+    ok_ = false;
+    p_ = end_;
+    return 0;
+  }
+
+  const char *p_;
+  const char *end_;
+  bool ok_;
+};
+
+// bit positions by double hashing one 64-bit hash
+std::size_t bloom_bit(uint64_t hash, std::size_t probe, std::size_t bits) {
+  uint32_t h1 = static_cast<uint32_t>(hash);
+  uint32_t h2 = static_cast<uint32_t>(hash >> 32) | 1;
+  return (h1 + probe * h2) % bits;
+}
+
+}
+
+kvdefs::BlockCache::BlockCache(std::size_t capacity)
+    : capacity_(capacity), charge_(0), hits_(0), misses_(0) {}
+
+std::shared_ptr<const kvdefs::TableBlock> kvdefs::BlockCache::Lookup(
+    uint64_t table, uint64_t offset) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(Key(table, offset));
+  if (it == index_.end()) {
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+  hits_.fetch_add(1, std::memory_order_relaxed);
+  lru_.splice(lru_.begin(), lru_, it->second);
+  return it->second->second;
+}
+
+void kvdefs::BlockCache::Insert(
+    uint64_t table, uint64_t offset,
+    const std::shared_ptr<const TableBlock> &block) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const Key key(table, offset);
+  if (index_.count(key)) return;
+  lru_.emplace_front(key, block);
+  index_[key] = lru_.begin();
+  charge_ += block->charge;
+  while (charge_ > capacity_ && lru_.size() > 1) {
+    charge_ -= lru_.back().second->charge;
+    index_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+}
+
+std::size_t kvdefs::BlockCache::Charge() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return charge_;
+}
+
+kvdefs::TableBuilder::TableBuilder(const std::string &path)
+    : path_(path), entries_(0) {}
+
+void kvdefs::TableBuilder::Add(const std::string &key,
+                               const Version &version) {
+  if (!entries_) smallest_ = key;
+  put_bytes(&block_, key);
+  put_bytes(&block_, version.value);
+  put_fixed64(&block_, version.index);
+  put_varint(&block_, version.codec);
+  put_varint(&block_, version.expire_at);
+  block_.push_back(version.tombstone ? 1 : 0);
+  last_key_ = key;
+  hashes_.push_back(stable_hash(key));
+  ++entries_;
+  if (block_.size() >= kTableBlockBytes) FlushBlock();
+}
+
+void kvdefs::TableBuilder::FlushBlock() {
+  if (block_.empty()) return;
+  put_bytes(&index_, last_key_);
+  put_fixed64(&index_, data_.size());
+  put_fixed32(&index_, block_.size());
+  put_checked(&data_, block_);
+  block_.clear();
+}
+
+int kvdefs::TableBuilder::Finish() {
+  FlushBlock();
+
+  std::string index;
+  put_bytes(&index, smallest_);
+  index.append(index_);
+
+  const std::size_t bits =
+      std::max<std::size_t>(64, hashes_.size() * kBloomBitsPerKey);
+  // ln 2 * bits per key probes minimize the false positive rate
+  const std::size_t probes =
+      std::max<std::size_t>(1, kBloomBitsPerKey * 69 / 100);
+  std::string bloom((bits + 7) / 8, '\0');
+  for (uint64_t hash : hashes_) {
+    for (std::size_t i = 0; i < probes; ++i) {
+      std::size_t bit = bloom_bit(hash, i, bloom.size() * 8);
+      bloom[bit / 8] |= static_cast<char>(1 << (bit % 8));
+    }
+  }
+  bloom.push_back(static_cast<char>(probes));
+
+  std::string &file = data_;
+  const uint64_t index_off = file.size();
+  put_checked(&file, index);
+  const uint64_t bloom_off = file.size();
+  put_checked(&file, bloom);
+  put_fixed64(&file, index_off);
+  put_fixed64(&file, index.size());
+  put_fixed64(&file, bloom_off);
+  put_fixed64(&file, bloom.size());
+  put_fixed64(&file, entries_);
+  put_fixed64(&file, kTableMagic);
+
+  int fd = open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    KV_LOG(ERROR) << "Failed creating table " << path_ << ": "
+                  << strerror(errno);
+    return -1;
+  }
+  bool ok =
+      write_fully(fd, file.data(), file.size()) == 0 && fdatasync(fd) == 0;
+  close(fd);
+  if (!ok) {
+    KV_LOG(ERROR) << "Failed writing table " << path_ << ": "
+                  << strerror(errno);
+    unlink(path_.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+kvdefs::Table::Table(const std::string &path, uint64_t number,
+                     BlockCache *cache)
+    : path_(path), number_(number), cache_(cache), map_(nullptr), size_(0),
+      bloom_(nullptr), bloom_bytes_(0), entries_(0), obsolete_(false) {}
+
+kvdefs::Table::~Table() {
+  if (map_) munmap(const_cast<char *>(map_), size_);
+  if (obsolete_) unlink(path_.c_str());
+}
+
+std::shared_ptr<kvdefs::Table> kvdefs::Table::Open(const std::string &path,
+                                                   uint64_t number,
+                                                   BlockCache *cache) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    KV_LOG(ERROR) << "Failed opening table " << path << ": " << strerror(errno);
+    return nullptr;
+  }
+  struct stat st;
+  std::shared_ptr<Table> table(new Table(path, number, cache));
+  if (fstat(fd, &st) == 0 &&
+      static_cast<std::size_t>(st.st_size) > kFooterLen) {
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+      table->map_ = static_cast<const char *>(map);
+      table->size_ = st.st_size;
+    }
+  }
+  close(fd);
+  if (!table->map_) {
+    KV_LOG(ERROR) << "Failed mapping table " << path;
+    return nullptr;
+  }
+
+  const std::size_t size = table->size_;
+  Reader footer(table->map_ + size - kFooterLen, kFooterLen);
+  uint64_t index_off = footer.Fixed(8), index_size = footer.Fixed(8);
+  uint64_t bloom_off = footer.Fixed(8), bloom_size = footer.Fixed(8);
+  table->entries_ = footer.Fixed(8);
+  const std::size_t body = size - kFooterLen;
+  bool ok = footer.Fixed(8) == kTableMagic &&
+            fits(index_off, index_size, body) &&
+            fits(bloom_off, bloom_size, body) && bloom_size >= 1 &&
+            checked(table->map_ + index_off, index_size) &&
+            checked(table->map_ + bloom_off, bloom_size);
+
+  if (ok) {
+    Reader index(table->map_ + index_off, index_size);
+    table->smallest_ = index.Bytes();
+    while (index.ok() && !index.done()) {
+      BlockHandle block;
+      block.last_key = index.Bytes();
+      block.offset = index.Fixed(8);
+      block.size = index.Fixed(4);
+      if (!fits(block.offset, block.size, index_off)) ok = false;
+      table->blocks_.push_back(std::move(block));
+    }
+    ok = ok && index.ok() && !table->blocks_.empty();
+    table->bloom_ = table->map_ + bloom_off;
+    table->bloom_bytes_ = bloom_size;
+  }
+  if (!ok) {
+    KV_LOG(ERROR) << "Corrupt table " << path;
+    return nullptr;
+  }
+  return table;
+}
+
+bool kvdefs::Table::MayContain(const std::string &key) const {
+  const std::size_t bits = (bloom_bytes_ - 1) * 8;
+  const std::size_t probes =
+      static_cast<unsigned char>(bloom_[bloom_bytes_ - 1]);
+  if (!bits) return true;
+  const uint64_t hash = stable_hash(key);
+  for (std::size_t i = 0; i < probes; ++i) {
+    std::size_t bit = bloom_bit(hash, i, bits);
+    if (!(bloom_[bit / 8] & (1 << (bit % 8)))) return false;
+  }
+  return true;
+}
+
+std::shared_ptr<const kvdefs::TableBlock> kvdefs::Table::ReadBlock(
+    std::size_t block, bool fill_cache) const {
+  const BlockHandle &handle = blocks_[block];
+  std::shared_ptr<const TableBlock> cached =
+      cache_->Lookup(number_, handle.offset);
+  if (cached) return cached;
+
+  std::shared_ptr<TableBlock> decoded = std::make_shared<TableBlock>();
+  decoded->charge = handle.size;
+  const bool intact = checked(map_ + handle.offset, handle.size);
+  Reader in(map_ + handle.offset, handle.size);
+  while (intact && in.ok() && !in.done()) {
+    std::string key = in.Bytes();
+    std::string value = in.Bytes();
+    int64_t index = in.Fixed(8);
+    int codec = in.Varint();
+    int64_t expire_at = in.Varint();
+    bool tombstone = in.Fixed(1) != 0;
+    if (!in.ok()) break;
+    decoded->charge += key.size() + value.size() + kEntryOverhead;
+    decoded->entries.emplace_back(
+        std::move(key),
+        std::make_shared<const Version>(value, index, codec, expire_at,
+                                        tombstone));
+  }
+  if (!intact || !in.ok()) {
+    // tables are synced before the manifest names them, so this is disk
+    // corruption. Serving what decoded would let older versions from
+    // deeper levels show through, and a compaction would make that stick.
+    KV_LOG(ERROR) << "Corrupt block at " << handle.offset << " in " << path_;
+    return nullptr;
+  }
+  if (fill_cache) cache_->Insert(number_, handle.offset, decoded);
+  return decoded;
+}
+
+int kvdefs::Table::Get(const std::string &key,
+                       std::shared_ptr<const Version> *version) const {
+  version->reset();
+  if (key < smallest_ || key > largest() || !MayContain(key)) return 0;
+  auto block = std::lower_bound(
+      blocks_.begin(), blocks_.end(), key,
+      [](const BlockHandle &b, const std::string &k) {
+        return b.last_key < k;
+      });
+  if (block == blocks_.end()) return 0;
+
+  std::shared_ptr<const TableBlock> data =
+      ReadBlock(block - blocks_.begin(), true);
+  if (!data) return -1;
+  auto it = std::lower_bound(
+      data->entries.begin(), data->entries.end(), key,
+      [](const TableEntry &e, const std::string &k) { return e.first < k; });
+  if (it != data->entries.end() && it->first == key) *version = it->second;
+  return 0;
+}
+
+kvdefs::Table::Iterator::Iterator(std::shared_ptr<const Table> table,
+                                  bool fill_cache)
+    : table_(std::move(table)), fill_cache_(fill_cache),
+      block_(table_->blocks_.size()), pos_(0), corrupt_(false) {}
+
+void kvdefs::Table::Iterator::Load(std::size_t block) {
+  for (block_ = block; Valid(); ++block_) {
+    data_ = table_->ReadBlock(block_, fill_cache_);
+    pos_ = 0;
+    if (!data_) {
+      corrupt_ = true;
+      block_ = table_->blocks_.size();
+      return;
+    }
+    if (!data_->entries.empty()) return;
+  }
+  data_.reset();
+}
+
+void kvdefs::Table::Iterator::Seek(const std::string &key) {
+  const std::vector<BlockHandle> &blocks = table_->blocks_;
+  auto block = std::lower_bound(
+      blocks.begin(), blocks.end(), key,
+      [](const BlockHandle &b, const std::string &k) {
+        return b.last_key < k;
+      });
+  Load(block - blocks.begin());
+  if (!Valid()) return;
+  auto it = std::lower_bound(
+      data_->entries.begin(), data_->entries.end(), key,
+      [](const TableEntry &e, const std::string &k) { return e.first < k; });
+  pos_ = it - data_->entries.begin();
+  if (pos_ == data_->entries.size()) Load(block_ + 1);
+}
+
+void kvdefs::Table::Iterator::Next() {
+  if (++pos_ == data_->entries.size()) Load(block_ + 1);
+}
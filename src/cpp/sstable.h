@@ -0,0 +1,172 @@
+#ifndef KVSTORE_SSTABLE_H
+#define KVSTORE_SSTABLE_H
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "sharded_dict.h"
+
+namespace kvdefs {
+
+// a key and the version a table holds for it, tombstones included
+typedef std::pair<std::string, std::shared_ptr<const Version>> TableEntry;
+
+struct TableBlock {
+  std::vector<TableEntry> entries;  // in key order
+  std::size_t charge;               // bytes it costs the block cache
+};
+
+// LRU cache of decoded data blocks shared by the tables of one engine,
+// bounded by the bytes the blocks decode to.
+class BlockCache {
+public:
+  explicit BlockCache(std::size_t capacity);
+
+  // null on a miss
+  std::shared_ptr<const TableBlock> Lookup(uint64_t table, uint64_t offset);
+  void Insert(uint64_t table, uint64_t offset,
+              const std::shared_ptr<const TableBlock> &block);
+
+  int64_t Hits() const { return hits_.load(std::memory_order_relaxed); }
+  int64_t Misses() const { return misses_.load(std::memory_order_relaxed); }
+  std::size_t Charge() const;
+
+private:
+  typedef std::pair<uint64_t, uint64_t> Key;
+  typedef std::list<std::pair<Key, std::shared_ptr<const TableBlock>>>
+      LruList;
+
+  mutable std::mutex mutex_;
+  std::size_t capacity_;
+  std::size_t charge_;
+  LruList lru_;  // most recently used first
+  std::map<Key, LruList::iterator> index_;
+  std::atomic<int64_t> hits_;
+  std::atomic<int64_t> misses_;
+};
+
+// Writes an immutable sorted table file.
+//
+// Layout: data blocks of about kTableBlockBytes, each a run of
+// [varint key len][key][varint value len][value][u64 index][varint codec]
+// [varint expire_at][u8 tombstone] entries; an index block of [varint len]
+// [smallest key] followed by [varint len][last key][u64 offset][u32 size]
+// per data block; a bloom filter over the keys; and a footer of six u64s:
+// index offset and size, bloom offset and size, entry count and kTableMagic.
+// Every data block, the index and the bloom filter are followed by a u32
+// crc32 of their bytes, which the sizes do not count. Integers are little
+// endian.
+class TableBuilder {
+public:
+  explicit TableBuilder(const std::string &path);
+
+  // keys must come in increasing order
+  void Add(const std::string &key, const Version &version);
+  // write and sync the file, 0 on success
+  int Finish();
+
+  std::size_t Entries() const { return entries_; }
+  // the size of the file so far
+  std::size_t Bytes() const { return data_.size() + block_.size(); }
+
+private:
+  void FlushBlock();
+
+  std::string path_;
+  std::string data_;   // data blocks written so far
+  std::string block_;  // the data block being filled
+  std::string index_;  // index entries of the blocks in data_
+  std::string smallest_;
+  std::string last_key_;
+  std::vector<uint64_t> hashes_;  // of every key, for the bloom filter
+  std::size_t entries_;
+};
+
+// An immutable sorted table read through a memory map, with its block
+// index kept decoded. Blocks are decoded on demand through the cache.
+class Table {
+public:
+  class Iterator;
+
+  // null if the file is missing or corrupt
+  static std::shared_ptr<Table> Open(const std::string &path,
+                                     uint64_t number, BlockCache *cache);
+  // unmaps the file, and unlinks it once MarkObsolete was called
+  ~Table();
+
+  uint64_t number() const { return number_; }
+  const std::string &smallest() const { return smallest_; }
+  const std::string &largest() const { return blocks_.back().last_key; }
+  std::size_t entries() const { return entries_; }
+  std::size_t file_size() const { return size_; }
+
+  // the version held for key, tombstones included, null if none; a bloom
+  // filter miss answers without touching the data blocks. -1 if the block
+  // that would hold key is corrupt, 0 otherwise
+  int Get(const std::string &key,
+          std::shared_ptr<const Version> *version) const;
+  // a compaction replaced the table, delete its file once the last reader
+  // lets go of it
+  void MarkObsolete() { obsolete_ = true; }
+
+private:
+  struct BlockHandle {
+    std::string last_key;
+    uint64_t offset;
+    uint32_t size;
+  };
+
+  Table(const std::string &path, uint64_t number, BlockCache *cache);
+  bool MayContain(const std::string &key) const;
+  // null if the block is corrupt
+  std::shared_ptr<const TableBlock> ReadBlock(std::size_t block,
+                                              bool fill_cache) const;
+
+  std::string path_;
+  uint64_t number_;
+  BlockCache *cache_;
+  const char *map_;
+  std::size_t size_;
+  std::string smallest_;
+  std::vector<BlockHandle> blocks_;
+  const char *bloom_;
+  std::size_t bloom_bytes_;
+  std::size_t entries_;
+  std::atomic<bool> obsolete_;
+};
+
+// Walks a table's entries in key order, from where Seek put it. Bulk
+// passes give fill_cache false so they do not evict the blocks reads use.
+// A corrupt block ends the walk with corrupt() set.
+class Table::Iterator {
+public:
+  Iterator(std::shared_ptr<const Table> table, bool fill_cache);
+
+  // to the first entry at or after key
+  void Seek(const std::string &key);
+  bool Valid() const { return block_ < table_->blocks_.size(); }
+  bool corrupt() const { return corrupt_; }
+  const TableEntry &entry() const { return data_->entries[pos_]; }
+  void Next();
+
+private:
+  void Load(std::size_t block);
+
+  std::shared_ptr<const Table> table_;
+  bool fill_cache_;
+  std::size_t block_;
+  std::shared_ptr<const TableBlock> data_;
+  std::size_t pos_;
+  bool corrupt_;
+};
+
+}
+
+#endif
@@ -0,0 +1,212 @@
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "defines.h"
+#include "sstable.h"
+#include "test_util.h"
+
+namespace {
+
+using kvdefs::BlockCache;
+using kvdefs::Table;
+using kvdefs::TableBuilder;
+using kvdefs::TableEntry;
+using kvdefs::Version;
+
+const int kKeys = 2000;
+
+std::string key(int i) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "key%06d", i);
+  return buf;
+}
+
+// every other key from 0 to 2 * kKeys, with versions telling them apart;
+// every tenth one a tombstone
+int build(const std::string &path) {
+  TableBuilder builder(path);
+  for (int i = 0; i < kKeys; ++i) {
+    const int k = 2 * i;
+    builder.Add(key(k), Version(k % 10 ? "value" + std::to_string(k) : "",
+                                k + 1, k % 3, k % 5 ? 0 : 1000 + k,
+                                k % 10 == 0));
+  }
+  return builder.Finish();
+}
+
+bool matches(const TableEntry &entry, int k) {
+  const Version &v = *entry.second;
+  return entry.first == key(k) && v.index == k + 1 && v.codec == k % 3 &&
+         v.expire_at == (k % 5 ? 0 : 1000 + k) &&
+         v.tombstone == (k % 10 == 0) &&
+         v.value == (k % 10 ? "value" + std::to_string(k) : "");
+}
+
+void TestRoundTrip() {
+  kvdefs::TestDir dir;
+  KV_CHECK(dir.ok());
+  const std::string path = dir.File("000001.sst");
+  KV_CHECK(build(path) == 0);
+
+  BlockCache cache(kvdefs::kBlockCacheBytes);
+  std::shared_ptr<Table> table = Table::Open(path, 1, &cache);
+  KV_CHECK(table != nullptr);
+  if (!table) return;
+  KV_CHECK(table->number() == 1);
+  KV_CHECK(table->entries() == std::size_t(kKeys));
+  KV_CHECK(table->smallest() == key(0));
+  KV_CHECK(table->largest() == key(2 * (kKeys - 1)));
+  KV_CHECK(table->file_size() == kvdefs::read_file(path).size());
+
+  for (int k = 0; k < 2 * kKeys; ++k) {
+    std::shared_ptr<const Version> version;
+    KV_CHECK(table->Get(key(k), &version) == 0);
+    if (k % 2) {
+      KV_CHECK(!version);
+    } else {
+      KV_CHECK(version && matches(TableEntry(key(k), version), k));
+    }
+  }
+
+  // every entry in order, across every block
+  int k = 0;
+  Table::Iterator it(table, false);
+  for (it.Seek(""); it.Valid(); it.Next(), k += 2)
+    KV_CHECK(matches(it.entry(), k));
+  KV_CHECK(k == 2 * kKeys && !it.corrupt());
+
+  // a seek between keys lands on the next one, past the last one ends
+  it.Seek(key(101));
+  KV_CHECK(it.Valid() && it.entry().first == key(102));
+  it.Seek(key(2 * kKeys));
+  KV_CHECK(!it.Valid() && !it.corrupt());
+}
+
+void TestBloomAndCache() {
+  kvdefs::TestDir dir;
+  KV_CHECK(dir.ok());
+  const std::string path = dir.File("000001.sst");
+  KV_CHECK(build(path) == 0);
+
+  BlockCache cache(kvdefs::kBlockCacheBytes);
+  std::shared_ptr<Table> table = Table::Open(path, 1, &cache);
+  KV_CHECK(table != nullptr);
+  if (!table) return;
+
+  // absent keys inside the table's range: the bloom filter answers almost
+  // all of them without looking a block up
+  for (int k = 1; k < 2 * kKeys; k += 2) {
+    std::shared_ptr<const Version> version;
+    table->Get(key(k), &version);
+  }
+  KV_CHECK(cache.Hits() + cache.Misses() < kKeys / 20);
+
+  // a read misses once, then finds its block in the cache
+  BlockCache fresh(kvdefs::kBlockCacheBytes);
+  table = Table::Open(path, 1, &fresh);
+  KV_CHECK(table != nullptr);
+  if (!table) return;
+  std::shared_ptr<const Version> version;
+  table->Get(key(1000), &version);
+  KV_CHECK(fresh.Misses() == 1 && fresh.Hits() == 0);
+  table->Get(key(1002), &version);
+  KV_CHECK(fresh.Misses() == 1 && fresh.Hits() == 1);
+
+  // bulk passes leave the cache alone
+  const std::size_t charge = fresh.Charge();
+  KV_CHECK(charge > 0);
+  Table::Iterator it(table, false);
+  for (it.Seek(""); it.Valid(); it.Next()) {
+  }
+  KV_CHECK(fresh.Charge() == charge);
+
+  // a cache a quarter the size of the table's blocks stays within that
+  Table::Iterator filling(table, true);
+  for (filling.Seek(""); filling.Valid(); filling.Next()) {
+  }
+  const std::size_t full = fresh.Charge();
+  BlockCache small(full / 4);
+  std::shared_ptr<Table> other = Table::Open(path, 2, &small);
+  KV_CHECK(other != nullptr);
+  if (!other) return;
+  Table::Iterator walk(other, true);
+  for (walk.Seek(""); walk.Valid(); walk.Next()) {
+  }
+  KV_CHECK(small.Charge() > 0 && small.Charge() <= full / 4);
+}
+
+void TestCorruption() {
+  kvdefs::TestDir dir;
+  KV_CHECK(dir.ok());
+  const std::string path = dir.File("000001.sst");
+  KV_CHECK(build(path) == 0);
+  const std::string good = kvdefs::read_file(path);
+  BlockCache cache(kvdefs::kBlockCacheBytes);
+
+  // a bad magic, a truncated file and an empty one are refused on open
+  std::string data = good;
+  data[data.size() - 1] ^= 0x01;
+  kvdefs::write_file(path, data);
+  KV_CHECK(!Table::Open(path, 1, &cache));
+  kvdefs::write_file(path, good.substr(0, good.size() - 3));
+  KV_CHECK(!Table::Open(path, 1, &cache));
+  kvdefs::write_file(path, "");
+  KV_CHECK(!Table::Open(path, 1, &cache));
+  KV_CHECK(!Table::Open(dir.File("missing.sst"), 1, &cache));
+
+  // a first key claiming to run past its block fails that block only
+  data = good;
+  data.replace(0, 5, "\xff\xff\xff\xff\x0f", 5);
+  kvdefs::write_file(path, data);
+  std::shared_ptr<Table> table = Table::Open(path, 1, &cache);
+  KV_CHECK(table != nullptr);
+  if (!table) return;
+  std::shared_ptr<const Version> version;
+  KV_CHECK(table->Get(key(0), &version) == -1 && !version);
+  KV_CHECK(table->Get(key(2 * (kKeys - 1)), &version) == 0 && version);
+
+  // and a walk over it stops there rather than skip its keys
+  Table::Iterator it(table, true);
+  it.Seek("");
+  KV_CHECK(!it.Valid() && it.corrupt());
+  Table::Iterator last(table, true);
+  last.Seek(key(2 * (kKeys - 1)));
+  KV_CHECK(last.Valid() && !last.corrupt());
+
+  // a flipped byte inside a value still decodes, the block's crc catches it
+  data = good;
+  const std::size_t at = good.find("value1002");
+  KV_CHECK(at != std::string::npos);
+  data[at + 5] ^= 0x01;
+  kvdefs::write_file(path, data);
+  BlockCache fresh(kvdefs::kBlockCacheBytes);
+  table = Table::Open(path, 1, &fresh);
+  KV_CHECK(table != nullptr);
+  if (!table) return;
+  KV_CHECK(table->Get(key(1002), &version) == -1 && !version);
+  KV_CHECK(table->Get(key(0), &version) == 0 && version);
+
+  // as do the index and the bloom filter's, on open
+  const std::size_t footer = good.size() - 6 * 8;
+  data = good;
+  data[footer - 4 - 1] ^= 0x01;
+  kvdefs::write_file(path, data);
+  KV_CHECK(!Table::Open(path, 1, &fresh));
+  data = good;
+  const std::size_t index_off = good.find(key(0), good.find("value3998"));
+  KV_CHECK(index_off != std::string::npos);
+  data[index_off] ^= 0x01;
+  kvdefs::write_file(path, data);
+  KV_CHECK(!Table::Open(path, 1, &fresh));
+}
+
+}
+
+int main() {
+  TestRoundTrip();
+  TestBloomAndCache();
+  TestCorruption();
+  return kvdefs::test_failures() ? 1 : 0;
+}
@@ -0,0 +1,75 @@
+#include "logger.h"
+#include "snapshot.h"
+#include "storage_engine.h"
+
+int kvdefs::parse_storage_engine(const std::string &name) {
+  if (name == "map") return ENGINE_MAP;
+  if (name == "lsm") return ENGINE_LSM;
+  return -1;
+}
+
+kvdefs::MapEngine::MapEngine(const std::string &path, std::size_t shard_bits)
+    : path_(path), dict_(shard_bits), checkpoint_index_(0) {}
+
+int kvdefs::MapEngine::Open(int64_t *index) {
+  *index = 0;
+  if (path_.empty()) return 0;
+  VersionMap state;
+  if (load_snapshot(path_, index, &state)) {
+    KV_LOG(ERROR) << "Failed loading snapshot " << path_;
+    return -1;
+  }
+  dict_.Assign(std::move(state));
+  return 0;
+}
+
+std::shared_ptr<const kvdefs::Version>
+kvdefs::MapEngine::GetVersion(const std::string &key) const {
+  return dict_.GetVersion(key);
+}
+
+void kvdefs::MapEngine::Put(const std::string &key, const std::string &value,
+                            int64_t index, int codec, int64_t expire_at) {
+  dict_.Put(key, value, index, codec, expire_at);
+}
+
+bool kvdefs::MapEngine::Erase(const std::string &key, int64_t index) {
+  return dict_.Erase(key);
+}
+
+std::size_t kvdefs::MapEngine::Size() const { return dict_.Size(); }
+
+int kvdefs::MapEngine::Scan(const std::string &start, const std::string &end,
+                            std::size_t limit, const ScanFn &fn) const {
+  dict_.Scan(start, end, limit, fn);
+  return 0;
+}
+
+// Nothing is copied at the cut: FinishCheckpoint streams the dict out a
+// shard run at a time, so writers only ever wait for one run of their
+// shard. A key written after the cut is saved with its newer version, the
+// log after the cut writes it again on recovery and leaves it the same.
+void kvdefs::MapEngine::BeginCheckpoint(int64_t index) {
+  checkpoint_index_ = index;
+}
+
+int kvdefs::MapEngine::FinishCheckpoint() {
+  if (path_.empty()) return 0;
+  if (save_snapshot(path_, checkpoint_index_, LiveDictView(*this))) {
+    KV_LOG(ERROR) << "Failed saving snapshot at " << checkpoint_index_;
+    return -1;
+  }
+  return 0;
+}
+
+// the last snapshot file stays until the next checkpoint replaces it, a
+// restart in between finds a complete older state
+void kvdefs::MapEngine::Clear() { dict_.Assign(VersionMap()); }
+
+void kvdefs::MapEngine::SetLockWaitHistogram(Histogram *histogram) {
+  dict_.SetLockWaitHistogram(histogram);
+}
+
+int kvdefs::LiveDictView::Scan(const ShardedDict::ScanFn &fn) const {
+  return engine_.Scan("", "", 0, fn);
+}
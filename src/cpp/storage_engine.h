@@ -0,0 +1,126 @@
+#ifndef KVSTORE_STORAGE_ENGINE_H
+#define KVSTORE_STORAGE_ENGINE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "sharded_dict.h"
+
+namespace kvdefs {
+
+enum STORAGE_ENGINE {
+  ENGINE_MAP = 900,  // everything in memory, snapshot files for recovery
+  ENGINE_LSM         // memtable over sorted files, for data beyond RAM
+};
+
+// "map" or "lsm", -1 for anything else
+int parse_storage_engine(const std::string &name);
+
+// An engine's content as a snapshot streams it out, see LiveDictView.
+class StorageView {
+public:
+  virtual ~StorageView() {}
+  // feeds fn every key in order until fn returns false; -1 if the keys
+  // could not all be read, 0 otherwise
+  virtual int Scan(const ShardedDict::ScanFn &fn) const = 0;
+};
+
+// Where a datanode keeps its dict. Writes come in log order from a single
+// thread at a time, the datanode's log_mutex_ holder; reads may run
+// concurrently with them and with each other.
+class StorageEngine {
+public:
+  typedef ShardedDict::ScanFn ScanFn;
+
+  virtual ~StorageEngine() {}
+
+  // Load what the last Checkpoint persisted, *index is the log index it
+  // reflects (0 for nothing). 0 on success.
+  virtual int Open(int64_t *index) = 0;
+
+  // null for a missing key, never a tombstone; also null for a key that
+  // could not be read, which only Get tells apart
+  virtual std::shared_ptr<const Version> GetVersion(
+      const std::string &key) const = 0;
+  // like GetVersion, -1 if the key could not be read, 0 otherwise
+  virtual int Get(const std::string &key,
+                  std::shared_ptr<const Version> *version) const {
+    *version = GetVersion(key);
+    return 0;
+  }
+  virtual void Put(const std::string &key, const std::string &value,
+                   int64_t index, int codec, int64_t expire_at) = 0;
+  // false if key was missing
+  virtual bool Erase(const std::string &key, int64_t index) = 0;
+  // the number of keys, an estimate where counting them is not cheap
+  virtual std::size_t Size() const = 0;
+  // like ShardedDict::Scan, live keys only; -1 if the range could not all
+  // be read, 0 otherwise
+  virtual int Scan(const std::string &start, const std::string &end,
+                   std::size_t limit, const ScanFn &fn) const = 0;
+
+  // Persist everything written so far as the state at log index, so
+  // recovery only has to replay the log after it. BeginCheckpoint takes the
+  // cut and is cheap enough to call with writers held off; FinishCheckpoint
+  // does the slow part and may run alongside further writes. What it
+  // persists may include some of those: replaying the log after index on
+  // top of them ends in the same state. One checkpoint at a time. 0 on
+  // success.
+  virtual void BeginCheckpoint(int64_t index) = 0;
+  virtual int FinishCheckpoint() = 0;
+  int Checkpoint(int64_t index) {
+    BeginCheckpoint(index);
+    return FinishCheckpoint();
+  }
+  // drop every key, ahead of installing a snapshot
+  virtual void Clear() = 0;
+
+  // see ShardedDict::SetLockWaitHistogram
+  virtual void SetLockWaitHistogram(Histogram *histogram) {}
+};
+
+// The whole dict in a ShardedDict. Checkpoints write it out as a snapshot
+// file at path, an empty path keeps it in memory only.
+class MapEngine : public StorageEngine {
+public:
+  MapEngine(const std::string &path, std::size_t shard_bits);
+
+  int Open(int64_t *index) override;
+  std::shared_ptr<const Version> GetVersion(
+      const std::string &key) const override;
+  void Put(const std::string &key, const std::string &value, int64_t index,
+           int codec, int64_t expire_at) override;
+  bool Erase(const std::string &key, int64_t index) override;
+  std::size_t Size() const override;
+  int Scan(const std::string &start, const std::string &end,
+           std::size_t limit, const ScanFn &fn) const override;
+  void BeginCheckpoint(int64_t index) override;
+  int FinishCheckpoint() override;
+  void Clear() override;
+  void SetLockWaitHistogram(Histogram *histogram) override;
+
+private:
+  std::string path_;
+  ShardedDict dict_;
+  // the log index BeginCheckpoint was called with
+  int64_t checkpoint_index_;
+};
+
+// An engine as it is while the scan passes by: each key shows its latest
+// version, which is its version when the view was taken or a later one.
+// Nothing is copied, so it is cheap to take with writers held off; what it
+// streams is only a cut at an index if replaying the log after that index
+// on top of it ends in the same state, as it does for the datanode's log.
+class LiveDictView : public StorageView {
+public:
+  explicit LiveDictView(const StorageEngine &engine) : engine_(engine) {}
+  int Scan(const ShardedDict::ScanFn &fn) const override;
+
+private:
+  const StorageEngine &engine_;
+};
+
+}
+
+#endif
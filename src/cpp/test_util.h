@@ -0,0 +1,80 @@
+#ifndef KVSTORE_TEST_UTIL_H
+#define KVSTORE_TEST_UTIL_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <ftw.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// Bare checks for the unit tests ctest runs. A failed KV_CHECK reports
+// itself and the test carries on; main returns test_failures() so the
+// binary exits nonzero.
+#define KV_CHECK(cond)                                                  \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,       \
+                   __LINE__, #cond);                                    \
+      ++kvdefs::test_failures();                                        \
+    }                                                                   \
+  } while (0)
+
+namespace kvdefs {
+
+inline int &test_failures() {
+  static int failures = 0;
+  return failures;
+}
+
+inline std::string read_file(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  std::ostringstream data;
+  data << in.rdbuf();
+  return data.str();
+}
+
+inline void write_file(const std::string &path, const std::string &data) {
+  std::ofstream(path, std::ios::binary | std::ios::trunc) << data;
+}
+
+inline bool file_exists(const std::string &path) {
+  return access(path.c_str(), F_OK) == 0;
+}
+
+// A fresh directory under $TMPDIR, removed with everything in it once the
+// test is done.
+class TestDir {
+public:
+  TestDir() {
+    const char *tmp = std::getenv("TMPDIR");
+    std::string pattern = std::string(tmp ? tmp : "/tmp") + "/kvtest.XXXXXX";
+    if (mkdtemp(&pattern[0])) path_ = pattern;
+  }
+  ~TestDir() {
+    if (!path_.empty())
+      nftw(path_.c_str(),
+           [](const char *path, const struct stat *, int, struct FTW *) {
+             return remove(path);
+           },
+           16, FTW_DEPTH | FTW_PHYS);
+  }
+
+  bool ok() const { return !path_.empty(); }
+  const std::string &path() const { return path_; }
+  std::string File(const std::string &name) const {
+    return path_ + "/" + name;
+  }
+
+private:
+  TestDir(const TestDir &) = delete;
+  TestDir &operator=(const TestDir &) = delete;
+  std::string path_;
+};
+
+}
+
+#endif
@@ -0,0 +1,79 @@
+#include <algorithm>
+
+#include "timing_wheel.h"
+
+kvdefs::TimingWheel::TimingWheel(int64_t tick_ms, int64_t now_ms)
+    : tick_ms_(tick_ms), tick_(now_ms / tick_ms),
+      levels_(kLevels, std::vector<Slot>(kSlots)) {}
+
+void kvdefs::TimingWheel::Add(const std::string &key, int64_t deadline_ms) {
+  // rounded up, a key never fires before its deadline
+  const int64_t tick = (deadline_ms + tick_ms_ - 1) / tick_ms_;
+  std::pair<Entries::iterator, bool> added = entries_.emplace(key, Entry());
+  Node *node = &*added.first;
+  if (!added.second) {
+    if (node->second.tick == tick) return;
+    Unlink(node);
+  }
+  node->second.tick = tick;
+  Place(node);
+}
+
+void kvdefs::TimingWheel::Place(Node *node) {
+  // already due, it fires on the next tick
+  const int64_t tick = std::max(node->second.tick, tick_ + 1);
+  const int64_t delta = tick - tick_;
+  int level = 0;
+  while (level + 1 < kLevels && delta >> (kSlotBits * (level + 1))) ++level;
+  // past the top level it waits in the farthest slot and is placed again
+  // once that comes up
+  const int64_t span = static_cast<int64_t>(1) << (kSlotBits * kLevels);
+  const int64_t at = delta < span ? tick : tick_ + span - 1;
+  Entry &entry = node->second;
+  entry.level = level;
+  entry.slot = static_cast<int>((at >> (kSlotBits * level)) & (kSlots - 1));
+  Slot &slot = levels_[level][entry.slot];
+  entry.pos = slot.size();
+  slot.push_back(node);
+}
+
+void kvdefs::TimingWheel::Unlink(Node *node) {
+  const Entry &entry = node->second;
+  Slot &slot = levels_[entry.level][entry.slot];
+  // the last one of the slot takes its place
+  Node *last = slot.back();
+  slot[entry.pos] = last;
+  last->second.pos = entry.pos;
+  slot.pop_back();
+}
+
+void kvdefs::TimingWheel::Advance(int64_t now_ms,
+                                  std::vector<std::string> *due) {
+  const int64_t target = now_ms / tick_ms_;
+  while (tick_ < target) {
+    ++tick_;
+    // top down, so entries cascading from a level can go on cascading
+    // through the ones below it within the same tick
+    for (int level = kLevels - 1; level >= 0; --level) {
+      const int shift = kSlotBits * level;
+      if (tick_ & ((static_cast<int64_t>(1) << shift) - 1)) continue;
+      Slot slot;
+      slot.swap(levels_[level][(tick_ >> shift) & (kSlots - 1)]);
+      for (Node *node : slot) {
+        if (node->second.tick <= tick_) {
+          due->push_back(node->first);
+          entries_.erase(due->back());
+        } else {
+          Place(node);
+        }
+      }
+    }
+  }
+}
+
+void kvdefs::TimingWheel::Clear(int64_t now_ms) {
+  for (auto &level : levels_)
+    for (auto &slot : level) Slot().swap(slot);
+  entries_.clear();
+  tick_ = now_ms / tick_ms_;
+}
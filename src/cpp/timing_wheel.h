@@ -0,0 +1,73 @@
+#ifndef KVSTORE_TIMING_WHEEL_H
+#define KVSTORE_TIMING_WHEEL_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace kvdefs {
+
+// Hierarchical timing wheel of key deadlines in milliseconds.
+//
+// Time advances in ticks of tick_ms. Level l has kSlots slots of
+// kSlots^l ticks each, so level 0 resolves single ticks and the kLevels
+// levels together cover kSlots^kLevels ticks ahead; later deadlines wait
+// in the top level and are placed again when their slot comes up. An entry
+// in level l moves down a level whenever the lower levels wrap around, so
+// Add is O(1) and every entry is touched at most kLevels times before it
+// fires.
+//
+// Each key has one entry, for the deadline it was last added with: adding
+// it again moves the entry, so the wheel holds as many entries as keys
+// however often they are written. The entry stays until it fires, and
+// whoever gets the fired keys checks whether they really expired.
+//
+// Not thread safe, the datanode guards it with its expiry_mutex_.
+class TimingWheel {
+public:
+  TimingWheel(int64_t tick_ms, int64_t now_ms);
+
+  // track key until deadline_ms, in place of any deadline it had
+  void Add(const std::string &key, int64_t deadline_ms);
+  bool Tracked(const std::string &key) const {
+    return entries_.count(key) != 0;
+  }
+  // move time to now_ms and append every key whose deadline is at or
+  // before it to due
+  void Advance(int64_t now_ms, std::vector<std::string> *due);
+  // drop every entry and restart at now_ms
+  void Clear(int64_t now_ms);
+
+  std::size_t size() const { return entries_.size(); }
+
+private:
+  static const int kSlotBits = 8;
+  static const int64_t kSlots = 1 << kSlotBits;
+  static const int kLevels = 4;
+
+  struct Entry {
+    int64_t tick;  // the deadline
+    int level;     // where it is placed
+    int slot;
+    std::size_t pos;
+  };
+  typedef std::unordered_map<std::string, Entry> Entries;
+  typedef Entries::value_type Node;
+  // map nodes stay put through rehashes, so slots point at them
+  typedef std::vector<Node *> Slot;
+
+  // place node in the slot its tick falls in, relative to tick_
+  void Place(Node *node);
+  // take node out of its slot
+  void Unlink(Node *node);
+
+  int64_t tick_ms_;
+  int64_t tick_;  // the last tick Advance went through
+  std::vector<std::vector<Slot>> levels_;
+  Entries entries_;
+};
+
+}
+
+#endif
@@ -1,24 +1,78 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
 #include <string>
 #include "defines.h"
 
-int kvdefs::del_znode_recursive(zhandle_t* zh, const char* path) {
-  String_vector children;
-  if (zoo_get_children(zh, path, 0, &children) == ZOK) {
-    for (int i = 0; i < children.count; ++i) {
-      std::string child_path(path);
-      child_path += "/";
-      child_path += children.data[i];
-
-      int ret = kvdefs::del_znode_recursive(zh, child_path.c_str());
-      if(ret != ZOK) return ret;
-    }
-  }
-  return zoo_delete(zh, path, -1);
-}
-
 std::string kvdefs::extract_data_node(const char* buf) {
   std::string sbuf(buf);
   std::size_t pos = sbuf.find("_backup");
   if(pos == std::string::npos) return sbuf;
   return sbuf.substr(0, pos);
-}
\ No newline at end of file
+}
+
+std::string kvdefs::make_node_data(const std::string& addr, int64_t weight) {
+  return addr + "|" + std::to_string(weight);
+}
+
+void kvdefs::parse_node_data(const char* buf, std::string* addr,
+                             int64_t* weight) {
+  std::string sbuf(buf);
+  std::size_t pos = sbuf.find('|');
+  *addr = sbuf.substr(0, pos);
+  *weight = 1;
+  if (pos != std::string::npos)
+    *weight = std::max<int64_t>(std::atoll(sbuf.c_str() + pos + 1), 1);
+}
+
+std::string kvdefs::prefix_end(const std::string& prefix) {
+  std::string end(prefix);
+  while (end.size()) {
+    unsigned char last = end.back();
+    end.pop_back();
+    if (last != 0xFF) {
+      end.push_back(static_cast<char>(last + 1));
+      return end;
+    }
+  }
+  return end;
+}
+
+std::vector<std::string> kvdefs::split_addrs(const std::string& addrs) {
+  std::vector<std::string> res;
+  std::size_t pos = 0;
+  while (pos < addrs.size()) {
+    std::size_t comma = addrs.find(',', pos);
+    if (comma == std::string::npos) comma = addrs.size();
+    if (comma > pos) res.push_back(addrs.substr(pos, comma - pos));
+    pos = comma + 1;
+  }
+  return res;
+}
+
+int kvdefs::parse_consistency(const std::string& name) {
+  if (name == "strong") return READ_STRONG;
+  if (name == "bounded") return READ_BOUNDED;
+  if (name == "index") return READ_INDEX;
+  return -1;
+}
+
+int64_t kvdefs::now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+uint64_t kvdefs::stable_hash(const std::string &data) {
+  uint64_t h = 0xCBF29CE484222325ull;
+  for (unsigned char c : data) {
+    h ^= c;
+    h *= 0x100000001B3ull;
+  }
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDull;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ull;
+  h ^= h >> 33;
+  return h;
+}
@@ -0,0 +1,369 @@
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "defines.h"
+#include "logger.h"
+#include "wal.h"
+
+namespace {
+
+const std::size_t kRecordHeaderLen = 8;
+
+// zlib's crc32, records stay well below 4GB
+uint32_t record_crc(const char *data, std::size_t len) {
+  return ::crc32(0, reinterpret_cast<const Bytef *>(data), len);
+}
+
+void put_fixed32(std::string *dst, uint32_t v) {
+  char buf[4];
+  for (int i = 0; i < 4; ++i)
+    buf[i] = static_cast<char>((v >> (8 * i)) & 0xFF);
+  dst->append(buf, 4);
+}
+
+uint32_t get_fixed32(const char *p) {
+  uint32_t v = 0;
+  for (int i = 0; i < 4; ++i)
+    v |= static_cast<uint32_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+  return v;
+}
+
+}
+
+void kvdefs::append_record(std::string *dst, const std::string &payload) {
+  dst->reserve(dst->size() + kRecordHeaderLen + payload.size());
+  put_fixed32(dst, payload.size());
+  put_fixed32(dst, record_crc(payload.data(), payload.size()));
+  *dst += payload;
+}
+
+std::size_t kvdefs::parse_records(
+    const std::string &data,
+    const std::function<bool(const char *, std::size_t)> &fn) {
+  std::size_t off = 0;
+  while (off + kRecordHeaderLen <= data.size()) {
+    uint32_t len = get_fixed32(&data[off]);
+    uint32_t crc = get_fixed32(&data[off + 4]);
+    if (off + kRecordHeaderLen + len > data.size()) break;
+
+    const char *payload = &data[off + kRecordHeaderLen];
+    if (record_crc(payload, len) != crc || !fn(payload, len)) break;
+    off += kRecordHeaderLen + len;
+  }
+  return off;
+}
+
+int kvdefs::write_fully(int fd, const char *data, std::size_t len) {
+  while (len) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int kvdefs::sync_parent_dir(const std::string &path) {
+  const std::size_t slash = path.rfind('/');
+  const std::string dir = slash == std::string::npos
+                              ? "."
+                              : slash ? path.substr(0, slash) : "/";
+  const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0) return -1;
+  int ret = fsync(fd);
+  close(fd);
+  return ret;
+}
+
+int kvdefs::read_fully(int fd, std::string *out) {
+  struct stat st;
+  if (fstat(fd, &st)) return -1;
+
+  out->assign(st.st_size, '\0');
+  std::size_t got = 0;
+  while (got < out->size()) {
+    ssize_t n = pread(fd, &(*out)[got], out->size() - got, got);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -1;
+    if (n == 0) break;
+    got += n;
+  }
+  out->resize(got);
+  return 0;
+}
+
+kvdefs::WriteAheadLog::WriteAheadLog()
+    : fd_(-1), policy_(WAL_SYNC_GROUP), appended_seq_(0), durable_seq_(0),
+      flushing_(false), failed_(false), syncs_(0), stop_(false) {}
+
+kvdefs::WriteAheadLog::~WriteAheadLog() { Close(); }
+
+int kvdefs::WriteAheadLog::Open(const std::string &path, int policy) {
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd_ < 0) {
+    KV_LOG(ERROR) << "Failed opening wal " << path << ": " << strerror(errno);
+    return -1;
+  }
+  path_ = path;
+  policy_ = policy;
+
+  if (policy_ == WAL_SYNC_PERIODIC)
+    syncer_ = std::thread(&WriteAheadLog::PeriodicSync, this);
+  return 0;
+}
+
+int kvdefs::WriteAheadLog::Replay(
+    const std::function<void(const kvStore::SyncContent &)> &fn) {
+  int count = 0;
+  std::string data;
+  // a checkpoint was in flight, its records come first
+  const int old_fd = open(RotatedPath().c_str(), O_RDONLY);
+  if (old_fd >= 0) {
+    const int ret = read_fully(old_fd, &data);
+    close(old_fd);
+    if (ret) return -1;
+    const std::size_t off =
+        parse_records(data, [&](const char *payload, std::size_t len) {
+          kvStore::SyncContent ent;
+          if (!ent.ParseFromArray(payload, len)) return false;
+          fn(ent);
+          ++count;
+          return true;
+        });
+    // it was synced whole before the rename, so this is no torn tail:
+    // going on would apply later records over a gap in the history
+    if (off < data.size()) {
+      KV_LOG(ERROR) << "wal " << RotatedPath() << ": corrupt record at offset "
+                    << off;
+      return -1;
+    }
+  } else if (errno != ENOENT) {
+    KV_LOG(ERROR) << "Failed opening wal " << RotatedPath() << ": "
+                  << strerror(errno);
+    return -1;
+  }
+
+  if (read_fully(fd_, &data)) return -1;
+  std::size_t off =
+      parse_records(data, [&](const char *payload, std::size_t len) {
+        kvStore::SyncContent ent;
+        if (!ent.ParseFromArray(payload, len)) return false;
+        fn(ent);
+        ++count;
+        return true;
+      });
+
+  if (off < data.size()) {
+    KV_LOG(WARN) << "wal " << path_ << ": dropping " << data.size() - off
+                 << " bytes of torn tail";
+    if (ftruncate(fd_, off)) return -1;
+  }
+
+  KV_LOG(INFO) << "replayed " << count << " wal records from " << path_;
+  return 0;
+}
+
+int kvdefs::WriteAheadLog::Append(const std::string &payload) {
+  return AppendBatch(&payload, 1);
+}
+
+int kvdefs::WriteAheadLog::AppendBatch(const std::string *payloads,
+                                       std::size_t count) {
+  std::size_t seq = 0;
+  if (Enqueue(payloads, count, &seq)) return -1;
+  return Sync(seq);
+}
+
+int kvdefs::WriteAheadLog::Enqueue(const std::string *payloads,
+                                   std::size_t count, std::size_t *seq) {
+  *seq = 0;
+  if (!count) return 0;
+
+  std::string recs;
+  for (std::size_t i = 0; i < count; ++i) append_record(&recs, payloads[i]);
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (failed_) return -1;
+
+  pending_ += recs;
+  appended_seq_ += count;
+  *seq = appended_seq_;
+
+  if (policy_ != WAL_SYNC_GROUP) {
+    // no fsync on the request path, just hand the bytes to the kernel
+    std::string buf;
+    buf.swap(pending_);
+    if (write_fully(fd_, buf.data(), buf.size())) {
+      failed_ = true;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int kvdefs::WriteAheadLog::Sync(std::size_t seq) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (policy_ != WAL_SYNC_GROUP) return failed_ ? -1 : 0;
+
+  // group commit: either lead a flush covering everything queued so far, or
+  // wait for the current leader and re-check
+  while (durable_seq_ < seq && !failed_) {
+    if (!flushing_) {
+      if (FlushLocked(lock)) break;
+    } else {
+      flushed_cv_.wait(lock);
+    }
+  }
+  return failed_ ? -1 : 0;
+}
+
+int kvdefs::WriteAheadLog::FlushLocked(std::unique_lock<std::mutex> &lock) {
+  flushing_ = true;
+  std::string buf;
+  buf.swap(pending_);
+  const std::size_t target = appended_seq_;
+
+  lock.unlock();
+  int ret = write_fully(fd_, buf.data(), buf.size());
+  if (!ret) ret = fdatasync(fd_);
+  ++syncs_;
+  lock.lock();
+
+  flushing_ = false;
+  if (ret) {
+    KV_LOG(ERROR) << "wal flush failed: " << strerror(errno);
+    failed_ = true;
+  } else {
+    durable_seq_ = target;
+  }
+  flushed_cv_.notify_all();
+  return ret;
+}
+
+void kvdefs::WriteAheadLog::PeriodicSync() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    stop_cv_.wait_for(lock, std::chrono::milliseconds(kWalSyncIntervalMs));
+    if (durable_seq_ == appended_seq_ || flushing_) continue;
+    const std::size_t target = appended_seq_;
+    flushing_ = true;
+    lock.unlock();
+    int ret = fdatasync(fd_);
+    ++syncs_;
+    lock.lock();
+    flushing_ = false;
+    // as in FlushLocked: the kernel may have dropped the dirty pages, a
+    // later sync succeeding says nothing about them
+    if (ret) {
+      KV_LOG(ERROR) << "wal periodic sync failed: " << strerror(errno);
+      failed_ = true;
+    } else {
+      durable_seq_ = target;
+    }
+    flushed_cv_.notify_all();
+  }
+}
+
+int kvdefs::WriteAheadLog::DrainLocked(std::unique_lock<std::mutex> &lock) {
+  while (flushing_) flushed_cv_.wait(lock);
+  if (!pending_.empty() && write_fully(fd_, pending_.data(), pending_.size()))
+    return -1;
+  pending_.clear();
+  return 0;
+}
+
+int kvdefs::WriteAheadLog::Reset() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (DrainLocked(lock)) return -1;
+  durable_seq_ = appended_seq_;
+  flushed_cv_.notify_all();
+
+  // O_APPEND puts the next record back at offset 0
+  if (ftruncate(fd_, 0) || fdatasync(fd_) ||
+      (unlink(RotatedPath().c_str()) && errno != ENOENT)) {
+    KV_LOG(ERROR) << "wal reset failed: " << strerror(errno);
+    return -1;
+  }
+  return 0;
+}
+
+int kvdefs::WriteAheadLog::Rotate() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // a failed append may have left half a record, which must not end up
+  // inside path.old
+  if (failed_) return -1;
+  if (access(RotatedPath().c_str(), F_OK) == 0) return 0;
+  ++syncs_;
+  if (DrainLocked(lock) || fdatasync(fd_)) {
+    KV_LOG(ERROR) << "wal rotate failed: " << strerror(errno);
+    return -1;
+  }
+  durable_seq_ = appended_seq_;
+  flushed_cv_.notify_all();
+
+  if (rename(path_.c_str(), RotatedPath().c_str())) {
+    KV_LOG(ERROR) << "wal rotate failed: " << strerror(errno);
+    return -1;
+  }
+  const int fd = open(path_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    // put the records back where appends go on
+    KV_LOG(ERROR) << "Failed opening wal " << path_ << ": " << strerror(errno);
+    rename(RotatedPath().c_str(), path_.c_str());
+    return -1;
+  }
+  close(fd_);
+  fd_ = fd;
+  // one directory sync covers the rename and the new file
+  if (sync_parent_dir(path_)) {
+    KV_LOG(ERROR) << "wal rotate failed: " << strerror(errno);
+    failed_ = true;
+    return -1;
+  }
+  return 0;
+}
+
+int kvdefs::WriteAheadLog::DropRotated() {
+  if (unlink(RotatedPath().c_str()) && errno != ENOENT) {
+    KV_LOG(ERROR) << "Failed dropping " << RotatedPath() << ": "
+                  << strerror(errno);
+    return -1;
+  }
+  return 0;
+}
+
+void kvdefs::WriteAheadLog::Close() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+  }
+  stop_cv_.notify_all();
+  if (syncer_.joinable()) syncer_.join();
+
+  if (fd_ < 0) return;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (flushing_) flushed_cv_.wait(lock);
+  if (!pending_.empty()) write_fully(fd_, pending_.data(), pending_.size());
+  pending_.clear();
+  fdatasync(fd_);
+  close(fd_);
+  fd_ = -1;
+}
+
+int kvdefs::parse_wal_sync_policy(const std::string &name) {
+  if (name == "none") return WAL_SYNC_NONE;
+  if (name == "group") return WAL_SYNC_GROUP;
+  if (name == "periodic") return WAL_SYNC_PERIODIC;
+  return -1;
+}
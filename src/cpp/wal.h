@@ -0,0 +1,105 @@
+#ifndef KVSTORE_WAL_H
+#define KVSTORE_WAL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "kvstore.pb.h"
+
+namespace kvdefs {
+
+// Append-only on-disk log of SyncContent records.
+//
+// Record layout: [u32 payload length][u32 crc32 of payload][payload], where
+// payload is the serialized SyncContent. A torn or corrupted tail found on
+// replay is cut off so later appends start from a clean record boundary.
+//
+// With WAL_SYNC_GROUP, records are queued in memory and whoever waits in
+// Sync while no flush is in progress becomes the leader: it writes and
+// fsyncs every queued record at once, then wakes the rest. Callers queue
+// under their own lock to keep records in log order and Sync after
+// dropping it, so records queued while one flush runs share the next.
+//
+// Rotate moves the records so far aside to path.old, so a checkpoint taken
+// off the write path can drop exactly them once it is on disk, while new
+// records go on to path. Replay reads both, the older ones first.
+class WriteAheadLog {
+public:
+  WriteAheadLog();
+  ~WriteAheadLog();
+
+  int Open(const std::string &path, int policy);
+  int Replay(const std::function<void(const kvStore::SyncContent &)> &fn);
+  // Append a serialized SyncContent, returns once the record is durable
+  // according to the sync policy
+  int Append(const std::string &payload);
+  // same, for count records that are written and synced together
+  int AppendBatch(const std::string *payloads, std::size_t count);
+  // queue count records behind the ones before them without waiting, *seq
+  // is what to hand Sync for them to be durable
+  int Enqueue(const std::string *payloads, std::size_t count,
+              std::size_t *seq);
+  // returns once the records queued up to seq are durable according to the
+  // sync policy
+  int Sync(std::size_t seq);
+  // drop every record, used once a snapshot covers the whole log
+  int Reset();
+  // set the records so far aside in path.old; if the ones of an earlier
+  // rotation are still there, keep appending to path instead
+  int Rotate();
+  // drop what Rotate set aside, once a checkpoint covers it
+  int DropRotated();
+  void Close();
+
+  bool IsOpen() const { return fd_ >= 0; }
+  // fdatasync calls so far
+  uint64_t SyncCount() const { return syncs_; }
+
+private:
+  int FlushLocked(std::unique_lock<std::mutex> &lock);
+  // write out pending_ once no flush is running, 0 on success
+  int DrainLocked(std::unique_lock<std::mutex> &lock);
+  std::string RotatedPath() const { return path_ + ".old"; }
+  void PeriodicSync();
+
+  int fd_;
+  int policy_;
+  std::string path_;
+
+  std::mutex mutex_;
+  std::condition_variable flushed_cv_;
+  std::string pending_;       // records not yet handed to write(2)
+  std::size_t appended_seq_;  // number of records appended so far
+  std::size_t durable_seq_;   // records known to be on disk
+  bool flushing_;  // a flush or periodic sync is using fd_ unlocked
+  bool failed_;
+  std::atomic<uint64_t> syncs_;
+
+  bool stop_;
+  std::condition_variable stop_cv_;
+  std::thread syncer_;
+};
+
+int parse_wal_sync_policy(const std::string &name);
+
+// [u32 len][u32 crc32][payload] framing shared by wal and snapshot files
+void append_record(std::string *dst, const std::string &payload);
+// feeds each intact record to fn until fn refuses one or the data runs out,
+// returns the number of bytes consumed
+std::size_t parse_records(
+    const std::string &data,
+    const std::function<bool(const char *, std::size_t)> &fn);
+
+int write_fully(int fd, const char *data, std::size_t len);
+int read_fully(int fd, std::string *out);
+// fsyncs the directory holding path, so a rename or create of path in it
+// survives a crash
+int sync_parent_dir(const std::string &path);
+
+}
+
+#endif
@@ -0,0 +1,238 @@
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "defines.h"
+#include "test_util.h"
+#include "wal.h"
+
+namespace {
+
+std::string entry(int64_t index) {
+  kvStore::SyncContent ent;
+  ent.set_index(index);
+  ent.mutable_req()->set_key("key" + std::to_string(index));
+  ent.mutable_req()->set_value(std::string(index % 7 * 10, 'v'));
+  return ent.SerializeAsString();
+}
+
+// opens path and replays it, the indices of the records come out in *indices
+int replay(const std::string &path, std::vector<int64_t> *indices,
+           int policy = kvdefs::WAL_SYNC_GROUP) {
+  indices->clear();
+  kvdefs::WriteAheadLog wal;
+  if (wal.Open(path, policy)) return -1;
+  return wal.Replay([indices](const kvStore::SyncContent &ent) {
+    indices->push_back(ent.index());
+  });
+}
+
+std::vector<int64_t> range(int64_t first, int64_t last) {
+  std::vector<int64_t> indices;
+  for (int64_t i = first; i < last; ++i) indices.push_back(i);
+  return indices;
+}
+
+void TestRecordFraming() {
+  std::string data;
+  kvdefs::append_record(&data, entry(1));
+  const std::size_t first = data.size();
+  kvdefs::append_record(&data, entry(2));
+  KV_CHECK(first == 8 + entry(1).size());
+
+  std::vector<std::string> seen;
+  auto collect = [&seen](const char *payload, std::size_t len) {
+    seen.emplace_back(payload, len);
+    return true;
+  };
+  KV_CHECK(kvdefs::parse_records(data, collect) == data.size());
+  KV_CHECK(seen.size() == 2 && seen[0] == entry(1) && seen[1] == entry(2));
+
+  // a flipped payload byte fails the crc, parsing stops before the record
+  std::string corrupt = data;
+  corrupt[first + 8] ^= 0x20;
+  seen.clear();
+  KV_CHECK(kvdefs::parse_records(corrupt, collect) == first);
+  KV_CHECK(seen.size() == 1);
+
+  // so does a length running past the data and half a header
+  seen.clear();
+  KV_CHECK(kvdefs::parse_records(data.substr(0, data.size() - 1), collect) ==
+           first);
+  KV_CHECK(kvdefs::parse_records(data.substr(0, first + 5), collect) == first);
+
+  // fn refusing a record stops there too
+  KV_CHECK(kvdefs::parse_records(data, [](const char *, std::size_t) {
+             return false;
+           }) == 0);
+}
+
+void TestTornTail() {
+  kvdefs::TestDir dir;
+  KV_CHECK(dir.ok());
+  const std::string path = dir.File("wal");
+  {
+    kvdefs::WriteAheadLog wal;
+    KV_CHECK(wal.Open(path, kvdefs::WAL_SYNC_GROUP) == 0);
+    for (int64_t i = 1; i <= 3; ++i) KV_CHECK(wal.Append(entry(i)) == 0);
+  }
+  const std::string clean = kvdefs::read_file(path);
+
+  // a crash halfway through the fourth record
+  std::string torn;
+  kvdefs::append_record(&torn, entry(4));
+  kvdefs::write_file(path, clean + torn.substr(0, torn.size() / 2));
+
+  std::vector<int64_t> indices;
+  KV_CHECK(replay(path, &indices) == 0);
+  KV_CHECK(indices == range(1, 4));
+  KV_CHECK(kvdefs::read_file(path) == clean);
+
+  // appends after the cut start on a record boundary
+  {
+    kvdefs::WriteAheadLog wal;
+    KV_CHECK(wal.Open(path, kvdefs::WAL_SYNC_GROUP) == 0);
+    KV_CHECK(wal.Replay([](const kvStore::SyncContent &) {}) == 0);
+    KV_CHECK(wal.Append(entry(4)) == 0);
+  }
+  KV_CHECK(replay(path, &indices) == 0);
+  KV_CHECK(indices == range(1, 5));
+
+  // a corrupt record in the middle ends the replay there as well
+  std::string data = kvdefs::read_file(path);
+  data[clean.size() - 1] ^= 0x01;
+  kvdefs::write_file(path, data);
+  KV_CHECK(replay(path, &indices) == 0);
+  KV_CHECK(indices == range(1, 3));
+}
+
+void TestGroupCommit() {
+  kvdefs::TestDir dir;
+  KV_CHECK(dir.ok());
+  const std::string path = dir.File("wal");
+  {
+    kvdefs::WriteAheadLog wal;
+    KV_CHECK(wal.Open(path, kvdefs::WAL_SYNC_GROUP) == 0);
+
+    // records queued before a Sync share its flush
+    std::size_t seq = 0;
+    for (int64_t i = 1; i <= 3; ++i) {
+      const std::string payload = entry(i);
+      KV_CHECK(wal.Enqueue(&payload, 1, &seq) == 0);
+      KV_CHECK(seq == std::size_t(i));
+    }
+    KV_CHECK(wal.SyncCount() == 0);
+    KV_CHECK(wal.Sync(seq) == 0);
+    KV_CHECK(wal.SyncCount() == 1);
+    // and a Sync for records already durable does not flush again
+    KV_CHECK(wal.Sync(2) == 0);
+    KV_CHECK(wal.SyncCount() == 1);
+
+    const std::string batch[] = {entry(4), entry(5)};
+    KV_CHECK(wal.AppendBatch(batch, 2) == 0);
+    KV_CHECK(wal.SyncCount() == 2);
+
+    // concurrent appenders, each queueing in order under one lock as the
+    // datanode does, never lose or reorder a record
+    const int kThreads = 4;
+    const int kPerThread = 200;
+    std::mutex order;
+    int64_t next = 6;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([&]() {
+        for (int n = 0; n < kPerThread; ++n) {
+          std::size_t seq = 0;
+          {
+            std::lock_guard<std::mutex> guard(order);
+            const std::string payload = entry(next++);
+            KV_CHECK(wal.Enqueue(&payload, 1, &seq) == 0);
+          }
+          KV_CHECK(wal.Sync(seq) == 0);
+        }
+      });
+    }
+    for (auto &t : threads) t.join();
+    KV_CHECK(wal.SyncCount() <= 2 + kThreads * kPerThread);
+  }
+  std::vector<int64_t> indices;
+  KV_CHECK(replay(path, &indices) == 0);
+  KV_CHECK(indices == range(1, 6 + 4 * 200));
+
+  // without group commit records still reach the file in order
+  const std::string none = dir.File("wal.none");
+  {
+    kvdefs::WriteAheadLog wal;
+    KV_CHECK(wal.Open(none, kvdefs::WAL_SYNC_NONE) == 0);
+    for (int64_t i = 1; i <= 3; ++i) KV_CHECK(wal.Append(entry(i)) == 0);
+    KV_CHECK(wal.SyncCount() == 0);
+  }
+  KV_CHECK(replay(none, &indices, kvdefs::WAL_SYNC_NONE) == 0);
+  KV_CHECK(indices == range(1, 4));
+}
+
+void TestRotate() {
+  kvdefs::TestDir dir;
+  KV_CHECK(dir.ok());
+  const std::string path = dir.File("wal");
+  const std::string old = path + ".old";
+  {
+    kvdefs::WriteAheadLog wal;
+    KV_CHECK(wal.Open(path, kvdefs::WAL_SYNC_GROUP) == 0);
+    KV_CHECK(wal.Append(entry(1)) == 0);
+    KV_CHECK(wal.Append(entry(2)) == 0);
+    KV_CHECK(wal.Rotate() == 0);
+    KV_CHECK(kvdefs::file_exists(old));
+    KV_CHECK(wal.Append(entry(3)) == 0);
+    // the first rotation is still there, so records stay in path
+    KV_CHECK(wal.Rotate() == 0);
+    KV_CHECK(wal.Append(entry(4)) == 0);
+  }
+  // the rotated records replay first
+  std::vector<int64_t> indices;
+  KV_CHECK(replay(path, &indices) == 0);
+  KV_CHECK(indices == range(1, 5));
+
+  // a corrupt record in path.old is no torn tail, replay refuses it
+  const std::string rotated = kvdefs::read_file(old);
+  std::string corrupt = rotated;
+  corrupt[corrupt.size() - 1] ^= 0x01;
+  kvdefs::write_file(old, corrupt);
+  KV_CHECK(replay(path, &indices) == -1);
+  KV_CHECK(kvdefs::read_file(old) == corrupt);
+  kvdefs::write_file(old, rotated);
+
+  {
+    kvdefs::WriteAheadLog wal;
+    KV_CHECK(wal.Open(path, kvdefs::WAL_SYNC_GROUP) == 0);
+    KV_CHECK(wal.DropRotated() == 0);
+    KV_CHECK(!kvdefs::file_exists(old));
+    // nothing left to drop is fine
+    KV_CHECK(wal.DropRotated() == 0);
+  }
+  KV_CHECK(replay(path, &indices) == 0);
+  KV_CHECK(indices == range(3, 5));
+
+  {
+    kvdefs::WriteAheadLog wal;
+    KV_CHECK(wal.Open(path, kvdefs::WAL_SYNC_GROUP) == 0);
+    KV_CHECK(wal.Rotate() == 0);
+    KV_CHECK(wal.Append(entry(5)) == 0);
+    KV_CHECK(wal.Reset() == 0);
+    KV_CHECK(!kvdefs::file_exists(old));
+    KV_CHECK(wal.Append(entry(6)) == 0);
+  }
+  KV_CHECK(replay(path, &indices) == 0);
+  KV_CHECK(indices == range(6, 7));
+}
+
+}
+
+int main() {
+  TestRecordFraming();
+  TestTornTail();
+  TestGroupCommit();
+  TestRotate();
+  return kvdefs::test_failures() ? 1 : 0;
+}